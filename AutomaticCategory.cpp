@@ -7,18 +7,61 @@
 #include "AutomaticCategory.h"
 
 #include "Capability.h"
+#include "ConcurrentSynthAccess.h"
 #include "Patch.h"
 #include "PatchHolder.h"
 #include "StoredTagCapability.h"
 
 #include "BinaryResources.h"
 #include "RapidjsonHelper.h"
+#include "TaskScheduler.h"
+#include "Trace.h"
 
 #include <boost/format.hpp>
 
+#include <algorithm>
+
 namespace midikraft {
 
-	AutomaticCategory::AutomaticCategory(std::vector<Category> existingCats)
+	namespace {
+
+		bool parseParameterRule(rapidjson::Value const &ruleObject, ParameterRule &outRule) {
+			// Expected format: { "synth": "Name of synth", "parameters": [ { "byte": 17, "mask": 112, "shift": 4, "op": "==", "value": 2 }, ... ] }
+			static const std::map<std::string, BytePredicate::Op> kOperators = {
+				{ "==", BytePredicate::Op::EQUAL }, { "!=", BytePredicate::Op::NOT_EQUAL },
+				{ "<", BytePredicate::Op::LESS }, { "<=", BytePredicate::Op::LESS_EQUAL },
+				{ ">", BytePredicate::Op::GREATER }, { ">=", BytePredicate::Op::GREATER_EQUAL }
+			};
+			if (!ruleObject.HasMember("synth") || !ruleObject["synth"].IsString() || !ruleObject.HasMember("parameters") || !ruleObject["parameters"].IsArray()) {
+				return false;
+			}
+			outRule.synthName = ruleObject["synth"].GetString();
+			outRule.predicates.clear();
+			for (auto const &p : ruleObject["parameters"].GetArray()) {
+				if (!p.IsObject() || !p.HasMember("byte") || !p["byte"].IsUint() || !p.HasMember("value") || !p["value"].IsInt()) {
+					return false;
+				}
+				BytePredicate predicate{ p["byte"].GetUint(), 0xff, 0, BytePredicate::Op::EQUAL, p["value"].GetInt() };
+				if (p.HasMember("mask")) {
+					if (!p["mask"].IsUint() || p["mask"].GetUint() > 0xff) return false;
+					predicate.mask = (uint8)p["mask"].GetUint();
+				}
+				if (p.HasMember("shift")) {
+					if (!p["shift"].IsUint() || p["shift"].GetUint() > 7) return false;
+					predicate.shift = (int)p["shift"].GetUint();
+				}
+				if (p.HasMember("op")) {
+					if (!p["op"].IsString() || kOperators.find(p["op"].GetString()) == kOperators.end()) return false;
+					predicate.op = kOperators.find(p["op"].GetString())->second;
+				}
+				outRule.predicates.push_back(predicate);
+			}
+			return !outRule.predicates.empty();
+		}
+
+	}
+
+	AutomaticCategory::AutomaticCategory(std::vector<Category> existingCats) : nameCache_(std::make_shared<BudgetedLruCache<std::string, std::set<Category>>>("Name categories"))
 	{
 		if (autoCategoryFileExists()) {
 			SimpleLogger::instance()->postMessageOncePerRun((boost::format("Overriding built-in automatic category rules with file %s") % getAutoCategoryFile().getFullPathName().toStdString()).str());
@@ -43,28 +86,120 @@ namespace midikraft {
 		return importMappings_;
 	}
 
+	AutomaticCategory::AutomaticCategory(AutomaticCategory const &other) : predefinedCategories_(other.predefinedCategories_), importMappings_(other.importMappings_),
+		exportMappings_(other.exportMappings_), nameCache_(std::make_shared<BudgetedLruCache<std::string, std::set<Category>>>("Name categories"))
+	{
+	}
+
+	AutomaticCategory &AutomaticCategory::operator=(AutomaticCategory const &other)
+	{
+		if (this != &other) {
+			predefinedCategories_ = other.predefinedCategories_;
+			importMappings_ = other.importMappings_;
+			exportMappings_ = other.exportMappings_;
+			nameCache_->clear();
+		}
+		return *this;
+	}
+
 	std::set<Category> AutomaticCategory::determineAutomaticCategories(PatchHolder const &patch)
 	{
+		MIDIKRAFT_TRACE_SCOPE("AutomaticCategory::determineAutomaticCategories", "categorize");
 		std::set <Category> result;
 
 		// First step, the synth might support stored categories
+		storedTagCategories(patch, result);
+
+		if (result.empty()) {
+			// Second step, if we have no category yet, try to detect the category from the name using the regex rule set stored in the file automatic_categories.jsonc
+			nameCategories(patch.name(), result);
+			// and from the parameter rules defined for this synth
+			parameterCategories(patch, result);
+		}
+		return result;
+	}
+
+	std::vector<std::set<Category>> AutomaticCategory::determineAutomaticCategories(std::vector<PatchHolder> const &patches)
+	{
+		MIDIKRAFT_TRACE_SCOPE("AutomaticCategory::determineAutomaticCategories (batch)", "categorize");
+		std::vector<std::set<Category>> result(patches.size());
+		std::vector<uint8> needsRules(patches.size(), 0);
+		// The stored tags come from the adaptation, so patches of synths not allowing concurrent access are done one by one
+		parallelForSynths(TaskScheduler::Priority::CATEGORIZATION, patches.size(), [&](size_t i) { return patches[i].synth(); }, [&](size_t i) {
+			storedTagCategories(patches[i], result[i]);
+			if (result[i].empty()) {
+				nameCategories(patches[i].name(), result[i]);
+				needsRules[i] = 1;
+			}
+		});
+
+		// Group the patches by synth, so we can evaluate the parameter rules column by column
+		MIDIKRAFT_TRACE_SCOPE("Parameter rules", "categorize");
+		std::map<std::string, std::vector<size_t>> rowsPerSynth;
+		for (size_t i = 0; i < patches.size(); i++) {
+			if (needsRules[i] && patches[i].synth() && patches[i].patch()) {
+				rowsPerSynth[patches[i].synth()->getName()].push_back(i);
+			}
+		}
+		for (auto const &synthRows : rowsPerSynth) {
+			std::vector<std::vector<uint8>> data; // Fetched lazily, only if there is any rule for this synth
+			auto const &rows = synthRows.second;
+			for (auto const &rule : predefinedCategories_) {
+				for (auto const &parameterRule : rule.parameterMatchers_) {
+					if (parameterRule.synthName != synthRows.first) {
+						continue;
+					}
+					if (data.empty()) {
+						data.reserve(rows.size());
+						for (auto row : rows) {
+							data.push_back(patches[row].patch()->data());
+						}
+					}
+					std::vector<uint8> matches(rows.size(), 1);
+					std::vector<uint8> column(rows.size());
+					for (auto const &predicate : parameterRule.predicates) {
+						for (size_t r = 0; r < rows.size(); r++) {
+							if (predicate.byteIndex < data[r].size()) {
+								column[r] = data[r][predicate.byteIndex];
+							}
+							else {
+								column[r] = 0;
+								matches[r] = 0;
+							}
+						}
+						predicate.evaluate(column, matches);
+					}
+					for (size_t r = 0; r < rows.size(); r++) {
+						if (matches[r]) {
+							result[rows[r]].insert(rule.category_);
+						}
+					}
+				}
+			}
+		}
+		return result;
+	}
+
+	void AutomaticCategory::storedTagCategories(PatchHolder const &patch, std::set<Category> &outCategories) const
+	{
 		auto storedTags = midikraft::Capability::hasCapability<StoredTagCapability>(patch.patch());
 		if (storedTags) {
 			// Ah, that synth supports storing tags in the patch data itself, nice! Let's see if we can use them
 			auto tags = storedTags->tags();
-			auto mappings = importMappings();
 			std::string synthname = patch.synth()->getName();
+			auto mapping = importMappings_.find(synthname);
 			for (auto tag : tags) {
 				// Let's see if we can map it
-				if (mappings.find(synthname) != mappings.end()) {
-					if (mappings[synthname].find(tag.name()) != mappings[synthname].end()) {
-						std::string categoryName = mappings[synthname][tag.name()];
+				if (mapping != importMappings_.end()) {
+					auto tagMapping = mapping->second.find(tag.name());
+					if (tagMapping != mapping->second.end()) {
+						std::string categoryName = tagMapping->second;
 						if (categoryName != "None") {
 							bool found = false;
-							for (auto cat : predefinedCategories_) {
+							for (auto const &cat : predefinedCategories_) {
 								if (cat.category().category() == categoryName) {
 									// That's us!
-									result.insert(cat.category());
+									outCategories.insert(cat.category());
 									found = true;
 								}
 							}
@@ -82,32 +217,119 @@ namespace midikraft {
 				}
 			}
 		}
+	}
 
-		if (result.empty()) {
-			// Second step, if we have no category yet, try to detect the category from the name using the regex rule set stored in the file automatic_categories.jsonc
-			for (auto autoCat : predefinedCategories_) {
-				for (auto matcher : autoCat.patchNameMatchers_) {
-					bool found = std::regex_search(patch.name(), matcher);
-					if (found) {
-						result.insert(autoCat.category_);
+	void AutomaticCategory::nameCategories(std::string const &patchName, std::set<Category> &outCategories) const
+	{
+		MIDIKRAFT_TRACE_SCOPE("Name rules", "categorize");
+		std::set<Category> categories;
+		if (nameCache_->get(patchName, categories)) {
+			outCategories.insert(categories.begin(), categories.end());
+			return;
+		}
+		double start = Time::getMillisecondCounterHiRes();
+		for (auto const &autoCat : predefinedCategories_) {
+			for (auto const &matcher : autoCat.nameMatchers_) {
+				if (matcher.search(patchName)) {
+					categories.insert(autoCat.category_);
+				}
+			}
+		}
+		// Cost is the time the rules took in microseconds, the size a rough estimate of string, set nodes and list entry
+		double micros = (Time::getMillisecondCounterHiRes() - start) * 1000.0;
+		int64 bytes = (int64)(sizeof(std::string) + patchName.capacity() + categories.size() * (sizeof(Category) + 32) + 64);
+		nameCache_->put(patchName, categories, bytes, micros);
+		outCategories.insert(categories.begin(), categories.end());
+	}
+
+	void AutomaticCategory::parameterCategories(PatchHolder const &patch, std::set<Category> &outCategories) const
+	{
+		if (!patch.synth() || !patch.patch()) {
+			return;
+		}
+		std::string synthname = patch.synth()->getName();
+		std::vector<uint8> data;
+		for (auto const &autoCat : predefinedCategories_) {
+			for (auto const &parameterRule : autoCat.parameterMatchers_) {
+				if (parameterRule.synthName == synthname) {
+					if (data.empty()) {
+						data = patch.patch()->data();
+					}
+					if (std::all_of(parameterRule.predicates.cbegin(), parameterRule.predicates.cend(), [&data](BytePredicate const &predicate) { return predicate.matches(data); })) {
+						outCategories.insert(autoCat.category_);
 					}
 				}
 			}
 		}
-		return result;
+	}
+
+	bool BytePredicate::matches(std::vector<uint8> const &data) const
+	{
+		if (byteIndex >= data.size()) {
+			return false;
+		}
+		int parameter = (data[byteIndex] & mask) >> shift;
+		switch (op) {
+		case Op::EQUAL: return parameter == value;
+		case Op::NOT_EQUAL: return parameter != value;
+		case Op::LESS: return parameter < value;
+		case Op::LESS_EQUAL: return parameter <= value;
+		case Op::GREATER: return parameter > value;
+		case Op::GREATER_EQUAL: return parameter >= value;
+		}
+		return false;
+	}
+
+	void BytePredicate::evaluate(std::vector<uint8> &column, std::vector<uint8> &matches) const
+	{
+		// Simple loops over contiguous bytes with the switch outside, so the compiler can vectorize them
+		jassert(column.size() == matches.size());
+		size_t rows = column.size();
+		uint8 *c = column.data();
+		uint8 *m = matches.data();
+		for (size_t i = 0; i < rows; i++) {
+			c[i] = (uint8)((c[i] & mask) >> shift);
+		}
+		// All values of the column are 0..255, so clamping the comparison value keeps the semantics for out of range values
+		int v = std::min(256, std::max(-1, value));
+		switch (op) {
+		case Op::EQUAL: for (size_t i = 0; i < rows; i++) m[i] &= (uint8)(c[i] == v); break;
+		case Op::NOT_EQUAL: for (size_t i = 0; i < rows; i++) m[i] &= (uint8)(c[i] != v); break;
+		case Op::LESS: for (size_t i = 0; i < rows; i++) m[i] &= (uint8)(c[i] < v); break;
+		case Op::LESS_EQUAL: for (size_t i = 0; i < rows; i++) m[i] &= (uint8)(c[i] <= v); break;
+		case Op::GREATER: for (size_t i = 0; i < rows; i++) m[i] &= (uint8)(c[i] > v); break;
+		case Op::GREATER_EQUAL: for (size_t i = 0; i < rows; i++) m[i] &= (uint8)(c[i] >= v); break;
+		}
 	}
 
 	AutoCategoryRule::AutoCategoryRule(Category category, std::vector<std::string> const &regexes) :
-		category_(category)
+		category_(category), memory_(MemoryAccounting::Kind::REGEX)
 	{
 		for (auto regex : regexes) {
-			patchNameMatchers_.push_back(std::regex(regex, std::regex::icase));
+			LinearRegex matcher(regex, false);
+			if (matcher.isValid()) {
+				nameMatchers_.push_back(matcher);
+			}
+			else {
+				SimpleLogger::instance()->postMessage((boost::format("Disabling rule '%s' for category %s: %s") % regex % category.category() % matcher.error()).str());
+			}
 		}
+		updateAccounting();
 	}
 
-	AutoCategoryRule::AutoCategoryRule(Category category, std::vector<std::regex> const &regexes) :
-		category_(category), patchNameMatchers_(regexes)
+	AutoCategoryRule::AutoCategoryRule(Category category, std::vector<LinearRegex> const &regexes, std::vector<ParameterRule> const &parameterRules) :
+		category_(category), nameMatchers_(regexes), parameterMatchers_(parameterRules), memory_(MemoryAccounting::Kind::REGEX)
 	{
+		updateAccounting();
+	}
+
+	void AutoCategoryRule::updateAccounting()
+	{
+		size_t bytes = 0;
+		for (auto const &matcher : nameMatchers_) {
+			bytes += matcher.memoryUsage();
+		}
+		memory_.setBytes((int64)bytes);
 	}
 
 	Category AutoCategoryRule::category() const
@@ -117,7 +339,28 @@ namespace midikraft {
 
 	std::vector<std::regex> AutoCategoryRule::patchNameMatchers() const
 	{
-		return patchNameMatchers_;
+		// For callers that need std::regex, only used for display and editing, never to categorize
+		std::vector<std::regex> result;
+		for (auto const &matcher : nameMatchers_) {
+			try {
+				result.push_back(std::regex(matcher.pattern(), matcher.isCaseSensitive() ? std::regex_constants::ECMAScript : std::regex::icase));
+			}
+			catch (std::regex_error &) {
+				// The linear engine is a subset of ECMAScript, so this should not happen
+				jassertfalse;
+			}
+		}
+		return result;
+	}
+
+	std::vector<LinearRegex> AutoCategoryRule::nameMatchers() const
+	{
+		return nameMatchers_;
+	}
+
+	std::vector<ParameterRule> AutoCategoryRule::parameterMatchers() const
+	{
+		return parameterMatchers_;
 	}
 
 	void AutomaticCategory::loadFromFile(std::vector<Category> existingCats, std::string fullPathToJson)
@@ -137,18 +380,39 @@ namespace midikraft {
 		if (doc.IsObject()) {
 			// Replace the hard-coded values with those read from the JSON file
 			predefinedCategories_.clear();
+			nameCache_->clear();
 
 			auto obj = doc.GetObject();
 			for (auto member = obj.MemberBegin(); member != obj.MemberEnd(); member++) {
 				auto categoryName = member->name.GetString();
-				std::vector<std::regex> regexes;
+				std::vector<LinearRegex> regexes;
+				std::vector<ParameterRule> parameterRules;
+				auto addRegex = [&regexes, categoryName](std::string const &pattern, bool caseSensitive) {
+					LinearRegex matcher(pattern, caseSensitive);
+					if (matcher.isValid()) {
+						regexes.push_back(matcher);
+					}
+					else {
+						SimpleLogger::instance()->postMessage((boost::format("Disabling rule '%s' for category %s: %s") % pattern % categoryName % matcher.error()).str());
+					}
+				};
 				if (member->value.IsArray()) {
 					auto a = member->value.GetArray();
 					for (auto s = a.Begin(); s != a.End(); s++) {
 
 						if (s->IsString()) {
 							// Simple Regex
-							regexes.push_back(std::regex(s->GetString(), std::regex::icase));
+							addRegex(s->GetString(), false);
+						}
+						else if (s->IsObject() && s->HasMember("parameters")) {
+							// Name independent rule on the patch data of a specific synth
+							ParameterRule rule;
+							if (parseParameterRule(*s, rule)) {
+								parameterRules.push_back(rule);
+							}
+							else {
+								SimpleLogger::instance()->postMessage((boost::format("Ignoring invalid parameter rule for category %s") % categoryName).str());
+							}
 						}
 						else if (s->IsObject()) {
 							bool case_sensitive = false;
@@ -162,7 +426,7 @@ namespace midikraft {
 							if (s->HasMember("regex")) {
 								auto regex = s->FindMember("regex");
 								if (regex->value.IsString()) {
-									regexes.push_back(std::regex(s->GetString(), case_sensitive ? std::regex_constants::ECMAScript : (std::regex::icase)));
+									addRegex(regex->value.GetString(), case_sensitive);
 								}
 							}
 						}
@@ -172,7 +436,7 @@ namespace midikraft {
 				bool found = false;
 				for (auto existing : existingCats) {
 					if (existing.category() == categoryName) {
-						AutoCategoryRule cat(existing, regexes);
+						AutoCategoryRule cat(existing, regexes, parameterRules);
 						predefinedCategories_.push_back(cat);
 						found = true;
 						break;
@@ -197,10 +461,27 @@ namespace midikraft {
 		if (doc.IsObject()) {
 			// Replace the hard-coded values with those read from the JSON file
 			importMappings_.clear();
+			std::map<std::string, std::map<std::string, std::string>> explicitExports;
 
 			auto obj = doc.GetObject();
 			for (auto member = obj.MemberBegin(); member != obj.MemberEnd(); member++) {
 				std::string synth = member->name.GetString();
+				if (member->value.HasMember("databaseToSynth")) {
+					auto exportMap = member->value.FindMember("databaseToSynth");
+					if (exportMap->value.IsObject()) {
+						for (auto s = exportMap->value.MemberBegin(); s != exportMap->value.MemberEnd(); s++) {
+							if (s->name.IsString() && s->value.IsString()) {
+								explicitExports[synth][s->name.GetString()] = s->value.GetString();
+							}
+							else {
+								SimpleLogger::instance()->postMessage("Invalid JSON input - need to map strings to strings only");
+							}
+						}
+					}
+					else {
+						SimpleLogger::instance()->postMessage("Invalid JSON input - need to supply map object");
+					}
+				}
 				if (member->value.HasMember("synthToDatabase")) {
 					std::map<std::string, std::string> mapping;
 					auto importMap = member->value.FindMember("synthToDatabase");
@@ -222,7 +503,101 @@ namespace midikraft {
 					}
 				}
 			}
+			compileExportMappings(explicitExports);
+		}
+	}
+
+	void AutomaticCategory::compileExportMappings(std::map<std::string, std::map<std::string, std::string>> const &explicitExports)
+	{
+		exportMappings_.clear();
+		for (auto const &synthMapping : importMappings_) {
+			auto &table = exportMappings_[synthMapping.first];
+			// Without an explicit databaseToSynth entry, the alphabetically smallest tag mapping to the category is used, as the mapping is
+			// a std::map and the file order is lost
+			for (auto const &tagToCategory : synthMapping.second) {
+				if (tagToCategory.second != "None") {
+					table.categoryTags.insert(tagToCategory.first);
+					table.tagForCategory.emplace(tagToCategory.second, tagToCategory.first);
+				}
+			}
+		}
+		for (auto const &synthMapping : explicitExports) {
+			auto &table = exportMappings_[synthMapping.first];
+			for (auto const &categoryToTag : synthMapping.second) {
+				table.tagForCategory[categoryToTag.first] = categoryToTag.second;
+				table.categoryTags.insert(categoryToTag.second);
+			}
+		}
+	}
+
+	std::vector<size_t> AutomaticCategory::writeCategoriesToStoredTags(std::vector<PatchHolder> &patches) const
+	{
+		MIDIKRAFT_TRACE_SCOPE("AutomaticCategory::writeCategoriesToStoredTags", "categorize");
+		// Holders can share their DataFile, and setTags modifies it in place. Only the first holder of each DataFile is written, so no two
+		// tasks touch the same bytes
+		std::vector<size_t> unique;
+		std::vector<size_t> duplicateOf(patches.size(), patches.size());
+		std::map<DataFile *, size_t> firstHolder;
+		for (size_t i = 0; i < patches.size(); i++) {
+			if (!patches[i].patch()) continue;
+			auto found = firstHolder.emplace(patches[i].patch().get(), i);
+			if (found.second) {
+				unique.push_back(i);
+			}
+			else {
+				duplicateOf[i] = found.first->second;
+			}
+		}
+
+		std::vector<uint8> changed(patches.size(), 0);
+		parallelForSynths(TaskScheduler::Priority::CATEGORIZATION, unique.size(), [&](size_t u) { return patches[unique[u]].synth(); }, [&](size_t u) {
+			size_t i = unique[u];
+			auto &patch = patches[i];
+			if (!patch.synth()) {
+				return;
+			}
+			auto storedTags = midikraft::Capability::hasCapability<StoredTagCapability>(patch.patch());
+			auto mapping = exportMappings_.find(patch.synth()->getName());
+			if (!storedTags || mapping == exportMappings_.end()) {
+				return;
+			}
+
+			std::set<std::string> oldTags;
+			std::set<std::string> newTags;
+			for (auto const &tag : storedTags->tags()) {
+				oldTags.insert(tag.name());
+				if (mapping->second.categoryTags.find(tag.name()) == mapping->second.categoryTags.end()) {
+					newTags.insert(tag.name());
+				}
+			}
+			for (auto const &category : patch.categories()) {
+				auto tag = mapping->second.tagForCategory.find(category.category());
+				if (tag != mapping->second.tagForCategory.end()) {
+					newTags.insert(tag->second);
+				}
+			}
+			if (newTags == oldTags) {
+				return;
+			}
+
+			std::set<Tag> tags;
+			for (auto const &name : newTags) {
+				tags.insert(Tag(name));
+			}
+			auto before = patch.patch()->data();
+			if (storedTags->setTags(tags) && patch.patch()->data() != before) {
+				changed[i] = 1;
+			}
+		});
+
+		std::vector<size_t> result;
+		for (size_t i = 0; i < changed.size(); i++) {
+			if (changed[i] || (duplicateOf[i] < patches.size() && changed[duplicateOf[i]])) {
+				result.push_back(i);
+			}
 		}
+		SimpleLogger::instance()->postMessage((boost::format("Wrote categories into the stored tags, %d of %d patches changed") % result.size() % patches.size()).str());
+		return result;
 	}
 
 	bool AutomaticCategory::autoCategoryFileExists() const
@@ -268,6 +643,12 @@ namespace midikraft {
 	void AutomaticCategory::addAutoCategory(AutoCategoryRule const &autoCat)
 	{
 		predefinedCategories_.push_back(autoCat);
+		nameCache_->clear();
+	}
+
+	void AutomaticCategory::clearNameCache()
+	{
+		nameCache_->clear();
 	}
 
 	std::string AutomaticCategory::defaultJson()
@@ -9,37 +9,81 @@
 #include "JuceHeader.h"
 
 #include "Category.h"
+#include "LinearRegex.h"
+#include "MemoryAccounting.h"
+#include "MemoryBudget.h"
 
 #include <set>
 #include <map>
 #include <regex>
+#include <unordered_map>
 
 namespace midikraft {
 
 	class PatchHolder;
 
+	// Condition on a byte or a bit field of a byte of the patch data, e.g. "byte 17, bits 4-6, equals 2"
+	struct BytePredicate {
+		enum class Op { EQUAL, NOT_EQUAL, LESS, LESS_EQUAL, GREATER, GREATER_EQUAL };
+
+		size_t byteIndex;
+		uint8 mask;
+		int shift;
+		Op op;
+		int value;
+
+		bool matches(std::vector<uint8> const &data) const;
+		// Columnar version - column contains the raw byte of each patch, matches is cleared for all rows not matching
+		void evaluate(std::vector<uint8> &column, std::vector<uint8> &matches) const;
+	};
+
+	// Name independent rule, all predicates need to match. Only used for patches of the synth given
+	struct ParameterRule {
+		std::string synthName;
+		std::vector<BytePredicate> predicates;
+	};
+
 	class AutoCategoryRule {
 	public:
+		// The patterns are compiled to LinearRegex, there is no way to categorize with a backtracking std::regex
 		AutoCategoryRule(Category category, std::vector<std::string> const &regexes);
-		AutoCategoryRule(Category category, std::vector<std::regex> const &regexes);
+		AutoCategoryRule(Category category, std::vector<LinearRegex> const &regexes, std::vector<ParameterRule> const &parameterRules);
 		Category category() const;
 
 		std::vector<std::regex> patchNameMatchers() const;
+		std::vector<LinearRegex> nameMatchers() const;
+		std::vector<ParameterRule> parameterMatchers() const;
 
 	private:
 		friend class AutomaticCategory; // Refactoring help
 
 		Category category_;
-		std::vector<std::regex> patchNameMatchers_;
+		std::vector<LinearRegex> nameMatchers_; // Evaluated in linear time, so a bad pattern can't hang an import
+		std::vector<ParameterRule> parameterMatchers_;
+		TrackedAllocation memory_;
+
+		void updateAccounting();
 	};
 
 	class AutomaticCategory {
 	public:
 		AutomaticCategory(std::vector<Category> existingCats);
+		// A copy can change its rules independently, so it gets its own name cache
+		AutomaticCategory(AutomaticCategory const &other);
+		AutomaticCategory &operator=(AutomaticCategory const &other);
 
 		std::set<Category> determineAutomaticCategories(PatchHolder const &patch);
+		// Batch version for many patches, evaluates the parameter rules in one columnar pass per synth
+		std::vector<std::set<Category>> determineAutomaticCategories(std::vector<PatchHolder> const &patches);
 		std::map<std::string, std::map<std::string, std::string>> const &importMappings();
 
+		// The reverse direction, for the synths with StoredTagCapability: rewrites the stored tags of the patches so they match the
+		// categories in the database. Tags without a category (mapped to "None" or not mapped) are kept. Runs in parallel and returns
+		// the indexes of the patches whose data bytes changed, only those need to be sent to the synth or exported again.
+		// Modifies the DataFiles of the patches in place. If several patches share a DataFile, the categories of the first one are
+		// written, and all of them are reported as changed.
+		std::vector<size_t> writeCategoriesToStoredTags(std::vector<PatchHolder> &patches) const;
+
 		void loadFromFile(std::vector<Category> existingCats, std::string fullPathToJson);
 		void loadFromString(std::vector<Category> existingCats, std::string const fileContent);
 		std::vector<AutoCategoryRule> loadedRules() const;
@@ -52,14 +96,30 @@ namespace midikraft {
 
 		void addAutoCategory(AutoCategoryRule const &autoCat);
 
+		// Drops the memoized name rule results, e.g. to measure the rules themselves and not the cache
+		void clearNameCache();
+
+		// The built-in rules and mappings, independent of the files in the user's application data directory
+		static std::string defaultJson();
+		static std::string defaultJsonMapping();
+
 	private:
-		void loadMappingFromString(std::string const fileContent);
+		void storedTagCategories(PatchHolder const &patch, std::set<Category> &outCategories) const;
+		void nameCategories(std::string const &patchName, std::set<Category> &outCategories) const;
+		void parameterCategories(PatchHolder const &patch, std::set<Category> &outCategories) const;
 
-		std::string defaultJson();
-		std::string defaultJsonMapping();
+		void loadMappingFromString(std::string const fileContent);
+		void compileExportMappings(std::map<std::string, std::map<std::string, std::string>> const &explicitExports);
 
 		std::vector<AutoCategoryRule> predefinedCategories_;
 		std::map<std::string, std::map<std::string, std::string>> importMappings_;
+		struct StoredTagExport {
+			std::unordered_map<std::string, std::string> tagForCategory; // Database category name to the tag stored in the synth
+			std::set<std::string> categoryTags; // All tags that stand for a category, these are replaced on write back
+		};
+		std::map<std::string, StoredTagExport> exportMappings_; // Per synth name
+		// Many patches share names like "Init" or "Brass 1", so the result of the name rules is memoized. Cleared when the rules change.
+		std::shared_ptr<BudgetedLruCache<std::string, std::set<Category>>> nameCache_;
 	};
 
 }
@@ -0,0 +1,281 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "BatchFileIO.h"
+
+#include "Trace.h"
+
+#ifdef MIDIKRAFT_HAS_LIBURING
+#include <liburing.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace midikraft {
+
+	namespace {
+
+		void readFilesBlocking(std::vector<File> const &files, size_t start, std::vector<SysexSpan> &result, TaskScheduler::Priority priority)
+		{
+			TaskScheduler::instance().parallelFor(priority, files.size() - start, [&](size_t i) {
+				result[start + i] = SysexSpan::fromFile(files[start + i]);
+			});
+		}
+
+		void writeFilesBlocking(std::vector<BatchFileIO::WriteRequest> const &requests, size_t start, std::vector<bool> &result, TaskScheduler::Priority priority)
+		{
+			std::vector<char> written(requests.size() - start, 0);
+			TaskScheduler::instance().parallelFor(priority, written.size(), [&](size_t i) {
+				auto const &request = requests[start + i];
+				if (request.file.existsAsFile() && !request.file.deleteFile()) {
+					return;
+				}
+				FileOutputStream out(request.file);
+				if (out.openedOk() && out.write(request.data.data(), request.data.size())) {
+					out.flush();
+					written[i] = out.getStatus().wasOk() ? 1 : 0;
+				}
+			});
+			for (size_t i = 0; i < written.size(); i++) {
+				result[start + i] = written[i] != 0;
+			}
+		}
+
+#ifdef MIDIKRAFT_HAS_LIBURING
+		// Number of files in flight per batch. Every file needs one submission queue entry per phase.
+		const unsigned kQueueDepth = 64;
+
+		class Ring {
+		public:
+			Ring() : ok_(io_uring_queue_init(kQueueDepth, &ring_, 0) == 0) {}
+			~Ring() { if (ok_) io_uring_queue_exit(&ring_); }
+
+			bool ok() const { return ok_; }
+			io_uring_sqe *next() { return io_uring_get_sqe(&ring_); }
+
+			// Submits everything queued and collects one result per entry, indexed by the user data set when queuing
+			bool submitAndWait(std::vector<int> &results) {
+				unsigned expected = (unsigned)results.size();
+				if (io_uring_submit_and_wait(&ring_, expected) < 0) {
+					return false;
+				}
+				for (unsigned done = 0; done < expected; done++) {
+					io_uring_cqe *cqe = nullptr;
+					if (io_uring_wait_cqe(&ring_, &cqe) < 0) {
+						return false;
+					}
+					results[(size_t)io_uring_cqe_get_data64(cqe)] = cqe->res;
+					io_uring_cqe_seen(&ring_, cqe);
+				}
+				return true;
+			}
+
+		private:
+			io_uring ring_;
+			bool ok_;
+		};
+
+		void closeAll(Ring &ring, std::vector<int> const &fds)
+		{
+			std::vector<int> results;
+			for (int fd : fds) {
+				if (fd >= 0) {
+					auto sqe = ring.next();
+					io_uring_prep_close(sqe, fd);
+					io_uring_sqe_set_data64(sqe, results.size());
+					results.push_back(0);
+				}
+			}
+			if (!results.empty()) {
+				ring.submitAndWait(results);
+			}
+		}
+
+		// For when the ring itself failed, then it can't be trusted with the closes either
+		void closeBlocking(std::vector<int> const &fds)
+		{
+			for (int fd : fds) {
+				if (fd >= 0) {
+					::close(fd);
+				}
+			}
+		}
+
+		// Returns false if the ring failed as a whole, then the caller falls back to blocking I/O for the rest
+		bool readBatch(Ring &ring, std::vector<File> const &files, size_t start, size_t count, std::vector<SysexSpan> &result)
+		{
+			std::vector<std::string> paths(count);
+			std::vector<int> fds(count, -1);
+			std::vector<struct statx> stats(count);
+			{
+				// Phase 1: open and stat all files of the batch
+				std::vector<int> results(count * 2, -1);
+				for (size_t i = 0; i < count; i++) {
+					paths[i] = files[start + i].getFullPathName().toStdString();
+					auto sqe = ring.next();
+					io_uring_prep_openat(sqe, AT_FDCWD, paths[i].c_str(), O_RDONLY | O_CLOEXEC, 0);
+					io_uring_sqe_set_data64(sqe, i * 2);
+					sqe = ring.next();
+					io_uring_prep_statx(sqe, AT_FDCWD, paths[i].c_str(), 0, STATX_SIZE, &stats[i]);
+					io_uring_sqe_set_data64(sqe, i * 2 + 1);
+				}
+				bool opened = ring.submitAndWait(results);
+				for (size_t i = 0; i < count; i++) {
+					fds[i] = results[i * 2];
+				}
+				if (!opened) {
+					// Some of the opens may have completed before the failure
+					closeBlocking(fds);
+					return false;
+				}
+				for (size_t i = 0; i < count; i++) {
+					if (results[i * 2 + 1] < 0 && fds[i] >= 0) {
+						// Size unknown, treat like a failed open
+						::close(fds[i]);
+						fds[i] = -1;
+					}
+				}
+			}
+
+			// Phase 2: read every file completely into its own buffer
+			std::vector<std::vector<uint8>> buffers(count);
+			std::vector<int> results;
+			std::vector<size_t> fileOfResult;
+			for (size_t i = 0; i < count; i++) {
+				if (fds[i] >= 0 && stats[i].stx_size > 0) {
+					buffers[i].resize((size_t)stats[i].stx_size);
+					auto sqe = ring.next();
+					io_uring_prep_read(sqe, fds[i], buffers[i].data(), (unsigned)buffers[i].size(), 0);
+					io_uring_sqe_set_data64(sqe, results.size());
+					results.push_back(-1);
+					fileOfResult.push_back(i);
+				}
+			}
+			bool ok = results.empty() || ring.submitAndWait(results);
+			for (size_t r = 0; ok && r < results.size(); r++) {
+				size_t i = fileOfResult[r];
+				// A short read only happens if the file changed in between, keep what we got
+				buffers[i].resize(results[r] > 0 ? (size_t)results[r] : 0);
+				result[start + i] = SysexSpan::fromVector(std::move(buffers[i]));
+			}
+
+			// Phase 3: close
+			if (ok) {
+				closeAll(ring, fds);
+			}
+			else {
+				closeBlocking(fds);
+			}
+			return ok;
+		}
+
+		bool writeBatch(Ring &ring, std::vector<BatchFileIO::WriteRequest> const &requests, size_t start, size_t count, std::vector<bool> &result)
+		{
+			std::vector<std::string> paths(count);
+			std::vector<int> fds(count, -1);
+			{
+				std::vector<int> results(count, -1);
+				for (size_t i = 0; i < count; i++) {
+					paths[i] = requests[start + i].file.getFullPathName().toStdString();
+					auto sqe = ring.next();
+					io_uring_prep_openat(sqe, AT_FDCWD, paths[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+					io_uring_sqe_set_data64(sqe, i);
+				}
+				bool opened = ring.submitAndWait(results);
+				fds = results;
+				if (!opened) {
+					// Some of the opens may have completed before the failure
+					closeBlocking(fds);
+					return false;
+				}
+			}
+
+			std::vector<int> results;
+			std::vector<size_t> fileOfResult;
+			for (size_t i = 0; i < count; i++) {
+				auto const &data = requests[start + i].data;
+				if (fds[i] >= 0) {
+					if (data.empty()) {
+						result[start + i] = true;
+						continue;
+					}
+					auto sqe = ring.next();
+					io_uring_prep_write(sqe, fds[i], data.data(), (unsigned)data.size(), 0);
+					io_uring_sqe_set_data64(sqe, results.size());
+					results.push_back(-1);
+					fileOfResult.push_back(i);
+				}
+			}
+			bool ok = results.empty() || ring.submitAndWait(results);
+			for (size_t r = 0; ok && r < results.size(); r++) {
+				size_t i = fileOfResult[r];
+				result[start + i] = results[r] == (int)requests[start + i].data.size();
+			}
+
+			if (ok) {
+				closeAll(ring, fds);
+			}
+			else {
+				closeBlocking(fds);
+			}
+			return ok;
+		}
+#endif
+
+	}
+
+	std::vector<SysexSpan> BatchFileIO::readFiles(std::vector<File> const &files, TaskScheduler::Priority priority)
+	{
+		MIDIKRAFT_TRACE_SCOPE("BatchFileIO::readFiles", "io");
+		std::vector<SysexSpan> result(files.size());
+		size_t done = 0;
+#ifdef MIDIKRAFT_HAS_LIBURING
+		Ring ring;
+		if (ring.ok()) {
+			// Each file takes two entries in the open phase
+			const size_t batchSize = kQueueDepth / 2;
+			while (done < files.size() && readBatch(ring, files, done, std::min(batchSize, files.size() - done), result)) {
+				done += std::min(batchSize, files.size() - done);
+			}
+		}
+#endif
+		if (done < files.size()) {
+			readFilesBlocking(files, done, result, priority);
+		}
+		return result;
+	}
+
+	std::vector<bool> BatchFileIO::writeFiles(std::vector<WriteRequest> const &requests, TaskScheduler::Priority priority)
+	{
+		MIDIKRAFT_TRACE_SCOPE("BatchFileIO::writeFiles", "io");
+		std::vector<bool> result(requests.size(), false);
+		size_t done = 0;
+#ifdef MIDIKRAFT_HAS_LIBURING
+		Ring ring;
+		if (ring.ok()) {
+			while (done < requests.size() && writeBatch(ring, requests, done, std::min((size_t)kQueueDepth, requests.size() - done), result)) {
+				done += std::min((size_t)kQueueDepth, requests.size() - done);
+			}
+		}
+#endif
+		if (done < requests.size()) {
+			writeFilesBlocking(requests, done, result, priority);
+		}
+		return result;
+	}
+
+	bool BatchFileIO::usesIoUring()
+	{
+#ifdef MIDIKRAFT_HAS_LIBURING
+		static const bool available = Ring().ok();
+		return available;
+#else
+		return false;
+#endif
+	}
+
+}
@@ -0,0 +1,38 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "SysexSpan.h"
+#include "TaskScheduler.h"
+
+namespace midikraft {
+
+	// Reads and writes many small files at once, e.g. the thousands of single patch .syx files of a preset collection.
+	//
+	// On Linux, when built with MIDIKRAFT_HAS_LIBURING, the opens, reads, writes and closes of a batch are each submitted as one
+	// round of io_uring requests, so the syscall cost is paid per batch and not per file. Everywhere else, or if the kernel refuses
+	// to set up a ring, the files are processed with plain blocking I/O on the TaskScheduler.
+	class BatchFileIO {
+	public:
+		struct WriteRequest {
+			File file;
+			std::vector<uint8> data;
+		};
+
+		// The result has one entry per file in the same order, an empty span for files that could not be read
+		static std::vector<SysexSpan> readFiles(std::vector<File> const &files, TaskScheduler::Priority priority = TaskScheduler::Priority::IMPORT);
+
+		// Creates or overwrites the files, returns per request whether it was written completely
+		static std::vector<bool> writeFiles(std::vector<WriteRequest> const &requests, TaskScheduler::Priority priority = TaskScheduler::Priority::EXPORT);
+
+		// True if the io_uring backend is compiled in and could be initialized on this machine
+		static bool usesIoUring();
+	};
+
+}
@@ -0,0 +1,46 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "CategoryRuleComparison.h"
+
+namespace midikraft {
+
+	CategoryRuleComparison::Report CategoryRuleComparison::compare(std::shared_ptr<AutomaticCategory> current, std::shared_ptr<AutomaticCategory> candidate, std::vector<PatchHolder> const &library)
+	{
+		// Both rule sets are evaluated with the parallel batch version, but one after the other. Both read the stored tags through the
+		// adaptations, and running them at the same time would call adaptations without ConcurrentAccessCapability concurrently
+		auto currentResult = current->determineAutomaticCategories(library);
+		auto candidateResult = candidate->determineAutomaticCategories(library);
+
+		Report report;
+		report.patchesEvaluated = library.size();
+		for (size_t i = 0; i < library.size(); i++) {
+			auto const &patch = library[i];
+			if (currentResult[i] != candidateResult[i]) {
+				for (auto const &gained : category_difference(candidateResult[i], currentResult[i])) {
+					auto &delta = report.perCategory[gained.category()];
+					delta.gained++;
+					if (delta.exampleGained.size() < kMaxExamples) {
+						delta.exampleGained.push_back(patch.name());
+					}
+				}
+				for (auto const &lost : category_difference(currentResult[i], candidateResult[i])) {
+					auto &delta = report.perCategory[lost.category()];
+					delta.lost++;
+					if (delta.exampleLost.size() < kMaxExamples) {
+						delta.exampleLost.push_back(patch.name());
+					}
+				}
+			}
+			// This is what would really happen to the patch, as user decisions are kept
+			if (patch.categoriesAfterAutoCategorization(candidateResult[i]) != patch.categories()) {
+				report.changedPatches.push_back(i);
+			}
+		}
+		return report;
+	}
+
+}
@@ -0,0 +1,41 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "AutomaticCategory.h"
+#include "PatchHolder.h"
+
+#include <map>
+
+namespace midikraft {
+
+	// Dry run of a candidate automatic_categories.jsonc rule set against the current one. Nothing in the library is modified.
+	//
+	// To create the candidate, construct an AutomaticCategory and replace its rules with loadFromString().
+	class CategoryRuleComparison {
+	public:
+		struct CategoryDelta {
+			int gained = 0;
+			int lost = 0;
+			std::vector<std::string> exampleGained; // Patch names, at most kMaxExamples
+			std::vector<std::string> exampleLost;
+		};
+
+		struct Report {
+			size_t patchesEvaluated = 0;
+			std::map<std::string, CategoryDelta> perCategory; // Only categories with changes, keyed by category name
+			std::vector<size_t> changedPatches; // Indexes of the patches whose categories autoCategorizeAgain with the candidate would change
+		};
+
+		static Report compare(std::shared_ptr<AutomaticCategory> current, std::shared_ptr<AutomaticCategory> candidate, std::vector<PatchHolder> const &library);
+
+		static const size_t kMaxExamples = 10;
+	};
+
+}
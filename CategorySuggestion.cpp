@@ -0,0 +1,162 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "CategorySuggestion.h"
+
+#include "Synth.h"
+#include "TaskScheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace midikraft {
+
+	CategorySuggestion::CategorySuggestion(int k) : k_(std::max(1, k)), budget_("Category suggestion index", MemoryAccounting::Kind::CACHE)
+	{
+	}
+
+	void CategorySuggestion::train(std::vector<PatchHolder> const &library)
+	{
+		indexes_.clear();
+
+		// Collect the training set per synth - only categories the user has confirmed are good labels
+		std::map<std::string, std::vector<std::pair<std::vector<uint8>, std::vector<Category>>>> trainingSets;
+		for (auto const &patch : library) {
+			if (!patch.synth() || !patch.patch()) continue;
+			auto confirmed = category_intersection(patch.categories(), patch.userDecisionSet());
+			if (!confirmed.empty()) {
+				trainingSets[patch.synth()->getName()].emplace_back(patch.patch()->data(), std::vector<Category>(confirmed.begin(), confirmed.end()));
+			}
+		}
+
+		for (auto const &trainingSet : trainingSets) {
+			auto const &rows = trainingSet.second;
+			size_t length = 0;
+			for (auto const &row : rows) {
+				length = std::max(length, row.first.size());
+			}
+
+			// Use the byte positions with the highest variance, constant bytes like the sysex header carry no information
+			std::vector<std::pair<double, size_t>> variances;
+			for (size_t pos = 0; pos < length; pos++) {
+				double sum = 0.0, sumSquares = 0.0;
+				for (auto const &row : rows) {
+					double value = pos < row.first.size() ? row.first[pos] : 0.0;
+					sum += value;
+					sumSquares += value * value;
+				}
+				double mean = sum / rows.size();
+				double variance = sumSquares / rows.size() - mean * mean;
+				if (variance > 0.0) {
+					variances.emplace_back(variance, pos);
+				}
+			}
+			std::sort(variances.begin(), variances.end(), [](std::pair<double, size_t> const &a, std::pair<double, size_t> const &b) { return a.first > b.first; });
+
+			SynthIndex index;
+			for (size_t i = 0; i < variances.size() && i < kMaxDimensions; i++) {
+				index.dimensions.push_back(variances[i].second);
+			}
+			std::sort(index.dimensions.begin(), index.dimensions.end());
+			if (index.dimensions.empty()) {
+				// All patches identical, nothing to learn
+				continue;
+			}
+			index.features.resize(rows.size() * index.dimensions.size());
+			for (size_t r = 0; r < rows.size(); r++) {
+				extractFeatures(rows[r].first, index.dimensions, &index.features[r * index.dimensions.size()]);
+				index.labels.push_back(rows[r].second);
+			}
+			indexes_[trainingSet.first] = std::move(index);
+		}
+
+		int64 bytes = 0;
+		for (auto const &index : indexes_) {
+			bytes += (int64)(index.second.dimensions.capacity() * sizeof(size_t) + index.second.features.capacity());
+			for (auto const &labels : index.second.labels) {
+				bytes += (int64)(sizeof(labels) + labels.capacity() * sizeof(Category));
+			}
+		}
+		budget_.setBytes(bytes, (int64)numberOfIndexedPatches());
+	}
+
+	size_t CategorySuggestion::numberOfIndexedPatches() const
+	{
+		size_t result = 0;
+		for (auto const &index : indexes_) {
+			result += index.second.labels.size();
+		}
+		return result;
+	}
+
+	void CategorySuggestion::extractFeatures(std::vector<uint8> const &data, std::vector<size_t> const &dimensions, uint8 *outRow)
+	{
+		for (size_t d = 0; d < dimensions.size(); d++) {
+			outRow[d] = dimensions[d] < data.size() ? data[dimensions[d]] : 0;
+		}
+	}
+
+	std::set<Category> CategorySuggestion::vote(SynthIndex const &index, uint8 const *query) const
+	{
+		size_t dims = index.dimensions.size();
+		size_t rows = index.labels.size();
+		size_t k = std::min((size_t)k_, rows);
+
+		// Keep the k best rows in a small sorted array, that's cheaper than a heap for small k
+		std::vector<std::pair<int32, size_t>> best;
+		best.reserve(k + 1);
+		uint8 const *row = index.features.data();
+		for (size_t r = 0; r < rows; r++, row += dims) {
+			int32 distance = 0;
+			for (size_t d = 0; d < dims; d++) {
+				int32 diff = (int32)row[d] - (int32)query[d];
+				distance += diff * diff;
+			}
+			if (best.size() < k || distance < best.back().first) {
+				auto insertAt = std::upper_bound(best.begin(), best.end(), std::make_pair(distance, r));
+				best.insert(insertAt, std::make_pair(distance, r));
+				if (best.size() > k) {
+					best.pop_back();
+				}
+			}
+		}
+
+		// Weighted vote, a category is suggested if it has at least half of the total weight
+		std::map<Category, double> votes;
+		double total = 0.0;
+		for (auto const &neighbour : best) {
+			double weight = 1.0 / (1.0 + std::sqrt((double)neighbour.first));
+			total += weight;
+			for (auto const &category : index.labels[neighbour.second]) {
+				votes[category] += weight;
+			}
+		}
+		std::set<Category> result;
+		for (auto const &v : votes) {
+			if (v.second >= total * 0.5) {
+				result.insert(v.first);
+			}
+		}
+		return result;
+	}
+
+	std::vector<std::set<Category>> CategorySuggestion::suggest(std::vector<PatchHolder> const &patches) const
+	{
+		std::vector<std::set<Category>> result(patches.size());
+		TaskScheduler::instance().parallelFor(TaskScheduler::Priority::CATEGORIZATION, patches.size(), [&](size_t i) {
+			auto const &patch = patches[i];
+			if (!patch.synth() || !patch.patch()) return;
+			auto index = indexes_.find(patch.synth()->getName());
+			if (index != indexes_.end()) {
+				std::vector<uint8> query(index->second.dimensions.size());
+				extractFeatures(patch.patch()->data(), index->second.dimensions, query.data());
+				result[i] = vote(index->second, query.data());
+			}
+		});
+		return result;
+	}
+
+}
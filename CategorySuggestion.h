@@ -0,0 +1,52 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "PatchHolder.h"
+#include "MemoryBudget.h"
+
+#include <map>
+
+namespace midikraft {
+
+	// Suggests categories for patches from the categories the user has given to similar patches of the same synth.
+	//
+	// Each patch's data is turned into a feature vector of the bytes that vary most within the synth's training set, and the
+	// categories are voted by the k nearest user-categorized patches. The index is a flat byte matrix per synth, scanned with
+	// integer distance loops the compiler can vectorize.
+	class CategorySuggestion {
+	public:
+		CategorySuggestion(int k = 5);
+
+		// Builds one index per synth from all patches with categories decided by the user
+		void train(std::vector<PatchHolder> const &library);
+		size_t numberOfIndexedPatches() const;
+
+		// Returns one (possibly empty) suggestion per patch given. Typically called with the uncategorized patches of a library
+		std::vector<std::set<Category>> suggest(std::vector<PatchHolder> const &patches) const;
+
+	private:
+		struct SynthIndex {
+			std::vector<size_t> dimensions; // Byte positions in the patch data used as features
+			std::vector<uint8> features; // Row major, one row of dimensions.size() bytes per indexed patch
+			std::vector<std::vector<Category>> labels; // One per row
+		};
+
+		static void extractFeatures(std::vector<uint8> const &data, std::vector<size_t> const &dimensions, uint8 *outRow);
+		std::set<Category> vote(SynthIndex const &index, uint8 const *query) const;
+
+		static const size_t kMaxDimensions = 64;
+
+		int k_;
+		std::map<std::string, SynthIndex> indexes_;
+		// Only train() can rebuild the indexes, as that needs the library, so they are accounted for but never evicted
+		BudgetedAllocation budget_;
+	};
+
+}
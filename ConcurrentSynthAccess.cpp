@@ -0,0 +1,90 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "ConcurrentSynthAccess.h"
+
+#include "Capability.h"
+
+#include <map>
+#include <set>
+
+namespace midikraft {
+
+	bool allowsConcurrentAccess(Synth *synth)
+	{
+		// Without a synth nothing of an adaptation is called
+		return synth == nullptr || midikraft::Capability::hasCapability<ConcurrentAccessCapability>(synth) != nullptr;
+	}
+
+	namespace {
+
+		std::recursive_mutex *accessMutex(Synth *synth) {
+			// Never removed, a mutex is cheap and the number of synths small
+			static std::mutex lock;
+			static std::map<Synth *, std::unique_ptr<std::recursive_mutex>> mutexes;
+			std::lock_guard<std::mutex> guard(lock);
+			auto &mutex = mutexes[synth];
+			if (!mutex) {
+				mutex = std::make_unique<std::recursive_mutex>();
+			}
+			return mutex.get();
+		}
+
+	}
+
+	SynthAccessLock::SynthAccessLock(Synth *synth) : SynthAccessLock(std::vector<Synth *>{ synth })
+	{
+	}
+
+	SynthAccessLock::SynthAccessLock(std::vector<Synth *> const &synths)
+	{
+		// Sorted by address and without duplicates, that is the fixed lock order
+		std::set<Synth *> exclusive;
+		for (auto synth : synths) {
+			if (!allowsConcurrentAccess(synth)) {
+				exclusive.insert(synth);
+			}
+		}
+		for (auto synth : exclusive) {
+			auto mutex = accessMutex(synth);
+			mutex->lock();
+			held_.push_back(mutex);
+		}
+	}
+
+	SynthAccessLock::~SynthAccessLock()
+	{
+		for (auto mutex = held_.rbegin(); mutex != held_.rend(); mutex++) {
+			(*mutex)->unlock();
+		}
+	}
+
+	void parallelForSynths(TaskScheduler::Priority priority, size_t count, std::function<Synth *(size_t)> synthOf, std::function<void(size_t)> body, CancellationToken const &token)
+	{
+		std::map<Synth *, bool> allowed;
+		std::vector<size_t> concurrent;
+		std::vector<size_t> sequential;
+		for (size_t i = 0; i < count; i++) {
+			Synth *synth = synthOf(i);
+			auto found = allowed.find(synth);
+			if (found == allowed.end()) {
+				found = allowed.emplace(synth, allowsConcurrentAccess(synth)).first;
+			}
+			(found->second ? concurrent : sequential).push_back(i);
+		}
+		if (!concurrent.empty()) {
+			TaskScheduler::instance().parallelFor(priority, concurrent.size(), [&](size_t c) {
+				body(concurrent[c]);
+			}, token);
+		}
+		for (auto i : sequential) {
+			if (token.isCancelled()) break;
+			SynthAccessLock lock(synthOf(i));
+			body(i);
+		}
+	}
+
+}
@@ -0,0 +1,49 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "Synth.h"
+#include "TaskScheduler.h"
+
+#include <mutex>
+
+namespace midikraft {
+
+	// Opt-in for adaptations that can be called from several threads at the same time, i.e. whose loadSysex, dataFileToSysex,
+	// calculateFingerprint and the DataFile capabilities like StoredTagCapability don't share mutable state. Adaptations without it,
+	// e.g. the Python backed ones, are never called concurrently by the batch operations of the librarian.
+	class ConcurrentAccessCapability {
+	public:
+		virtual ~ConcurrentAccessCapability() = default;
+	};
+
+	bool allowsConcurrentAccess(Synth *synth);
+
+	// Process wide serialization of the calls into adaptations that don't allow concurrent access. Holds the per synth mutex of
+	// every given synth without ConcurrentAccessCapability, synths with it and null are ignored. The mutexes are recursive, so code
+	// holding a lock can call into code taking it again, and several synths are locked in a fixed order so two holders can't deadlock.
+	// Take it around every call into an adaptation that can happen outside of the message thread.
+	class SynthAccessLock {
+	public:
+		explicit SynthAccessLock(Synth *synth);
+		explicit SynthAccessLock(std::vector<Synth *> const &synths);
+		~SynthAccessLock();
+
+	private:
+		std::vector<std::recursive_mutex *> held_;
+
+		JUCE_DECLARE_NON_COPYABLE(SynthAccessLock)
+	};
+
+	// Like TaskScheduler::parallelFor, but only the indexes whose synth (as returned by synthOf, may be null) allows concurrent
+	// access run on the pool. The others run one after the other on the calling thread after the parallel ones are done, each
+	// under a SynthAccessLock.
+	void parallelForSynths(TaskScheduler::Priority priority, size_t count, std::function<Synth *(size_t)> synthOf, std::function<void(size_t)> body, CancellationToken const &token = CancellationToken());
+
+}
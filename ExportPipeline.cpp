@@ -0,0 +1,363 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "ExportPipeline.h"
+
+#include "Librarian.h"
+#include "BatchFileIO.h"
+#include "ConcurrentSynthAccess.h"
+#include "PatchInterchangeFormat.h"
+#include "PatchMetadataTable.h"
+#include "ProgramDumpCapability.h"
+#include "Synth.h"
+#include "Sysex.h"
+#include "TaskScheduler.h"
+#include "Trace.h"
+
+#include <boost/format.hpp>
+
+namespace midikraft {
+
+	namespace {
+
+		const size_t kBlockSize = 64;
+
+		std::vector<uint8> toBytes(std::vector<MidiMessage> const &messages) {
+			std::vector<uint8> result;
+			for (auto const &message : messages) {
+				result.insert(result.end(), message.getRawData(), message.getRawData() + message.getRawDataSize());
+			}
+			return result;
+		}
+
+		// All messages into one .syx file
+		class OneFileSink : public ExportSink {
+		public:
+			OneFileSink(File const &destination, int formatOption) : destination_(destination), formatOption_(formatOption) {}
+
+			int formatOption() const override { return formatOption_; }
+			void add(PatchHolder const &patch, std::vector<MidiMessage> const &sysex) override {
+				ignoreUnused(patch);
+				std::copy(sysex.begin(), sysex.end(), std::back_inserter(allMessages_));
+			}
+			bool finish() override {
+				Sysex::saveSysex(destination_.getFullPathName().toStdString(), allMessages_);
+				return true;
+			}
+			String describe() const override { return "sysex file " + destination_.getFullPathName(); }
+
+		private:
+			File destination_;
+			int formatOption_;
+			std::vector<MidiMessage> allMessages_;
+		};
+
+		// All messages into track 1 of a standard MIDI file
+		class MidFileSink : public ExportSink {
+		public:
+			MidFileSink(File const &destination, int formatOption) : destination_(destination), formatOption_(formatOption) {}
+
+			int formatOption() const override { return formatOption_; }
+			void add(PatchHolder const &patch, std::vector<MidiMessage> const &sysex) override {
+				ignoreUnused(patch);
+				for (const auto &msg : sysex) {
+					mmSeq_.addEvent(msg, 0.0);
+				}
+			}
+			bool finish() override {
+				MidiFile midiFile;
+				midiFile.addTrack(mmSeq_);
+				midiFile.setTicksPerQuarterNote(96);
+
+				if (destination_.existsAsFile()) {
+					destination_.deleteFile();
+				}
+				FileOutputStream stream(destination_);
+				if (!midiFile.writeTo(stream, 1)) {
+					SimpleLogger::instance()->postMessage("ERROR: Failed to write SMF file to " + destination_.getFullPathName());
+					return false;
+				}
+				stream.flush();
+				return true;
+			}
+			String describe() const override { return "MIDI file " + destination_.getFullPathName(); }
+
+		private:
+			File destination_;
+			int formatOption_;
+			MidiMessageSequence mmSeq_;
+		};
+
+		// One .syx file per patch inside a zip file. The entries are built in memory, no temporary files needed
+		class ZipSink : public ExportSink {
+		public:
+			ZipSink(File const &destination, int formatOption) : destination_(destination), formatOption_(formatOption) {}
+
+			int formatOption() const override { return formatOption_; }
+			void add(PatchHolder const &patch, std::vector<MidiMessage> const &sysex) override {
+				// The names only need to be unique within the zip
+				auto fileName = ExportPipeline::uniqueSysexFileName(File(), File::createLegalFileName(String(patch.name()).trim()), usedFileNames_);
+				auto data = toBytes(sysex);
+				builder_.addEntry(new MemoryInputStream(data.data(), data.size(), true), 6, fileName, Time::getCurrentTime());
+			}
+			bool finish() override {
+				if (destination_.existsAsFile()) {
+					destination_.deleteFile();
+				}
+				FileOutputStream targetStream(destination_);
+				return builder_.writeToStream(targetStream, nullptr);
+			}
+			String describe() const override { return "zip file " + destination_.getFullPathName(); }
+
+		private:
+			File destination_;
+			int formatOption_;
+			std::set<String> usedFileNames_;
+			ZipFile::Builder builder_;
+		};
+
+		// One .syx file per patch in a directory, written with one batch per block
+		class ManyFilesSink : public ExportSink {
+		public:
+			ManyFilesSink(File const &directory, int formatOption) : directory_(directory), formatOption_(formatOption) {}
+
+			int formatOption() const override { return formatOption_; }
+			bool begin() override {
+				return directory_.isDirectory() || directory_.createDirectory().wasOk();
+			}
+			void add(PatchHolder const &patch, std::vector<MidiMessage> const &sysex) override {
+				auto fileName = ExportPipeline::uniqueSysexFileName(directory_, File::createLegalFileName(String(patch.name()).trim()), usedFileNames_);
+				fileWrites_.push_back({ directory_.getChildFile(fileName), toBytes(sysex) });
+			}
+			void endBlock() override {
+				auto written = BatchFileIO::writeFiles(fileWrites_);
+				for (size_t w = 0; w < written.size(); w++) {
+					if (!written[w]) {
+						SimpleLogger::instance()->postMessage("ERROR: Failed to write " + fileWrites_[w].file.getFullPathName());
+						failed_ = true;
+					}
+				}
+				fileWrites_.clear();
+			}
+			bool finish() override {
+				endBlock();
+				return !failed_;
+			}
+			String describe() const override { return "directory " + directory_.getFullPathName(); }
+
+		private:
+			File directory_;
+			int formatOption_;
+			std::set<String> usedFileNames_;
+			std::vector<BatchFileIO::WriteRequest> fileWrites_;
+			bool failed_ = false;
+		};
+
+		class PatchInterchangeFormatSink : public ExportSink {
+		public:
+			PatchInterchangeFormatSink(File const &destination) : destination_(destination) {}
+
+			// PatchInterchangeFormat::save also stores the result of dataFileToSysex
+			int formatOption() const override { return Librarian::EDIT_BUFFER_DUMPS; }
+			bool begin() override {
+				writer_ = std::make_unique<PatchInterchangeFormatWriter>(destination_.getFullPathName().toStdString());
+				return writer_->isOpen();
+			}
+			void add(PatchHolder const &patch, std::vector<MidiMessage> const &sysex) override {
+				writer_->add(patch, sysex);
+			}
+			bool finish() override {
+				writer_->close();
+				return true;
+			}
+			String describe() const override { return "patch interchange format file " + destination_.getFullPathName(); }
+
+		private:
+			File destination_;
+			std::unique_ptr<PatchInterchangeFormatWriter> writer_;
+		};
+
+		class MetadataSink : public ExportSink {
+		public:
+			MetadataSink(File const &destination) : destination_(destination) {}
+
+			int formatOption() const override { return kNoSysex; }
+			bool begin() override {
+				writer_ = std::make_unique<PatchMetadataWriter>(destination_);
+				return writer_->isOpen();
+			}
+			void add(PatchHolder const &patch, std::vector<MidiMessage> const &sysex) override {
+				ignoreUnused(sysex);
+				writer_->add(patch);
+			}
+			bool finish() override {
+				return writer_->close();
+			}
+			String describe() const override { return "metadata table " + destination_.getFullPathName(); }
+
+		private:
+			File destination_;
+			std::unique_ptr<PatchMetadataWriter> writer_;
+		};
+
+	}
+
+	void ExportPipeline::addSink(std::shared_ptr<ExportSink> sink)
+	{
+		if (sink) {
+			sinks_.push_back(sink);
+		}
+	}
+
+	size_t ExportPipeline::numberOfSinks() const
+	{
+		return sinks_.size();
+	}
+
+	bool ExportPipeline::run(std::vector<PatchHolder> const &patches, TProgressHandler progress)
+	{
+		MIDIKRAFT_TRACE_SCOPE("ExportPipeline::run", "export");
+		std::vector<std::shared_ptr<ExportSink>> active;
+		for (auto const &sink : sinks_) {
+			if (sink->begin()) {
+				active.push_back(sink);
+			}
+			else {
+				SimpleLogger::instance()->postMessage("ERROR: Can't export into " + sink->describe());
+			}
+		}
+		if (active.empty()) {
+			return false;
+		}
+
+		// Every sysex format is created only once, no matter how many sinks want it
+		std::vector<int> formats;
+		for (auto const &sink : active) {
+			if (std::find(formats.begin(), formats.end(), sink->formatOption()) == formats.end()) {
+				formats.push_back(sink->formatOption());
+			}
+		}
+
+		bool cancelled = false;
+		for (size_t blockStart = 0; blockStart < patches.size() && !cancelled; blockStart += kBlockSize) {
+			// Creating the sysex can be expensive for some synths, so do that in parallel for a block of patches where the adaptation allows it
+			size_t blockEnd = std::min(patches.size(), blockStart + kBlockSize);
+			size_t blockLength = blockEnd - blockStart;
+			std::vector<std::vector<MidiMessage>> sysex(blockLength * formats.size());
+			parallelForSynths(TaskScheduler::Priority::EXPORT, sysex.size(), [&](size_t i) {
+				return patches[blockStart + i % blockLength].synth();
+			}, [&](size_t i) {
+				if (formats[i / blockLength] == ExportSink::kNoSysex) {
+					return;
+				}
+				MIDIKRAFT_TRACE_SCOPE("Create sysex", "export");
+				sysex[i] = createSysex(patches[blockStart + i % blockLength], formats[i / blockLength]);
+			});
+
+			// Each sink sees the patches in order, but the sinks work on the block concurrently. Sinks ask the adaptations for the
+			// fingerprint, so a block with a synth that does not allow concurrent access is written by one sink after the other.
+			bool concurrentSinks = true;
+			for (size_t i = blockStart; i < blockEnd && concurrentSinks; i++) {
+				concurrentSinks = allowsConcurrentAccess(patches[i].synth());
+			}
+			auto writeBlock = [&](size_t s) {
+				MIDIKRAFT_TRACE_SCOPE("Write block", "export");
+				auto &sink = active[s];
+				size_t format = (size_t)(std::find(formats.begin(), formats.end(), sink->formatOption()) - formats.begin());
+				for (size_t i = 0; i < blockLength; i++) {
+					if (patches[blockStart + i].patch()) {
+						sink->add(patches[blockStart + i], sysex[format * blockLength + i]);
+					}
+				}
+				sink->endBlock();
+			};
+			if (concurrentSinks) {
+				TaskScheduler::instance().parallelFor(TaskScheduler::Priority::EXPORT, active.size(), writeBlock);
+			}
+			else {
+				std::vector<Synth *> blockSynths;
+				for (size_t i = blockStart; i < blockEnd; i++) {
+					blockSynths.push_back(patches[i].synth());
+				}
+				SynthAccessLock access(blockSynths);
+				for (size_t s = 0; s < active.size(); s++) {
+					writeBlock(s);
+				}
+			}
+			if (progress && !progress(blockEnd / (double)patches.size())) {
+				cancelled = true;
+			}
+		}
+
+		MIDIKRAFT_TRACE_SCOPE("Finish export", "export");
+		bool ok = !cancelled;
+		for (auto const &sink : active) {
+			if (!sink->finish()) {
+				SimpleLogger::instance()->postMessage("ERROR: Failed to complete export into " + sink->describe());
+				ok = false;
+			}
+		}
+		return ok;
+	}
+
+	std::shared_ptr<ExportSink> ExportPipeline::createSink(int fileOption, int formatOption, File const &destination)
+	{
+		switch (fileOption) {
+		case Librarian::MANY_FILES: return std::make_shared<ManyFilesSink>(destination, formatOption);
+		case Librarian::ZIPPED_FILES: return std::make_shared<ZipSink>(destination, formatOption);
+		case Librarian::ONE_FILE: return std::make_shared<OneFileSink>(destination, formatOption);
+		case Librarian::MID_FILE: return std::make_shared<MidFileSink>(destination, formatOption);
+		default:
+			jassertfalse;
+			return nullptr;
+		}
+	}
+
+	std::shared_ptr<ExportSink> ExportPipeline::createPatchInterchangeFormatSink(File const &destination)
+	{
+		return std::make_shared<PatchInterchangeFormatSink>(destination);
+	}
+
+	std::shared_ptr<ExportSink> ExportPipeline::createMetadataSink(File const &destination)
+	{
+		return std::make_shared<MetadataSink>(destination);
+	}
+
+	std::vector<MidiMessage> ExportPipeline::createSysex(PatchHolder const &patch, int formatOption)
+	{
+		if (!patch.patch()) {
+			return {};
+		}
+		switch (formatOption) {
+		case Librarian::PROGRAM_DUMPS:
+		{
+			// Let's see if we have program dump capability for the synth!
+			auto pdc = Capability::hasCapability<ProgramDumpCabability>(patch.synth());
+			if (pdc) {
+				return pdc->patchToProgramDumpSysex(patch.patch(), patch.patchNumber());
+			}
+			// fall through do default then
+		}
+		default:
+		case Librarian::EDIT_BUFFER_DUMPS:
+			// Every synth is forced to have an implementation for this
+			return patch.synth()->dataFileToSysex(patch.patch(), nullptr);
+		}
+	}
+
+	String ExportPipeline::uniqueSysexFileName(File const &directory, String const &patchName, std::set<String> &usedFileNames)
+	{
+		String name = patchName.isEmpty() ? "patch" : patchName;
+		String candidate = name + ".syx";
+		int suffix = 2;
+		while (usedFileNames.count(candidate.toLowerCase()) || (directory != File() && directory.getChildFile(candidate).exists())) {
+			candidate = name + " (" + String(suffix++) + ").syx";
+		}
+		usedFileNames.insert(candidate.toLowerCase());
+		return candidate;
+	}
+
+}
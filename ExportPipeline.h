@@ -0,0 +1,68 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "PatchHolder.h"
+
+#include <set>
+
+namespace midikraft {
+
+	// Destination of an export. The pipeline calls add() for every patch in library order, always from one thread at a time, and
+	// endBlock() after each block of patches, so sinks that write many files can batch them.
+	class ExportSink {
+	public:
+		virtual ~ExportSink() = default;
+
+		// Which sysex the sink wants, one of Librarian::ExportFormatOption, or kNoSysex
+		virtual int formatOption() const = 0;
+		static const int kNoSysex = -1;
+
+		virtual bool begin() { return true; }
+		virtual void add(PatchHolder const &patch, std::vector<MidiMessage> const &sysex) = 0;
+		virtual void endBlock() {}
+		virtual bool finish() = 0;
+
+		virtual String describe() const = 0; // For log messages
+	};
+
+	// Exports a list of patches into any number of sinks in one pass.
+	//
+	// The sysex of each patch is created only once per format needed by the sinks (in parallel for a block of patches), and then
+	// handed to all sinks, which process the block concurrently with each other.
+	class ExportPipeline {
+	public:
+		// Progress is reported from 0 to 1, returning false cancels the export
+		typedef std::function<bool(double)> TProgressHandler;
+
+		void addSink(std::shared_ptr<ExportSink> sink);
+		size_t numberOfSinks() const;
+
+		// Returns false if the export was cancelled or a sink failed
+		bool run(std::vector<PatchHolder> const &patches, TProgressHandler progress = nullptr);
+
+		// Sink for the Librarian::ExportFileOption given, writing to a file or, for MANY_FILES, into a directory
+		static std::shared_ptr<ExportSink> createSink(int fileOption, int formatOption, File const &destination);
+		// Sink writing a PatchInterchangeFormat file, which always stores edit buffer sysex
+		static std::shared_ptr<ExportSink> createPatchInterchangeFormatSink(File const &destination);
+		// Sink writing only the metadata as a PatchMetadataTable, no sysex is created for it
+		static std::shared_ptr<ExportSink> createMetadataSink(File const &destination);
+
+		// The sysex of the patch in the requested Librarian::ExportFormatOption
+		static std::vector<MidiMessage> createSysex(PatchHolder const &patch, int formatOption);
+
+		// Creates "name.syx", or "name (2).syx" etc. if the name is taken in the directory or by an earlier call with the same set.
+		// Pass File() as directory to only check the set.
+		static String uniqueSysexFileName(File const &directory, String const &patchName, std::set<String> &usedFileNames);
+
+	private:
+		std::vector<std::shared_ptr<ExportSink>> sinks_;
+	};
+
+}
@@ -8,6 +8,7 @@
 
 #include "JsonSchema.h"
 #include "RapidjsonHelper.h"
+#include "Trace.h"
 #include "Synth.h"
 
 #include <boost/format.hpp>
@@ -39,11 +40,13 @@ namespace midikraft {
 	}
 
 	std::string JsonSerialization::dataToString(std::vector<uint8> const &data) {
+		MIDIKRAFT_TRACE_SCOPE("JsonSerialization::dataToString", "json");
 		return Base64::toBase64(data.data(), data.size()).toStdString();
 	}
 
 	std::vector<uint8> JsonSerialization::stringToData(std::string const string)
 	{
+		MIDIKRAFT_TRACE_SCOPE("JsonSerialization::stringToData", "json");
 		std::vector<uint8> outBuffer(2048, 0);
 		MemoryOutputStream output(outBuffer.data(), outBuffer.size());
 		if (Base64::convertFromBase64(output, string)) {
@@ -57,6 +60,7 @@ namespace midikraft {
 
 	std::string JsonSerialization::patchToJson(std::shared_ptr<Synth> synth, PatchHolder *patchholder)
 	{
+		MIDIKRAFT_TRACE_SCOPE("JsonSerialization::patchToJson", "json");
 		if (!patchholder || !patchholder->patch() || !synth) {
 			jassert(false);
 			return "";
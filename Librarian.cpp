@@ -18,6 +18,12 @@
 #include "LegacyLoaderCapability.h"
 #include "SendsProgramChangeCapability.h"
 #include "PatchInterchangeFormat.h"
+#include "SysexSpan.h"
+#include "BatchFileIO.h"
+#include "ConcurrentSynthAccess.h"
+#include "ExportPipeline.h"
+#include "TaskScheduler.h"
+#include "Trace.h"
 
 #include "RunWithRetry.h"
 #include "MidiHelpers.h"
@@ -130,11 +136,13 @@ namespace midikraft {
 		// First things first - this should not be called more than once at a time, and there should be no other Librarian callback handlers be registered!
 		jassert(handles_.empty());
 		clearHandlers();
+		downloadOperation_ = std::make_unique<MemoryAccounting::ScopedOperation>("download");
 
 		// Ok, for this we need to send a program change message, and then a request edit buffer message from the active synth
 		// Once we get that, store the patch and increment number by one
 		downloadNumber_ = 0;
-		currentDownload_.clear();
+		clearDownloadBuffer(currentDownload_);
+		reserveDownloadBuffers(synth, bankNo);
 		onFinished_ = onFinished;
 
 		// Determine what we will do with the answer...
@@ -153,7 +161,7 @@ namespace midikraft {
 			expectedDownloadNumber_ = numberOfPatchesInBank(synth, bankNo);
 			if (expectedDownloadNumber_ > 0) {
 				auto messages = streamLoading->requestStreamElement(bankNo.toZeroBased(), StreamLoadCapability::StreamType::BANK_DUMP);
-				synth->sendBlockOfMessagesToSynth(midiOutput->name(), messages);
+				sendToSynth(synth, midiOutput->name(), messages);
 			}
 		}
 		else if (handshakeLoadingRequired) {
@@ -162,14 +170,15 @@ namespace midikraft {
 			if (state) {
 				MidiController::instance()->addMessageHandler(handle, [this, handshakeLoadingRequired, state, progressHandler, midiOutput, synth, bankNo](MidiInput *source, const juce::MidiMessage &protocolMessage) {
 					ignoreUnused(source);
-					std::vector<MidiMessage> answer;
+					auto &answer = handshakeAnswer_;
+					answer.clear();
 					if (handshakeLoadingRequired->isNextMessage(protocolMessage, answer, state)) {
 						// Store message
-						currentDownload_.push_back(protocolMessage);
+						appendToDownload(currentDownload_, protocolMessage);
 					}
 					// Send an answer if the handshake handler constructed one
 					if (!answer.empty()) {
-						synth->sendBlockOfMessagesToSynth(midiOutput->name(), answer);
+						sendToSynth(synth, midiOutput->name(), answer);
 					}
 					// Update progress handler
 					progressHandler->setProgressPercentage(state->progress());
@@ -202,7 +211,7 @@ namespace midikraft {
 			std::string outname = midiOutput->name();
 			RunWithRetry::start([this, synth, outname, buffer, bankNo]() {
 					expectedDownloadNumber_ = numberOfPatchesInBank(synth, bankNo);
-					synth->sendBlockOfMessagesToSynth(outname, buffer);
+					sendToSynth(synth, outname, buffer);
 					}, 
 				[this]() {
 					return currentDownload_.empty();
@@ -216,7 +225,7 @@ namespace midikraft {
 				this->handleNextBankDump(midiOutput, synth, progressHandler, editBuffer, bankNo);
 			});
 			handles_.push(handle);
-			currentDownload_.clear();
+			clearDownloadBuffer(currentDownload_);
 		}
 		else {
 			// Uh, stone age, need to start a loop
@@ -255,11 +264,12 @@ namespace midikraft {
 		// First things first - this should not be called more than once at a time, and there should be no other Librarian callback handlers be registered!
 		jassert(handles_.empty());
 		clearHandlers();
+		downloadOperation_ = std::make_unique<MemoryAccounting::ScopedOperation>("download");
 
 		// Ok, for this we need to send a program change message, and then a request edit buffer message from the active synth
 		// Once we get that, store the patch and increment number by one
 		downloadNumber_ = 0;
-		currentDownload_.clear();
+		clearDownloadBuffer(currentDownload_);
 		onFinished_ = onFinished;
 		auto editBufferCapability = midikraft::Capability::hasCapability<EditBufferCapability>(synth);
 		auto streamLoading = midikraft::Capability::hasCapability<StreamLoadCapability>(synth);
@@ -273,13 +283,14 @@ namespace midikraft {
 				this->handleNextStreamPart(midiOutput, synth, progressHandler, editBuffer, StreamLoadCapability::StreamType::EDIT_BUFFER_DUMP);
 			});
 			handles_.push(handle);
-			currentDownload_.clear();
+			clearDownloadBuffer(currentDownload_);
 			auto messages = streamLoading->requestStreamElement(0, StreamLoadCapability::StreamType::EDIT_BUFFER_DUMP);
-			synth->sendBlockOfMessagesToSynth(midiOutput->name(), messages);
+			sendToSynth(synth, midiOutput->name(), messages);
 		} else if (editBufferCapability) {
 			MidiController::instance()->addMessageHandler(handle, [this, synth, progressHandler, midiOutput](MidiInput *source, const juce::MidiMessage &editBuffer) {
 				ignoreUnused(source);
-				this->handleNextEditBuffer(midiOutput, synth, progressHandler, editBuffer, MidiBankNumber::fromZeroBase(0));
+				// The edit buffer is no program place, so this must not count as a new version of bank 0
+				this->handleNextEditBuffer(midiOutput, synth, progressHandler, editBuffer, MidiBankNumber::invalid());
 			});
 			handles_.push(handle);
 			// Special case - load only a single patch. In this case we're interested in the edit buffer only!
@@ -289,7 +300,7 @@ namespace midikraft {
 		}
 		else if (programDumpCapability && programChangeCapability) {
 			auto messages = programDumpCapability->requestPatch(programChangeCapability->lastProgramChange().toZeroBased());
-			synth->sendBlockOfMessagesToSynth(midiOutput->name(), messages);
+			sendToSynth(synth, midiOutput->name(), messages);
 		}
 		else {
 			SimpleLogger::instance()->postMessage("The " + synth->getName() + " has no way to request the edit buffer or program place");
@@ -301,16 +312,17 @@ namespace midikraft {
 		// First things first - this should not be called more than once at a time, and there should be no other Librarian callback handlers be registered!
 		jassert(handles_.empty());
 		clearHandlers();
+		downloadOperation_ = std::make_unique<MemoryAccounting::ScopedOperation>("download");
 
 		downloadNumber_ = 0;
-		currentDownload_.clear();
+		clearDownloadBuffer(currentDownload_);
 		onSequencerFinished_ = onFinished;
 
 		auto handle = MidiController::makeOneHandle();
 		MidiController::instance()->addMessageHandler(handle, [this, sequencer, progressHandler, midiOutput, dataFileIdentifier](MidiInput *source, const MidiMessage &message) {
 			ignoreUnused(source);
 			if (sequencer->isDataFile(message, dataFileIdentifier)) {
-				currentDownload_.push_back(message);
+				appendToDownload(currentDownload_, message);
 				downloadNumber_++;
 				if (downloadNumber_ >= sequencer->numberOfDataItemsPerType(dataFileIdentifier)) {
 					auto loadedData = sequencer->loadData(currentDownload_, dataFileIdentifier);
@@ -332,13 +344,54 @@ namespace midikraft {
 		startDownloadNextDataItem(midiOutput, sequencer, dataFileIdentifier);
 	}
 
+	void Librarian::startDownloadingSequencerData(std::shared_ptr<SafeMidiOutput> midiOutput, DataFileLoadCapability *sequencer, int dataFileIdentifier, PipelinedDataDownload::Options const &options, ProgressHandler *progressHandler, TStepSequencerFinishedHandler onFinished)
+	{
+		// First things first - this should not be called more than once at a time, and there should be no other Librarian callback handlers be registered!
+		jassert(handles_.empty());
+		clearHandlers();
+		downloadOperation_ = std::make_unique<MemoryAccounting::ScopedOperation>("download");
+		onSequencerFinished_ = onFinished;
+
+		auto downloadOptions = options;
+		if (!downloadOptions.recorder) {
+			downloadOptions.recorder = sessionRecorder_;
+		}
+		if (!downloadOptions.replay) {
+			downloadOptions.replay = sessionReplay_;
+		}
+		auto download = std::make_shared<PipelinedDataDownload>(midiOutput, sequencer, dataFileIdentifier, downloadOptions, progressHandler);
+		download->setFinishedHandler([this, progressHandler](PipelinedDataDownload::Result result, std::vector<std::shared_ptr<DataFile>> loadedData) {
+			clearHandlers();
+			switch (result) {
+			case PipelinedDataDownload::Result::SUCCESS:
+				onSequencerFinished_(loadedData);
+				if (progressHandler) progressHandler->onSuccess();
+				break;
+			case PipelinedDataDownload::Result::CANCELLED:
+			case PipelinedDataDownload::Result::TIMED_OUT:
+				if (progressHandler) progressHandler->onCancel();
+				break;
+			}
+		});
+		sequencerDownload_ = download;
+
+		auto handle = MidiController::makeOneHandle();
+		MidiController::instance()->addMessageHandler(handle, [download](MidiInput *source, const MidiMessage &message) {
+			ignoreUnused(source);
+			download->handleMessage(message);
+		});
+		handles_.push(handle);
+		download->start();
+	}
+
 	Synth *Librarian::sniffSynth(std::vector<MidiMessage> const &messages) const
 	{
 		std::set<Synth *> result;
-		for (auto message : messages) {
-			for (auto synth : synths_) {
-				if (synth.synth() && synth.synth()->isOwnSysex(message)) {
-					result.insert(synth.synth().get());
+		auto synths = SynthRegistry::instance().snapshot();
+		for (auto const &message : messages) {
+			for (auto const &entry : *synths) {
+				if (entry.second.synth() && entry.second.synth()->isOwnSysex(message)) {
+					result.insert(entry.second.synth().get());
 				}
 			}
 		}
@@ -363,17 +416,54 @@ namespace midikraft {
 		}
 
 		void run() {
-			int filesDiscovered = files_.size();
-			int filesDone = 0;
-			for (auto fileChosen : files_) {
+			MemoryAccounting::ScopedOperation memory("import");
+			// Load the files in parallel on the shared scheduler if the adaptation allows it, but keep the result in the order of the files given
+			std::vector<std::vector<PatchHolder>> patchesPerFile((size_t)files_.size());
+			std::atomic<int> filesDone(0);
+			CancellationToken cancelled;
+			// Plain .syx files are read in batches with as few syscalls as possible, everything else goes through the file specific loaders
+			auto legacyLoader = midikraft::Capability::hasCapability<LegacyLoaderCapability>(synth_);
+			std::vector<int> syxFiles;
+			std::vector<int> otherFiles;
+			for (int i = 0; i < files_.size(); i++) {
+				bool plainSysex = files_[i].hasFileExtension(".syx") && !(legacyLoader && legacyLoader->supportsExtension(files_[i].getFullPathName().toStdString()));
+				(plainSysex ? syxFiles : otherFiles).push_back(i);
+			}
+			for (size_t batchStart = 0; batchStart < syxFiles.size() && !cancelled.isCancelled(); batchStart += kPrefetchBatch) {
+				size_t batchEnd = std::min(syxFiles.size(), batchStart + kPrefetchBatch);
+				std::vector<File> batch;
+				for (size_t b = batchStart; b < batchEnd; b++) {
+					batch.push_back(files_[syxFiles[b]]);
+				}
+				auto contents = BatchFileIO::readFiles(batch);
+				for (size_t b = 0; b < batch.size(); b++) {
+					// An empty span is either an empty file or a failed read
+					if (contents[b].size() == 0 && (!batch[b].existsAsFile() || batch[b].getSize() > 0)) {
+						SimpleLogger::instance()->postMessage("ERROR: Failed to read " + batch[b].getFullPathName());
+					}
+				}
+				parallelForSynths(TaskScheduler::Priority::IMPORT, batch.size(), [this](size_t) { return synth_.get(); }, [&](size_t b) {
+					if (threadShouldExit()) {
+						cancelled.cancel();
+						return;
+					}
+					auto const &fileChosen = batch[b];
+					patchesPerFile[(size_t)syxFiles[batchStart + b]] = librarian_->loadSysexPatchesFromData(synth_, fileChosen.getFullPathName().toStdString(), fileChosen.getFileName().toStdString(), contents[b], automaticCategories_);
+					setProgress(++filesDone / (double)files_.size());
+				}, cancelled);
+			}
+			parallelForSynths(TaskScheduler::Priority::IMPORT, otherFiles.size(), [this](size_t) { return synth_.get(); }, [&](size_t o) {
 				if (threadShouldExit()) {
+					cancelled.cancel();
 					return;
 				}
-				setProgress(filesDone / (double)filesDiscovered);
+				auto fileChosen = files_[otherFiles[o]];
 				auto pathChosen = fileChosen.getFullPathName().toStdString();
-				auto newPatches = librarian_->loadSysexPatchesFromDisk(synth_, pathChosen, fileChosen.getFileName().toStdString(), automaticCategories_);
+				patchesPerFile[(size_t)otherFiles[o]] = librarian_->loadSysexPatchesFromDisk(synth_, pathChosen, fileChosen.getFileName().toStdString(), automaticCategories_);
+				setProgress(++filesDone / (double)files_.size());
+			}, cancelled);
+			for (auto const &newPatches : patchesPerFile) {
 				std::copy(newPatches.begin(), newPatches.end(), std::back_inserter(result_));
-				filesDone++;
 			}
 		}
 
@@ -382,6 +472,8 @@ namespace midikraft {
 		}
 
 	private:
+		static const size_t kPrefetchBatch = 256; // Limits the memory held by file contents not yet parsed
+
 		Librarian *librarian_;
 		std::shared_ptr<Synth> synth_;
 		Array<File> files_;
@@ -437,6 +529,7 @@ namespace midikraft {
 	}
 
 	std::vector<PatchHolder> Librarian::loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories) {
+		MIDIKRAFT_TRACE_SCOPE("Librarian::loadSysexPatchesFromDisk", "import");
 		auto legacyLoader = midikraft::Capability::hasCapability<LegacyLoaderCapability>(synth);
 		TPatchVector patches;
 		if (legacyLoader && legacyLoader->supportsExtension(fullpath)) {
@@ -445,6 +538,7 @@ namespace midikraft {
 				FileInputStream inputStream(legacyFile);
 				std::vector<uint8> data((size_t)inputStream.getTotalLength());
 				inputStream.read(&data[0], (int)inputStream.getTotalLength()); // 4 GB Limit
+				MIDIKRAFT_TRACE_SCOPE("LegacyLoaderCapability::load", "import");
 				patches = legacyLoader->load(fullpath, data);
 			}
 		}
@@ -454,8 +548,19 @@ namespace midikraft {
 			return PatchInterchangeFormat::load(synths, fullpath, automaticCategories);
 		}
 		else {
-			auto messagesLoaded = Sysex::loadSysex(fullpath);
+			std::vector<MidiMessage> messagesLoaded;
+			{
+				MIDIKRAFT_TRACE_SCOPE("Sysex::loadSysex", "import");
+				if (File(fullpath).hasFileExtension(".syx")) {
+					// Plain sysex files are read into one buffer and split into messages without intermediate copies
+					messagesLoaded = SysexSpan::toMidiMessages(SysexSpan::fromFile(File(fullpath)).messages());
+				}
+				else {
+					messagesLoaded = Sysex::loadSysex(fullpath);
+				}
+			}
 			if (synth) {
+				MIDIKRAFT_TRACE_SCOPE("Synth::loadSysex", "import");
 				patches = synth->loadSysex(messagesLoaded);
 			}
 		}
@@ -470,8 +575,24 @@ namespace midikraft {
 			//}
 		}
 
+		return tagPatchesWithFileSource(synth, patches, fullpath, filename, automaticCategories);
+	}
+
+	std::vector<PatchHolder> Librarian::loadSysexPatchesFromData(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, SysexSpan const &content, std::shared_ptr<AutomaticCategory> automaticCategories) {
+		MIDIKRAFT_TRACE_SCOPE("Librarian::loadSysexPatchesFromData", "import");
+		TPatchVector patches;
+		if (synth) {
+			MIDIKRAFT_TRACE_SCOPE("Synth::loadSysex", "import");
+			patches = synth->loadSysex(SysexSpan::toMidiMessages(content.messages()));
+		}
+		return tagPatchesWithFileSource(synth, patches, fullpath, filename, automaticCategories);
+	}
+
+	std::vector<PatchHolder> Librarian::tagPatchesWithFileSource(std::shared_ptr<Synth> synth, TPatchVector &patches, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories) {
 		// Add the meta information
+		MIDIKRAFT_TRACE_SCOPE("Create PatchHolders", "import");
 		std::vector<PatchHolder> result;
+		result.reserve(patches.size());
 		int i = 0;
 		for (auto patch : patches) {
 			result.push_back(PatchHolder(synth, std::make_shared<FromFileSource>(filename, fullpath, MidiProgramNumber::fromZeroBase(i)), patch, 
@@ -482,6 +603,7 @@ namespace midikraft {
 	}
 
 	std::vector<PatchHolder> Librarian::loadSysexPatchesManualDump(std::shared_ptr<Synth> synth, std::vector<MidiMessage> const &messages, std::shared_ptr<AutomaticCategory> automaticCategories) {
+		MIDIKRAFT_TRACE_SCOPE("Librarian::loadSysexPatchesManualDump", "import");
 		TPatchVector patches;
 		if (synth) {
 			patches = synth->loadSysex(messages);
@@ -506,6 +628,8 @@ namespace midikraft {
 
 		virtual void run() override
 		{
+			MIDIKRAFT_TRACE_SCOPE("ExportSysexFilesInBackground", "export");
+			MemoryAccounting::ScopedOperation memory("export");
 			if (destination.existsAsFile()) {
 				destination.deleteFile();
 			}
@@ -515,100 +639,12 @@ namespace midikraft {
 				return;
 			}
 
-			// Create a temporary directory to build the result
-			TemporaryDirectory tempDir;
-
-			// Now, iterate over the list of patches and pack them one by one into the zip file!		
-			ZipFile::Builder builder;
-			std::vector<MidiMessage> allMessages;
-			int count = 0;
-			for (const auto& patch : patches) {
-				if (patch.patch()) {
-					std::vector<MidiMessage> sysexMessages;
-					switch (params.formatOption) {
-					case Librarian::PROGRAM_DUMPS:
-					{
-						// Let's see if we have program dump capability for the synth!
-						auto pdc = Capability::hasCapability<ProgramDumpCabability>(patch.synth());
-						if (pdc) {
-							sysexMessages = pdc->patchToProgramDumpSysex(patch.patch(), patch.patchNumber());
-							break;
-						}
-						// fall through do default then
-					}
-					default:
-					case Librarian::EDIT_BUFFER_DUMPS:
-						// Every synth is forced to have an implementation for this
-						sysexMessages = patch.synth()->dataFileToSysex(patch.patch(), nullptr);
-						break;
-					}
-
-					String fileName = patch.name();
-					switch (params.fileOption) {
-					case Librarian::MANY_FILES:
-					{
-						std::string result = Sysex::saveSysexIntoNewFile(destination.getFullPathName().toStdString(), File::createLegalFileName(fileName.trim()).toStdString(), sysexMessages);
-						break;
-					}
-					case Librarian::ZIPPED_FILES:
-					{
-						std::string result = Sysex::saveSysexIntoNewFile(tempDir.name(), File::createLegalFileName(fileName.trim()).toStdString(), sysexMessages);
-						builder.addFile(File(result), 6);
-						break;
-					}
-					case Librarian::MID_FILE:
-					case Librarian::ONE_FILE:
-					{
-						std::copy(sysexMessages.begin(), sysexMessages.end(), std::back_inserter(allMessages));
-						break;
-					}
-					}
-				}
-				setProgress(count++ / (double)patches.size());
-				if (threadShouldExit()) {
-					break;
-				}
-			}
-			switch (params.fileOption)
-			{
-			case Librarian::ZIPPED_FILES:
-			{
-				FileOutputStream targetStream(destination);
-				builder.writeToStream(targetStream, nullptr);
-				break;
-			}
-			case Librarian::ONE_FILE:
-			{
-				Sysex::saveSysex(destination.getFullPathName().toStdString(), allMessages);
-				break;
-			}
-			case Librarian::MID_FILE:
-			{
-				MidiFile midiFile;
-				MidiMessageSequence mmSeq;
-				for (const auto& msg : allMessages) {
-					mmSeq.addEvent(msg, 0.0);
-				}
-
-				// Add to track 1 of MIDI file
-				midiFile.addTrack(mmSeq);
-				midiFile.setTicksPerQuarterNote(96);
-
-				// Done, write to file
-				File file(destination);
-				if (file.existsAsFile()) {
-					file.deleteFile();
-				}
-				FileOutputStream stream(file);
-				if (!midiFile.writeTo(stream, 1)) {
-					SimpleLogger::instance()->postMessage("ERROR: Failed to write SMF file to " + destination.getFullPathName());
-				}
-				stream.flush();
-			}
-			default:
-				// Nothing to do
-				break;
-			}
+			ExportPipeline pipeline;
+			pipeline.addSink(ExportPipeline::createSink(params.fileOption, params.formatOption, destination));
+			pipeline.run(patches, [this](double progress) {
+				setProgress(progress);
+				return !threadShouldExit();
+			});
 		}
 
 	private:
@@ -696,6 +732,11 @@ namespace midikraft {
 		}
 	}
 
+	void Librarian::setVersionHistory(std::shared_ptr<PatchVersionHistory> history)
+	{
+		versionHistory_ = history;
+	}
+
 	void Librarian::clearHandlers()
 	{
 		// This is to clear up any remaining MIDI callback handlers, e.g. on User canceling an operation
@@ -704,6 +745,62 @@ namespace midikraft {
 			handles_.pop();
 			MidiController::instance()->removeMessageHandler(handle);
 		}
+		if (sequencerDownload_) {
+			sequencerDownload_->cancel();
+			sequencerDownload_.reset();
+		}
+		// No more messages to come, which ends the download operation
+		downloadOperation_.reset();
+	}
+
+	void Librarian::updateDownloadAccounting()
+	{
+		// The payload is counted as the messages come in, so this stays constant time per received message
+		int64 bytes = downloadPayloadBytes_;
+		for (auto buffer : { &currentDownload_, &currentEditBuffer_, &currentProgramDump_ }) {
+			bytes += (int64)(buffer->capacity() * sizeof(MidiMessage));
+		}
+		downloadMemory_.setBytes(bytes);
+	}
+
+	void Librarian::appendToDownload(std::vector<MidiMessage> &buffer, MidiMessage const &message)
+	{
+		buffer.push_back(message);
+		downloadPayloadBytes_ += message.getRawDataSize();
+		updateDownloadAccounting();
+	}
+
+	void Librarian::moveIntoDownload(std::vector<MidiMessage> &partialBuffer)
+	{
+		// The payload just changes buffers, so the count stays. Moving, the partial buffer is cleared before the next request anyway
+		std::move(partialBuffer.begin(), partialBuffer.end(), std::back_inserter(currentDownload_));
+		partialBuffer.clear();
+		updateDownloadAccounting();
+	}
+
+	void Librarian::clearDownloadBuffer(std::vector<MidiMessage> &buffer)
+	{
+		for (auto const &message : buffer) {
+			downloadPayloadBytes_ -= message.getRawDataSize();
+		}
+		buffer.clear();
+		updateDownloadAccounting();
+	}
+
+	void Librarian::reserveDownloadBuffers(std::shared_ptr<Synth> synth, MidiBankNumber bankNo)
+	{
+		// The buffers are only cleared between downloads, never shrunk, so after this the receive handlers don't reallocate.
+		// One message per patch is the common case, synths with multi-message dumps grow the buffer a few times only.
+		const size_t kPartialDumpReserve = 8;
+		size_t expected = 0;
+		if (midikraft::Capability::hasCapability<HasBankDescriptorsCapability>(synth) || midikraft::Capability::hasCapability<HasBanksCapability>(synth)) {
+			expected = (size_t)std::max(0, numberOfPatchesInBank(synth, bankNo));
+		}
+		currentDownload_.reserve(expected);
+		currentEditBuffer_.reserve(kPartialDumpReserve);
+		currentProgramDump_.reserve(kPartialDumpReserve);
+		handshakeAnswer_.reserve(kPartialDumpReserve);
+		updateDownloadAccounting();
 	}
 
 	void Librarian::startDownloadNextEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, bool sendProgramChange) {
@@ -711,7 +808,7 @@ namespace midikraft {
 		std::vector<MidiMessage> messages;
 		auto editBufferCapability = midikraft::Capability::hasCapability<EditBufferCapability>(synth);
 		if (editBufferCapability) {
-			currentEditBuffer_.clear();
+			clearDownloadBuffer(currentEditBuffer_);
 			auto midiLocation = midikraft::Capability::hasCapability<MidiLocationCapability>(synth);
 			if (midiLocation) {
 				if (sendProgramChange) {
@@ -731,7 +828,7 @@ namespace midikraft {
 
 		// Send messages
 		if (!messages.empty()) {
-			synth->sendBlockOfMessagesToSynth(midiOutput->name(), messages);
+			sendToSynth(synth, midiOutput->name(), messages);
 		}
 	}
 
@@ -740,7 +837,7 @@ namespace midikraft {
 		std::vector<MidiMessage> messages;
 		auto programDumpCapability = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth);
 		if (programDumpCapability) {
-			currentProgramDump_.clear();
+			clearDownloadBuffer(currentProgramDump_);
 			messages = programDumpCapability->requestPatch(downloadNumber_);
 		}		
 		else {
@@ -750,7 +847,7 @@ namespace midikraft {
 
 		// Send messages
 		if (!messages.empty()) {
-			synth->sendBlockOfMessagesToSynth(midiOutput->name(), messages);
+			sendToSynth(synth, midiOutput->name(), messages);
 		}
 	}
 
@@ -759,20 +856,54 @@ namespace midikraft {
 		// If this is a synth, it has a throttled send method
 		auto synth = dynamic_cast<Synth *>(sequencer);
 		if (synth) {
-			synth->sendBlockOfMessagesToSynth(midiOutput->name(), request);
+			sendToSynth(synth, midiOutput->name(), request);
 		}
 		else {
 			// This is not a synth... fall back to old behavior
-			midiOutput->sendBlockOfMessagesFullSpeed(request);
+			if (sessionRecorder_) sessionRecorder_->recordSent(request);
+			if (sessionReplay_) {
+				sessionReplay_->requestSent(request);
+			}
+			else {
+				midiOutput->sendBlockOfMessagesFullSpeed(request);
+			}
+		}
+	}
+
+	void Librarian::sendToSynth(Synth *synth, std::string const &midiOutput, std::vector<MidiMessage> const &messages)
+	{
+		if (sessionRecorder_) {
+			sessionRecorder_->recordSent(messages);
 		}
+		if (sessionReplay_) {
+			sessionReplay_->requestSent(messages);
+			return;
+		}
+		synth->sendBlockOfMessagesToSynth(midiOutput, messages);
+	}
+
+	void Librarian::sendToSynth(std::shared_ptr<Synth> const &synth, std::string const &midiOutput, std::vector<MidiMessage> const &messages)
+	{
+		sendToSynth(synth.get(), midiOutput, messages);
+	}
+
+	void Librarian::setSessionRecorder(std::shared_ptr<MidiSessionRecorder> recorder)
+	{
+		sessionRecorder_ = recorder;
+	}
+
+	void Librarian::setSessionReplay(std::shared_ptr<MidiSessionReplay> replay)
+	{
+		sessionReplay_ = replay;
 	}
 
 	void Librarian::handleNextStreamPart(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, const juce::MidiMessage &message, StreamLoadCapability::StreamType streamType)
 	{
+		MIDIKRAFT_TRACE_SCOPE("Librarian::handleNextStreamPart", "download");
 		auto streamLoading = midikraft::Capability::hasCapability<StreamLoadCapability>(synth);
 		if (streamLoading) {
 			if (streamLoading->isMessagePartOfStream(message, streamType)) {
-				currentDownload_.push_back(message);
+				appendToDownload(currentDownload_, message);
 				int progressTotal = streamLoading->numberOfStreamMessagesExpected(streamType);
 				if (progressTotal > 0 && progressHandler) {
 					progressHandler->setProgressPercentage(currentDownload_.size() / (double)progressTotal);
@@ -780,7 +911,9 @@ namespace midikraft {
 				if (streamLoading->isStreamComplete(currentDownload_, streamType)) {
 					clearHandlers();
 					auto result = synth->loadSysex(currentDownload_);
-					onFinished_(tagPatchesWithImportFromSynth(synth, result, currentDownloadBank_));
+					// currentDownloadBank_ is only set by bank downloads, an edit buffer stream has no program place
+					auto bankNo = streamType == StreamLoadCapability::StreamType::EDIT_BUFFER_DUMP ? MidiBankNumber::invalid() : currentDownloadBank_;
+					onFinished_(tagPatchesWithImportFromSynth(synth, result, bankNo));
 					if (progressHandler) progressHandler->onSuccess();
 				}
 				else if (progressHandler && progressHandler->shouldAbort()) {
@@ -790,7 +923,7 @@ namespace midikraft {
 				else if (streamLoading->shouldStreamAdvance(currentDownload_, streamType)) {
 					downloadNumber_++;
 					auto messages = streamLoading->requestStreamElement(downloadNumber_, streamType);
-					synth->sendBlockOfMessagesToSynth(midiOutput->name(), messages);
+					sendToSynth(synth, midiOutput->name(), messages);
 					if (progressTotal == -1 && progressHandler) progressHandler->setProgressPercentage(downloadNumber_ / (double)expectedDownloadNumber_);
 				}
 			}
@@ -801,13 +934,14 @@ namespace midikraft {
 	}
 
 	void Librarian::handleNextEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, const juce::MidiMessage &editBuffer, MidiBankNumber bankNo) {
+		MIDIKRAFT_TRACE_SCOPE("Librarian::handleNextEditBuffer", "download");
 		auto editBufferCapability = midikraft::Capability::hasCapability<EditBufferCapability>(synth);
 		// This message might be a part of a multi-message program dump?
 		if (editBufferCapability && editBufferCapability->isMessagePartOfEditBuffer(editBuffer)) {
-			currentEditBuffer_.push_back(editBuffer);
+			appendToDownload(currentEditBuffer_, editBuffer);
 			if (editBufferCapability->isEditBufferDump(currentEditBuffer_)) {
 				// Ok, that worked, save it and continue!
-				std::copy(currentEditBuffer_.begin(), currentEditBuffer_.end(), std::back_inserter(currentDownload_));
+				moveIntoDownload(currentEditBuffer_);
 
 				// Finished?
 				if (downloadNumber_ >= endDownloadNumber_-1) {
@@ -833,13 +967,14 @@ namespace midikraft {
 	}
 
 	void Librarian::handleNextProgramBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler* progressHandler, const juce::MidiMessage& editBuffer, MidiBankNumber bankNo) {
+		MIDIKRAFT_TRACE_SCOPE("Librarian::handleNextProgramBuffer", "download");
 		auto programDumpCapability = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth);
 		// This message might be a part of a multi-message program dump?
 		if (programDumpCapability && programDumpCapability->isMessagePartOfProgramDump(editBuffer)) {
-			currentProgramDump_.push_back(editBuffer);
+			appendToDownload(currentProgramDump_, editBuffer);
 			if (programDumpCapability->isSingleProgramDump(currentProgramDump_)) {
 				// Ok, that worked, save it and continue!
-				std::copy(currentProgramDump_.begin(), currentProgramDump_.end(), std::back_inserter(currentDownload_));
+				moveIntoDownload(currentProgramDump_);
 
 				// Finished?
 				if (downloadNumber_ >= endDownloadNumber_ - 1) {
@@ -863,10 +998,11 @@ namespace midikraft {
 
 	void Librarian::handleNextBankDump(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, const juce::MidiMessage &bankDump, MidiBankNumber bankNo)
 	{
+		MIDIKRAFT_TRACE_SCOPE("Librarian::handleNextBankDump", "download");
 		ignoreUnused(midiOutput); //TODO why?
 		auto bankDumpCapability = midikraft::Capability::hasCapability<BankDumpCapability>(synth);
 		if (bankDumpCapability && bankDumpCapability->isBankDump(bankDump)) {
-			currentDownload_.push_back(bankDump);
+			appendToDownload(currentDownload_, bankDump);
 			if (bankDumpCapability->isBankDumpFinished(currentDownload_)) {
 				clearHandlers();
 				auto patches = synth->loadSysex(currentDownload_);
@@ -884,6 +1020,7 @@ namespace midikraft {
 	}
 
 	std::vector<PatchHolder> Librarian::tagPatchesWithImportFromSynth(std::shared_ptr<Synth> synth, TPatchVector &patches, MidiBankNumber bankNo) {
+		MIDIKRAFT_TRACE_SCOPE("Librarian::tagPatchesWithImportFromSynth", "download");
 		std::vector<PatchHolder> result;
 		auto now = Time::getCurrentTime();
 		int i = 0;
@@ -893,7 +1030,12 @@ namespace midikraft {
 			if (realpatch) {
 				place = realpatch->patchNumber();
 			}
-			result.push_back(PatchHolder(synth, std::make_shared<FromSynthSource>(now, bankNo), patch, bankNo, place));
+			// An invalid bank marks an edit buffer download in the source info, which keeps it out of the version history.
+			// The holder itself gets bank 0 like the other edit buffer imports.
+			result.push_back(PatchHolder(synth, std::make_shared<FromSynthSource>(now, bankNo), patch, bankNo.isValid() ? bankNo : MidiBankNumber::fromZeroBase(0), place));
+			if (versionHistory_) {
+				versionHistory_->addVersion(result.back());
+			}
 		}
 		return result;
 	}
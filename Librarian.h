@@ -13,9 +13,15 @@
 #include "ProgressHandler.h"
 #include "MidiBankNumber.h"
 #include "SynthHolder.h"
+#include "SynthRegistry.h"
 #include "PatchHolder.h"
+#include "MemoryAccounting.h"
 #include "DataFileLoadCapability.h"
 #include "StreamLoadCapability.h"
+#include "PatchVersionHistory.h"
+#include "PipelinedDataDownload.h"
+#include "MidiSessionRecorder.h"
+#include "SysexSpan.h"
 
 #include <stack>
 
@@ -28,7 +34,11 @@ namespace midikraft {
 		typedef std::function<void(std::vector<PatchHolder>)> TFinishedHandler;
 		typedef std::function<void(std::vector<std::shared_ptr<DataFile>>)> TStepSequencerFinishedHandler;
 
-		Librarian(std::vector<SynthHolder> const &synths) : synths_(synths), currentDownloadBank_(MidiBankNumber::fromZeroBase(0)), downloadNumber_(0), startDownloadNumber_(0), endDownloadNumber_(0) {}
+		// Adds the synths to the SynthRegistry, which all synth lookups by name go through. Synths registered by others stay, so a
+		// second Librarian (e.g. the one of a LibrarianService) doesn't take them away from the rest of the process
+		Librarian(std::vector<SynthHolder> const &synths) : downloadMemory_(MemoryAccounting::Kind::DOWNLOAD_BUFFER), downloadPayloadBytes_(0), currentDownloadBank_(MidiBankNumber::fromZeroBase(0)), downloadNumber_(0), startDownloadNumber_(0), endDownloadNumber_(0) {
+			SynthRegistry::instance().add(synths);
+		}
 
 		void startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, MidiBankNumber bankNo, ProgressHandler *progressHandler, TFinishedHandler onFinished);
 		void startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo, ProgressHandler *progressHandler, TFinishedHandler onFinished);
@@ -36,10 +46,14 @@ namespace midikraft {
 		void downloadEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, TFinishedHandler onFinished);
 
 		void startDownloadingSequencerData(std::shared_ptr<SafeMidiOutput> midiOutput, DataFileLoadCapability *sequencer, int dataFileIdentifier, ProgressHandler *progressHandler, TStepSequencerFinishedHandler onFinished);
+		// Batched variant, keeps a window of requests in flight and can hand over each item as soon as it has arrived
+		void startDownloadingSequencerData(std::shared_ptr<SafeMidiOutput> midiOutput, DataFileLoadCapability *sequencer, int dataFileIdentifier, PipelinedDataDownload::Options const &options, ProgressHandler *progressHandler, TStepSequencerFinishedHandler onFinished);
 
 		Synth *sniffSynth(std::vector<MidiMessage> const &messages) const;
 		std::vector<PatchHolder> loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::shared_ptr<AutomaticCategory> automaticCategories);
 		std::vector<PatchHolder> loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories);
+		// Same as above for a .syx file whose content has already been read, e.g. in a batch with BatchFileIO
+		std::vector<PatchHolder> loadSysexPatchesFromData(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, SysexSpan const &content, std::shared_ptr<AutomaticCategory> automaticCategories);
 		std::vector<PatchHolder> loadSysexPatchesManualDump(std::shared_ptr<Synth> synth, std::vector<MidiMessage> const &messages, std::shared_ptr<AutomaticCategory> automaticCategories);
 
 		enum ExportFormatOption {
@@ -61,6 +75,15 @@ namespace midikraft {
 
 		void clearHandlers();
 
+		// Optional - if set, every patch downloaded from a synth program place is recorded as a new version of that place
+		void setVersionHistory(std::shared_ptr<PatchVersionHistory> history);
+
+		// Optional - if set and recording, all requests sent during downloads are written to the session recording
+		void setSessionRecorder(std::shared_ptr<MidiSessionRecorder> recorder);
+
+		// Optional - if set, all requests are handed to the replay instead of being sent to the synth, for tests with a recorded session
+		void setSessionReplay(std::shared_ptr<MidiSessionReplay> replay);
+
 	private:
 		void startDownloadNextEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, bool sendProgramChange);
 		void startDownloadNextPatch(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth);
@@ -70,19 +93,35 @@ namespace midikraft {
 		void handleNextProgramBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler* progressHandler, const juce::MidiMessage& editBuffer, MidiBankNumber bankNo);
 		void handleNextBankDump(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler* progressHandler, const juce::MidiMessage& bankDump, MidiBankNumber bankNo);
 
+		std::vector<PatchHolder> tagPatchesWithFileSource(std::shared_ptr<Synth> synth, TPatchVector &patches, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories);
 		std::vector<PatchHolder> tagPatchesWithImportFromSynth(std::shared_ptr<Synth> synth, TPatchVector &patches, MidiBankNumber bankNo);
 		void tagPatchesWithMultiBulkImport(std::vector<PatchHolder> &patches);
 
+		void sendToSynth(Synth *synth, std::string const &midiOutput, std::vector<MidiMessage> const &messages);
+		void sendToSynth(std::shared_ptr<Synth> const &synth, std::string const &midiOutput, std::vector<MidiMessage> const &messages);
 		void updateLastPath(std::string &lastPathVariable, std::string const &settingsKey);
-
-		std::vector<SynthHolder> synths_;
+		void updateDownloadAccounting();
+		// All changes to the three download buffers go through these, to keep downloadPayloadBytes_ up to date
+		void appendToDownload(std::vector<MidiMessage> &buffer, MidiMessage const &message);
+		void moveIntoDownload(std::vector<MidiMessage> &partialBuffer);
+		void clearDownloadBuffer(std::vector<MidiMessage> &buffer);
+		void reserveDownloadBuffers(std::shared_ptr<Synth> synth, MidiBankNumber bankNo);
+
+		std::shared_ptr<PatchVersionHistory> versionHistory_;
+		std::shared_ptr<MidiSessionRecorder> sessionRecorder_;
+		std::shared_ptr<MidiSessionReplay> sessionReplay_;
 		std::vector<MidiMessage> currentDownload_;
 		std::vector<MidiMessage> currentEditBuffer_;
 		std::vector<MidiMessage> currentProgramDump_;
+		std::vector<MidiMessage> handshakeAnswer_; // Reused for every message of a handshake download
+		TrackedAllocation downloadMemory_;
+		int64 downloadPayloadBytes_;
+		std::unique_ptr<MemoryAccounting::ScopedOperation> downloadOperation_;
 		MidiBankNumber currentDownloadBank_;
 		std::stack<MidiController::HandlerHandle> handles_;
 		TFinishedHandler onFinished_;
 		TStepSequencerFinishedHandler onSequencerFinished_;
+		std::shared_ptr<PipelinedDataDownload> sequencerDownload_;
 		int downloadNumber_;
 		int startDownloadNumber_;
 		int endDownloadNumber_;
@@ -0,0 +1,629 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "LibrarianService.h"
+
+#include "ConcurrentSynthAccess.h"
+#include "ExportPipeline.h"
+#include "PatchInterchangeFormat.h"
+#include "MemoryBudget.h"
+#include "Synth.h"
+#include "SynthRegistry.h"
+#include "TaskScheduler.h"
+#include "Trace.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+// macOS has no MSG_NOSIGNAL, a closed client then raises SIGPIPE unless the host ignores it
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace midikraft {
+
+	namespace {
+
+		std::string patchKey(std::string const &synthName, std::string const &md5) {
+			return synthName + ":" + md5;
+		}
+
+		bool sendAll(int socket, std::string const &data) {
+			size_t sent = 0;
+			while (sent < data.size()) {
+				auto result = ::send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+				if (result <= 0) {
+					return false;
+				}
+				sent += (size_t)result;
+			}
+			return true;
+		}
+
+		// Reads until a complete line is in the buffer, returns false when the connection is closed
+		bool readLine(int socket, std::string &buffer, std::string &outLine) {
+			while (true) {
+				auto newline = buffer.find('\n');
+				if (newline != std::string::npos) {
+					outLine = buffer.substr(0, newline);
+					buffer.erase(0, newline + 1);
+					return true;
+				}
+				char chunk[4096];
+				auto received = ::recv(socket, chunk, sizeof(chunk), 0);
+				if (received <= 0) {
+					return false;
+				}
+				buffer.append(chunk, (size_t)received);
+			}
+		}
+
+		std::vector<Synth *> synthsOf(std::vector<PatchHolder> const &patches) {
+			std::set<Synth *> synths;
+			for (auto const &patch : patches) {
+				synths.insert(patch.synth());
+			}
+			return std::vector<Synth *>(synths.begin(), synths.end());
+		}
+
+		nlohmann::json error(std::string const &message) {
+			return { { "ok", false }, { "error", message } };
+		}
+
+		int fileOptionFromString(std::string const &type) {
+			if (type == "MANY_FILES") return Librarian::MANY_FILES;
+			if (type == "ZIPPED_FILES") return Librarian::ZIPPED_FILES;
+			if (type == "ONE_FILE") return Librarian::ONE_FILE;
+			if (type == "MID_FILE") return Librarian::MID_FILE;
+			return -1;
+		}
+
+	}
+
+	LibrarianService::LibrarianService(std::vector<SynthHolder> const &synths, std::shared_ptr<AutomaticCategory> detector) :
+		detector_(detector), librarian_(synths), nextResultSet_(0), listenSocket_(-1), running_(false), activeClients_(0)
+	{
+	}
+
+	LibrarianService::~LibrarianService()
+	{
+		stop();
+	}
+
+	bool LibrarianService::start(std::string const &socketPath)
+	{
+		stop();
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (socketPath.size() >= sizeof(address.sun_path)) {
+			SimpleLogger::instance()->postMessage("Socket path too long for a Unix domain socket: " + socketPath);
+			return false;
+		}
+		strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+		// A stale socket file of a crashed service would block the bind, but anything else at that path is not ours to delete
+		struct stat existing;
+		if (::lstat(socketPath.c_str(), &existing) == 0) {
+			if (!S_ISSOCK(existing.st_mode)) {
+				SimpleLogger::instance()->postMessage("Refusing to start the service, there is a file that is not a socket at " + socketPath);
+				return false;
+			}
+			::unlink(socketPath.c_str());
+		}
+
+		listenSocket_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listenSocket_ < 0) {
+			SimpleLogger::instance()->postMessage("Failed to create service socket");
+			return false;
+		}
+		// Only the user running the service may connect. The umask applies at creation, a chmod after the bind would leave a window
+		mode_t previousMask = ::umask(0077);
+		bool bound = ::bind(listenSocket_, (sockaddr *)&address, sizeof(address)) == 0;
+		int bindError = errno;
+		::umask(previousMask);
+		if (!bound || ::listen(listenSocket_, 16) != 0) {
+			SimpleLogger::instance()->postMessage((boost::format("Failed to listen on %s: %s") % socketPath % strerror(bound ? errno : bindError)).str());
+			::close(listenSocket_);
+			listenSocket_ = -1;
+			return false;
+		}
+		socketPath_ = socketPath;
+		running_ = true;
+		acceptThread_ = std::thread([this]() { acceptLoop(); });
+		return true;
+	}
+
+	void LibrarianService::stop()
+	{
+		if (!running_.exchange(false)) {
+			return;
+		}
+		// Closing the sockets wakes up the blocked accept and recv calls
+		::shutdown(listenSocket_, SHUT_RDWR);
+		::close(listenSocket_);
+		listenSocket_ = -1;
+		if (acceptThread_.joinable()) {
+			acceptThread_.join();
+		}
+		{
+			// The client threads are detached, wait until the last one has said goodbye
+			std::unique_lock<std::mutex> lock(clientsLock_);
+			for (int client : clientSockets_) {
+				::shutdown(client, SHUT_RDWR);
+			}
+			clientsDone_.wait(lock, [this]() { return activeClients_ == 0; });
+		}
+		struct stat existing;
+		if (::lstat(socketPath_.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+			::unlink(socketPath_.c_str());
+		}
+
+		std::lock_guard<std::mutex> lock(resultSetLock_);
+		for (auto const &resultSet : resultSets_) {
+			::shm_unlink(resultSet.first.c_str());
+		}
+		resultSets_.clear();
+	}
+
+	bool LibrarianService::isRunning() const
+	{
+		return running_;
+	}
+
+	void LibrarianService::setLibrary(std::vector<PatchHolder> const &patches)
+	{
+		{
+			std::unique_lock<std::shared_mutex> lock(libraryLock_);
+			patches_.clear();
+			index_.clear();
+		}
+		addPatches(patches);
+	}
+
+	size_t LibrarianService::numberOfPatches() const
+	{
+		std::shared_lock<std::shared_mutex> lock(libraryLock_);
+		return patches_.size();
+	}
+
+	void LibrarianService::acceptLoop()
+	{
+		while (running_) {
+			int client = ::accept(listenSocket_, nullptr, nullptr);
+			if (client < 0) {
+				if (running_ && errno == EINTR) continue;
+				break;
+			}
+			// Detached, so short lived clients don't pile up thread handles. stop() waits for activeClients_ to drop to zero.
+			std::lock_guard<std::mutex> lock(clientsLock_);
+			clientSockets_.push_back(client);
+			activeClients_++;
+			std::thread([this, client]() { serveClient(client); }).detach();
+		}
+	}
+
+	void LibrarianService::serveClient(int clientSocket)
+	{
+		std::string buffer;
+		std::string line;
+		while (running_ && readLine(clientSocket, buffer, line)) {
+			nlohmann::json answer;
+			try {
+				answer = handleRequest(nlohmann::json::parse(line), clientSocket);
+			}
+			catch (nlohmann::json::exception &e) {
+				answer = error(std::string("Invalid request: ") + e.what());
+			}
+			if (!sendAll(clientSocket, answer.dump(-1, ' ', false, nlohmann::detail::error_handler_t::replace) + "\n")) {
+				break;
+			}
+		}
+		// A client that crashed or just went away can't release its result sets anymore. Done before the close, the socket number can
+		// be reused right after
+		releaseResultSets(clientSocket);
+		::close(clientSocket);
+		std::lock_guard<std::mutex> lock(clientsLock_);
+		clientSockets_.erase(std::remove(clientSockets_.begin(), clientSockets_.end(), clientSocket), clientSockets_.end());
+		activeClients_--;
+		clientsDone_.notify_all();
+	}
+
+	nlohmann::json LibrarianService::handleRequest(nlohmann::json const &request)
+	{
+		return handleRequest(request, -1);
+	}
+
+	nlohmann::json LibrarianService::handleRequest(nlohmann::json const &request, int clientSocket)
+	{
+		MIDIKRAFT_TRACE_SCOPE("LibrarianService::handleRequest", "service");
+		nlohmann::json answer;
+		std::string op = request.value("op", "");
+		try {
+			if (op == "status") answer = status();
+			else if (op == "query") answer = query(request, clientSocket);
+			else if (op == "import") answer = import(request);
+			else if (op == "export") answer = exportPatches(request);
+			else if (op == "categorize") answer = categorize(request);
+			else if (op == "setCategory") answer = setCategory(request);
+			else if (op == "save") answer = save(request);
+			else if (op == "release") answer = release(request);
+			else answer = error("Unknown op '" + op + "'");
+		}
+		catch (std::exception &e) {
+			answer = error(e.what());
+		}
+		if (request.contains("id")) {
+			answer["id"] = request["id"];
+		}
+		return answer;
+	}
+
+	std::vector<size_t> LibrarianService::filter(nlohmann::json const &filter) const
+	{
+		std::string synth = filter.value("synth", "");
+		String name = String(filter.value("name", ""));
+		std::string categoryName = filter.value("category", "");
+		bool onlyFavorites = filter.value("favorite", false);
+
+		std::vector<size_t> result;
+		for (size_t i = 0; i < patches_.size(); i++) {
+			auto const &patch = patches_[i];
+			if (!synth.empty() && (!patch.synth() || patch.synth()->getName() != synth)) continue;
+			if (onlyFavorites && !patch.isFavorite()) continue;
+			if (name.isNotEmpty() && !String(patch.name()).containsIgnoreCase(name)) continue;
+			if (!categoryName.empty()) {
+				auto categories = patch.categories();
+				if (std::none_of(categories.begin(), categories.end(), [&](Category const &c) { return c.category() == categoryName; })) continue;
+			}
+			result.push_back(i);
+		}
+		return result;
+	}
+
+	nlohmann::json LibrarianService::patchToJson(PatchHolder const &patch) const
+	{
+		nlohmann::json categories = nlohmann::json::array();
+		for (auto const &category : patch.categories()) {
+			categories.push_back(category.category());
+		}
+		std::string md5;
+		{
+			SynthAccessLock access(patch.synth());
+			md5 = patch.md5();
+		}
+		return {
+			{ "synth", patch.synth() ? patch.synth()->getName() : "" },
+			{ "name", patch.name() },
+			{ "md5", md5 },
+			{ "favorite", patch.isFavorite() },
+			{ "bank", patch.bankNumber().toZeroBased() },
+			{ "place", patch.patchNumber().toZeroBased() },
+			{ "categories", categories }
+		};
+	}
+
+	void LibrarianService::addPatches(std::vector<PatchHolder> const &patches)
+	{
+		// Fingerprints outside of the lock, they can be expensive. parallelForSynths serializes them with all other calls into
+		// adaptations without ConcurrentAccessCapability, e.g. by an export of another client
+		std::vector<std::string> keys(patches.size());
+		parallelForSynths(TaskScheduler::Priority::IMPORT, patches.size(), [&](size_t i) { return patches[i].synth(); }, [&](size_t i) {
+			if (patches[i].synth() && patches[i].patch()) {
+				keys[i] = patchKey(patches[i].synth()->getName(), patches[i].md5());
+			}
+		});
+		std::unique_lock<std::shared_mutex> lock(libraryLock_);
+		for (size_t i = 0; i < patches.size(); i++) {
+			if (!keys[i].empty() && index_.find(keys[i]) == index_.end()) {
+				index_[keys[i]] = patches_.size();
+				patches_.push_back(patches[i]);
+			}
+		}
+	}
+
+	nlohmann::json LibrarianService::status()
+	{
+		nlohmann::json synths = nlohmann::json::array();
+		for (auto const &entry : *SynthRegistry::instance().snapshot()) {
+			synths.push_back(entry.first);
+		}
+		return {
+			{ "ok", true },
+			{ "patches", numberOfPatches() },
+			{ "synths", synths },
+			{ "caches", nlohmann::json::parse(MemoryBudget::instance().report()) }
+		};
+	}
+
+	nlohmann::json LibrarianService::query(nlohmann::json const &request, int clientSocket)
+	{
+		size_t offset = request.value("offset", (size_t)0);
+		size_t limit = request.value("limit", std::numeric_limits<size_t>::max());
+		std::vector<nlohmann::json> rows;
+		size_t total;
+		{
+			std::shared_lock<std::shared_mutex> lock(libraryLock_);
+			auto matches = filter(request.value("filter", nlohmann::json::object()));
+			total = matches.size();
+			for (size_t i = offset; i < matches.size() && rows.size() < limit; i++) {
+				rows.push_back(patchToJson(patches_[matches[i]]));
+			}
+		}
+
+		nlohmann::json answer = { { "ok", true }, { "total", total }, { "count", rows.size() } };
+		if (rows.size() <= kInlineResultLimit) {
+			answer["patches"] = rows;
+		}
+		else {
+			std::string data;
+			for (auto const &row : rows) {
+				data += row.dump(-1, ' ', false, nlohmann::detail::error_handler_t::replace);
+				data += '\n';
+			}
+			auto name = createResultSet(data, clientSocket);
+			if (name.empty()) {
+				return error("Failed to create shared memory segment for the result");
+			}
+			answer["shm"] = name;
+			answer["size"] = data.size();
+		}
+		return answer;
+	}
+
+	nlohmann::json LibrarianService::import(nlohmann::json const &request)
+	{
+		auto synth = SynthRegistry::instance().findSynth(request.value("synth", ""));
+		if (!synth) {
+			return error("Unknown synth");
+		}
+		std::vector<PatchHolder> loaded;
+		for (auto const &filename : request.value("files", std::vector<std::string>())) {
+			File file(filename);
+			std::lock_guard<std::mutex> lock(librarianLock_);
+			SynthAccessLock access(synth.get());
+			auto patches = librarian_.loadSysexPatchesFromDisk(synth, file.getFullPathName().toStdString(), file.getFileName().toStdString(), detector_);
+			std::copy(patches.begin(), patches.end(), std::back_inserter(loaded));
+		}
+		size_t before = numberOfPatches();
+		addPatches(loaded);
+		return { { "ok", true }, { "loaded", loaded.size() }, { "added", numberOfPatches() - before } };
+	}
+
+	nlohmann::json LibrarianService::exportPatches(nlohmann::json const &request)
+	{
+		int formatOption = request.value("format", "EDIT_BUFFER_DUMPS") == "PROGRAM_DUMPS" ? Librarian::PROGRAM_DUMPS : Librarian::EDIT_BUFFER_DUMPS;
+		ExportPipeline pipeline;
+		for (auto const &sink : request.value("sinks", nlohmann::json::array())) {
+			std::string type = sink.value("type", "");
+			File destination(sink.value("destination", ""));
+			if (type == "PIF") {
+				pipeline.addSink(ExportPipeline::createPatchInterchangeFormatSink(destination));
+			}
+			else if (type == "METADATA") {
+				pipeline.addSink(ExportPipeline::createMetadataSink(destination));
+			}
+			else if (fileOptionFromString(type) >= 0) {
+				pipeline.addSink(ExportPipeline::createSink(fileOptionFromString(type), formatOption, destination));
+			}
+			else {
+				return error("Unknown sink type '" + type + "'");
+			}
+		}
+		if (pipeline.numberOfSinks() == 0) {
+			return error("No sinks given");
+		}
+		std::vector<PatchHolder> selection;
+		{
+			std::shared_lock<std::shared_mutex> lock(libraryLock_);
+			for (auto i : filter(request.value("filter", nlohmann::json::object()))) {
+				selection.push_back(patches_[i]);
+			}
+		}
+		// Readers run concurrently, so two exports must not call into the same adaptation at once unless it allows that
+		bool ok;
+		{
+			SynthAccessLock access(synthsOf(selection));
+			ok = pipeline.run(selection);
+		}
+		return { { "ok", ok }, { "exported", selection.size() } };
+	}
+
+	nlohmann::json LibrarianService::categorize(nlohmann::json const &request)
+	{
+		std::unique_lock<std::shared_mutex> lock(libraryLock_);
+		auto rows = filter(request.value("filter", nlohmann::json::object()));
+		std::vector<PatchHolder> selection;
+		selection.reserve(rows.size());
+		for (auto i : rows) {
+			selection.push_back(patches_[i]);
+		}
+		auto automatic = detector_->determineAutomaticCategories(selection);
+		size_t changed = 0;
+		for (size_t r = 0; r < rows.size(); r++) {
+			auto &patch = patches_[rows[r]];
+			auto newCategories = patch.categoriesAfterAutoCategorization(automatic[r]);
+			if (newCategories != patch.categories()) {
+				patch.setCategories(newCategories);
+				changed++;
+			}
+		}
+		return { { "ok", true }, { "checked", rows.size() }, { "changed", changed } };
+	}
+
+	nlohmann::json LibrarianService::setCategory(nlohmann::json const &request)
+	{
+		Category category(nullptr);
+		if (!findCategory(detector_, request.value("category", "").c_str(), category)) {
+			return error("Unknown category");
+		}
+		std::unique_lock<std::shared_mutex> lock(libraryLock_);
+		auto found = index_.find(patchKey(request.value("synth", ""), request.value("md5", "")));
+		if (found == index_.end()) {
+			return error("Unknown patch");
+		}
+		auto &patch = patches_[found->second];
+		patch.setCategory(category, request.value("value", true));
+		patch.setUserDecision(category);
+		return { { "ok", true } };
+	}
+
+	nlohmann::json LibrarianService::save(nlohmann::json const &request)
+	{
+		std::string filename = request.value("filename", "");
+		if (filename.empty()) {
+			return error("No filename given");
+		}
+		std::shared_lock<std::shared_mutex> lock(libraryLock_);
+		SynthAccessLock access(synthsOf(patches_));
+		PatchInterchangeFormat::save(patches_, filename);
+		return { { "ok", true }, { "saved", patches_.size() } };
+	}
+
+	nlohmann::json LibrarianService::release(nlohmann::json const &request)
+	{
+		std::string name = request.value("shm", "");
+		std::lock_guard<std::mutex> lock(resultSetLock_);
+		if (resultSets_.erase(name) == 0) {
+			return error("Unknown result set");
+		}
+		::shm_unlink(name.c_str());
+		return { { "ok", true } };
+	}
+
+	std::string LibrarianService::createResultSet(std::string const &data, int clientSocket)
+	{
+		auto name = (boost::format("/midikraft-%d-%d") % getpid() % nextResultSet_++).str();
+		int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0) {
+			return {};
+		}
+		bool ok = ::ftruncate(fd, (off_t)data.size()) == 0;
+		if (ok && !data.empty()) {
+			void *mapped = ::mmap(nullptr, data.size(), PROT_WRITE, MAP_SHARED, fd, 0);
+			ok = mapped != MAP_FAILED;
+			if (ok) {
+				memcpy(mapped, data.data(), data.size());
+				::munmap(mapped, data.size());
+			}
+		}
+		::close(fd);
+		if (!ok) {
+			::shm_unlink(name.c_str());
+			return {};
+		}
+		std::lock_guard<std::mutex> lock(resultSetLock_);
+		resultSets_.emplace(name, clientSocket);
+		return name;
+	}
+
+	void LibrarianService::releaseResultSets(int clientSocket)
+	{
+		std::lock_guard<std::mutex> lock(resultSetLock_);
+		for (auto resultSet = resultSets_.begin(); resultSet != resultSets_.end(); ) {
+			if (resultSet->second == clientSocket) {
+				::shm_unlink(resultSet->first.c_str());
+				resultSet = resultSets_.erase(resultSet);
+			}
+			else {
+				resultSet++;
+			}
+		}
+	}
+
+	LibrarianServiceClient::LibrarianServiceClient() : socket_(-1)
+	{
+	}
+
+	LibrarianServiceClient::~LibrarianServiceClient()
+	{
+		disconnect();
+	}
+
+	bool LibrarianServiceClient::connect(std::string const &socketPath)
+	{
+		disconnect();
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+		socket_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (socket_ < 0 || ::connect(socket_, (sockaddr *)&address, sizeof(address)) != 0) {
+			disconnect();
+			return false;
+		}
+		return true;
+	}
+
+	void LibrarianServiceClient::disconnect()
+	{
+		if (socket_ >= 0) {
+			::close(socket_);
+			socket_ = -1;
+		}
+		buffer_.clear();
+	}
+
+	nlohmann::json LibrarianServiceClient::request(nlohmann::json const &request)
+	{
+		std::string line;
+		if (socket_ < 0 || !sendAll(socket_, request.dump() + "\n") || !readLine(socket_, buffer_, line)) {
+			return nullptr;
+		}
+		return nlohmann::json::parse(line, nullptr, false);
+	}
+
+	std::vector<nlohmann::json> LibrarianServiceClient::queryResult(nlohmann::json const &answer)
+	{
+		std::vector<nlohmann::json> result;
+		if (!answer.is_object() || !answer.value("ok", false)) {
+			return result;
+		}
+		if (answer.contains("patches")) {
+			for (auto const &patch : answer["patches"]) {
+				result.push_back(patch);
+			}
+			return result;
+		}
+		std::string name = answer.value("shm", "");
+		size_t size = answer.value("size", (size_t)0);
+		int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd >= 0) {
+			// Never map beyond the segment, touching those pages would raise SIGBUS
+			struct stat segment;
+			size = ::fstat(fd, &segment) == 0 ? std::min(size, (size_t)segment.st_size) : 0;
+			void *mapped = size > 0 ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+			if (mapped != MAP_FAILED) {
+				// Parse straight from the shared pages, line by line
+				const char *data = static_cast<const char *>(mapped);
+				const char *end = data + size;
+				while (data < end) {
+					const char *newline = static_cast<const char *>(memchr(data, '\n', (size_t)(end - data)));
+					const char *lineEnd = newline ? newline : end;
+					if (lineEnd > data) {
+						result.push_back(nlohmann::json::parse(data, lineEnd, nullptr, false));
+					}
+					data = lineEnd + 1;
+				}
+				::munmap(mapped, size);
+			}
+			::close(fd);
+		}
+		request({ { "op", "release" }, { "shm", name } });
+		return result;
+	}
+
+}
@@ -0,0 +1,140 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "Librarian.h"
+#include "AutomaticCategory.h"
+
+// Turn off warning on unknown pragmas for VC++
+#pragma warning(push)
+#pragma warning(disable: 4068)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#include "nlohmann/json.hpp"
+#pragma GCC diagnostic pop
+#pragma warning(pop)
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace midikraft {
+
+	// Serves one in-memory library to other processes on the same machine over a Unix domain socket (POSIX only).
+	//
+	// The protocol is one JSON object per line in both directions. Every request has an "op" and an optional "id", which is copied
+	// into the answer together with "ok" and, on failure, "error". Operations:
+	//
+	//   status                                      - number of patches, synths and the cache usage
+	//   query      filter, offset, limit            - patches matching the filter
+	//   import     synth, files                     - loads files with the Librarian and adds new patches to the library
+	//   export     filter, format, sinks            - runs the ExportPipeline, sinks is a list of { type, destination },
+	//                                               type is an ExportFileOption name, PIF or METADATA
+	//   categorize filter                           - reruns the automatic categories, respecting user decisions
+	//   setCategory synth, md5, category, value     - sets or clears a category as a user decision
+	//   save       filename                         - writes the whole library as PatchInterchangeFormat
+	//   release    shm                              - the client is done with a result set
+	//
+	// A filter is an object with the optional members synth, name (case insensitive substring), category and favorite.
+	//
+	// Small query results are returned inline as "patches". Larger ones are written once into a POSIX shared memory segment as
+	// JSON lines, and the answer only carries its name and size, so the data is not pushed through the socket. The segment stays
+	// until the client releases it, disconnects, or the service stops.
+	//
+	// Readers (query, export, status) run concurrently, writers (import, categorize, setCategory) get exclusive access.
+	class LibrarianService {
+	public:
+		// The synths are registered with the SynthRegistry by the Librarian
+		LibrarianService(std::vector<SynthHolder> const &synths, std::shared_ptr<AutomaticCategory> detector);
+		~LibrarianService();
+
+		bool start(std::string const &socketPath);
+		void stop();
+		bool isRunning() const;
+
+		// Initial content, e.g. loaded from the database or a PIF backup by the host process
+		void setLibrary(std::vector<PatchHolder> const &patches);
+		size_t numberOfPatches() const;
+
+		// Entry point for one request, public so the host can use the same operations in process
+		nlohmann::json handleRequest(nlohmann::json const &request);
+
+		// Results with more patches than this go into shared memory
+		static const size_t kInlineResultLimit = 100;
+
+	private:
+		void acceptLoop();
+		void serveClient(int clientSocket);
+		// clientSocket owns the result sets created by the request, -1 for requests from the host process
+		nlohmann::json handleRequest(nlohmann::json const &request, int clientSocket);
+
+		std::vector<size_t> filter(nlohmann::json const &filter) const; // Caller holds the library lock
+		nlohmann::json patchToJson(PatchHolder const &patch) const;
+		void addPatches(std::vector<PatchHolder> const &patches);
+
+		nlohmann::json status();
+		nlohmann::json query(nlohmann::json const &request, int clientSocket);
+		nlohmann::json import(nlohmann::json const &request);
+		nlohmann::json exportPatches(nlohmann::json const &request);
+		nlohmann::json categorize(nlohmann::json const &request);
+		nlohmann::json setCategory(nlohmann::json const &request);
+		nlohmann::json save(nlohmann::json const &request);
+		nlohmann::json release(nlohmann::json const &request);
+
+		std::string createResultSet(std::string const &data, int clientSocket);
+		void releaseResultSets(int clientSocket);
+
+		std::shared_ptr<AutomaticCategory> detector_;
+		std::mutex librarianLock_; // The Librarian is not thread safe
+		Librarian librarian_;
+
+		mutable std::shared_mutex libraryLock_;
+		std::vector<PatchHolder> patches_;
+		std::unordered_map<std::string, size_t> index_; // synth name + md5 to position in patches_
+
+		std::mutex resultSetLock_;
+		std::map<std::string, int> resultSets_; // Shared memory segments not yet released, with the socket of the client owning them
+		std::atomic<int> nextResultSet_;
+
+		std::string socketPath_;
+		int listenSocket_;
+		std::atomic<bool> running_;
+		std::thread acceptThread_;
+		std::mutex clientsLock_;
+		std::condition_variable clientsDone_;
+		int activeClients_; // Client threads are detached, this counts the running ones
+		std::vector<int> clientSockets_;
+	};
+
+	// Helper for tools talking to a LibrarianService
+	class LibrarianServiceClient {
+	public:
+		LibrarianServiceClient();
+		~LibrarianServiceClient();
+
+		bool connect(std::string const &socketPath);
+		void disconnect();
+
+		// Sends one request and waits for its answer, returns a null json if the connection failed
+		nlohmann::json request(nlohmann::json const &request);
+
+		// Returns the patches of a query answer, reading and releasing the shared memory segment if the result was not inline
+		std::vector<nlohmann::json> queryResult(nlohmann::json const &answer);
+
+	private:
+		int socket_;
+		std::string buffer_; // Received bytes after the last complete line
+	};
+
+}
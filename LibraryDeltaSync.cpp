@@ -0,0 +1,293 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "LibraryDeltaSync.h"
+
+#include "Logger.h"
+#include "PatchInterchangeFormat.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <array>
+#include <unordered_map>
+
+namespace {
+
+	const char *kSignatureMagic = "MKSIG1";
+	const char *kDeltaMagic = "MKDLT1";
+
+	const uint8 kOpCopy = 0;
+	const uint8 kOpLiteral = 1;
+
+	// Chunk sizes. The average is determined by the number of bits in the mask
+	const size_t kMinChunk = 2048;
+	const size_t kMaxChunk = 65536;
+	const uint64 kChunkMask = (1 << 13) - 1;
+
+	std::array<uint64, 256> const &gearTable() {
+		// Deterministic table via splitmix64, so signatures are compatible across machines and builds
+		static std::array<uint64, 256> table = []() {
+			std::array<uint64, 256> result;
+			uint64 state = 0x4b6e6f624b726166ull;
+			for (auto &entry : result) {
+				state += 0x9e3779b97f4a7c15ull;
+				uint64 z = state;
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+				entry = z ^ (z >> 31);
+			}
+			return result;
+		}();
+		return table;
+	}
+
+	std::string digestKey(uint8 const *digest) {
+		return String::toHexString(digest, 16, 0).toStdString();
+	}
+
+	bool checkMagic(InputStream &in, const char *magic) {
+		char buffer[6];
+		return in.read(buffer, 6) == 6 && memcmp(buffer, magic, 6) == 0;
+	}
+
+	class ReadOnlyMapping {
+	public:
+		ReadOnlyMapping(std::string const &filename) : file_(filename), mapping_(file_, MemoryMappedFile::readOnly) {}
+
+		bool ok() const { return file_.existsAsFile() && (mapping_.getData() != nullptr || file_.getSize() == 0); }
+		uint8 const *data() const { return static_cast<uint8 const *>(mapping_.getData()); }
+		size_t size() const { return mapping_.getData() ? mapping_.getSize() : 0; }
+
+	private:
+		File file_;
+		MemoryMappedFile mapping_;
+	};
+
+}
+
+namespace midikraft {
+
+	std::vector<LibraryDeltaSync::Chunk> LibraryDeltaSync::chunk(uint8 const *data, size_t size)
+	{
+		auto const &gear = gearTable();
+		std::vector<Chunk> result;
+		size_t start = 0;
+		uint64 hash = 0;
+		for (size_t pos = 0; pos < size; pos++) {
+			hash = (hash << 1) + gear[data[pos]];
+			size_t length = pos - start + 1;
+			if ((length >= kMinChunk && (hash & kChunkMask) == 0) || length >= kMaxChunk) {
+				result.push_back({ start, length });
+				start = pos + 1;
+				hash = 0;
+			}
+		}
+		if (start < size) {
+			result.push_back({ start, size - start });
+		}
+		return result;
+	}
+
+	bool LibraryDeltaSync::saveWithSignature(std::vector<PatchHolder> const &patches, std::string const &pifFilename)
+	{
+		// The signature must describe what is really on disk, so a failed or partial write must not be signed
+		PatchInterchangeFormatWriter writer(pifFilename);
+		for (auto const &patch : patches) {
+			if (patch.patch() && patch.synth()) {
+				writer.add(patch, patch.synth()->dataFileToSysex(patch.patch(), nullptr));
+			}
+		}
+		if (!writer.close()) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to write patch interchange format file %s, not creating a signature") % pifFilename).str());
+			File(pifFilename + ".sig").deleteFile();
+			return false;
+		}
+		return createSignature(pifFilename, pifFilename + ".sig");
+	}
+
+	bool LibraryDeltaSync::createSignature(std::string const &previousExport, std::string const &signatureFile)
+	{
+		ReadOnlyMapping source(previousExport);
+		if (!source.ok()) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to read file %s to create signature") % previousExport).str());
+			return false;
+		}
+
+		File outFile(signatureFile);
+		outFile.deleteFile();
+		FileOutputStream out(outFile);
+		if (out.failedToOpen()) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to open file %s to write signature to") % signatureFile).str());
+			return false;
+		}
+		auto chunks = chunk(source.data(), source.size());
+		out.write(kSignatureMagic, 6);
+		out.writeInt64((int64)chunks.size());
+		for (auto const &c : chunks) {
+			MD5 hash(source.data() + c.offset, c.length);
+			out.writeInt((int)c.length);
+			out.write(hash.getChecksumDataArray(), 16);
+		}
+		out.flush();
+		return out.getStatus().wasOk();
+	}
+
+	bool LibraryDeltaSync::createDelta(std::string const &signatureFile, std::string const &newExport, std::string const &deltaFile)
+	{
+		// Read the signature into a lookup table hash -> offset in old file
+		FileInputStream sig{ File(signatureFile) };
+		if (sig.failedToOpen() || !checkMagic(sig, kSignatureMagic)) {
+			SimpleLogger::instance()->postMessage((boost::format("File %s is not a valid library signature") % signatureFile).str());
+			return false;
+		}
+		std::unordered_map<std::string, Chunk> known;
+		int64 numChunks = sig.readInt64();
+		size_t offset = 0;
+		for (int64 i = 0; i < numChunks && !sig.isExhausted(); i++) {
+			size_t length = (size_t)sig.readInt();
+			uint8 digest[16];
+			if (sig.read(digest, 16) != 16) {
+				SimpleLogger::instance()->postMessage((boost::format("Signature file %s is truncated") % signatureFile).str());
+				return false;
+			}
+			known.emplace(digestKey(digest), Chunk{ offset, length });
+			offset += length;
+		}
+
+		ReadOnlyMapping target(newExport);
+		if (!target.ok()) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to read file %s to create delta") % newExport).str());
+			return false;
+		}
+
+		File outFile(deltaFile);
+		outFile.deleteFile();
+		FileOutputStream out(outFile);
+		if (out.failedToOpen()) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to open file %s to write delta to") % deltaFile).str());
+			return false;
+		}
+		out.write(kDeltaMagic, 6);
+		out.writeInt64((int64)target.size());
+		out.write(MD5(target.data(), target.size()).getChecksumDataArray(), 16);
+
+		// Adjacent copies of consecutive old chunks are merged into one op
+		Chunk pendingCopy{ 0, 0 };
+		auto flushCopy = [&]() {
+			if (pendingCopy.length > 0) {
+				out.writeByte((char)kOpCopy);
+				out.writeInt64((int64)pendingCopy.offset);
+				out.writeInt64((int64)pendingCopy.length);
+				pendingCopy.length = 0;
+			}
+		};
+		for (auto const &c : chunk(target.data(), target.size())) {
+			MD5 hash(target.data() + c.offset, c.length);
+			auto found = known.find(digestKey(hash.getChecksumDataArray()));
+			if (found != known.end() && found->second.length == c.length) {
+				if (pendingCopy.length > 0 && pendingCopy.offset + pendingCopy.length == found->second.offset) {
+					pendingCopy.length += c.length;
+				}
+				else {
+					flushCopy();
+					pendingCopy = found->second;
+				}
+			}
+			else {
+				flushCopy();
+				out.writeByte((char)kOpLiteral);
+				out.writeInt64((int64)c.length);
+				out.write(target.data() + c.offset, c.length);
+			}
+		}
+		flushCopy();
+		out.flush();
+		return out.getStatus().wasOk();
+	}
+
+	bool LibraryDeltaSync::applyDelta(std::string const &previousExport, std::string const &deltaFile, std::string const &outputFile)
+	{
+		ReadOnlyMapping source(previousExport);
+		if (!source.ok()) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to read file %s to apply delta to") % previousExport).str());
+			return false;
+		}
+		FileInputStream delta{ File(deltaFile) };
+		if (delta.failedToOpen() || !checkMagic(delta, kDeltaMagic)) {
+			SimpleLogger::instance()->postMessage((boost::format("File %s is not a valid library delta") % deltaFile).str());
+			return false;
+		}
+		int64 targetSize = delta.readInt64();
+		uint8 expectedDigest[16];
+		if (delta.read(expectedDigest, 16) != 16) {
+			return false;
+		}
+
+		File outFile(outputFile);
+		outFile.deleteFile();
+		bool ok = true;
+		{
+			FileOutputStream out(outFile);
+			if (out.failedToOpen()) {
+				SimpleLogger::instance()->postMessage((boost::format("Failure to open file %s to write reconstructed export to") % outputFile).str());
+				return false;
+			}
+			// The delta is untrusted input, so every length is checked against the source, the remaining delta and the announced
+			// target size before anything is copied or allocated
+			const size_t kLiteralBuffer = 1 << 20;
+			HeapBlock<uint8> literal(kLiteralBuffer);
+			int64 written = 0;
+			ok = targetSize >= 0;
+			while (ok && !delta.isExhausted()) {
+				auto op = (uint8)delta.readByte();
+				if (op == kOpCopy) {
+					auto offset = delta.readInt64();
+					auto length = delta.readInt64();
+					if (offset < 0 || length < 0 || (uint64)offset > source.size() || (uint64)length > source.size() - (uint64)offset || length > targetSize - written) {
+						ok = false;
+					}
+					else {
+						ok = out.write(source.data() + offset, (size_t)length);
+						written += length;
+					}
+				}
+				else if (op == kOpLiteral) {
+					auto length = delta.readInt64();
+					if (length < 0 || length > delta.getNumBytesRemaining() || length > targetSize - written) {
+						ok = false;
+					}
+					else {
+						written += length;
+						while (ok && length > 0) {
+							int chunk = (int)std::min((int64)kLiteralBuffer, length);
+							ok = delta.read(literal.getData(), chunk) == chunk && out.write(literal.getData(), (size_t)chunk);
+							length -= chunk;
+						}
+					}
+				}
+				else {
+					ok = false;
+				}
+			}
+			out.flush();
+			ok = ok && out.getStatus().wasOk();
+		}
+
+		if (ok) {
+			// Verify the result byte-exact against the checksum of the original export
+			ReadOnlyMapping result(outputFile);
+			ok = result.ok() && (int64)result.size() == targetSize
+				&& memcmp(MD5(result.data(), result.size()).getChecksumDataArray(), expectedDigest, 16) == 0;
+		}
+		if (!ok) {
+			SimpleLogger::instance()->postMessage((boost::format("Applying delta %s to %s failed, reconstructed file does not match the original export") % deltaFile % previousExport).str());
+			outFile.deleteFile();
+		}
+		return ok;
+	}
+
+}
@@ -0,0 +1,37 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "PatchHolder.h"
+
+namespace midikraft {
+
+	// Transfer library exports between machines by only carrying over what changed.
+	//
+	// The export is cut into content-defined chunks with a rolling (gear) hash, so inserting or removing a patch only changes
+	// the chunks around it. The receiving side creates a signature of the export it already has, the sending side creates a delta
+	// of its new export against that signature, and the receiving side applies the delta to its old export to get the new one.
+	// The delta carries the MD5 of the complete new file, so the reconstruction is verified byte-exact.
+	class LibraryDeltaSync {
+	public:
+		// Write the PIF file and its signature (to pifFilename + ".sig") in one go
+		static bool saveWithSignature(std::vector<PatchHolder> const &patches, std::string const &pifFilename);
+
+		static bool createSignature(std::string const &previousExport, std::string const &signatureFile);
+		static bool createDelta(std::string const &signatureFile, std::string const &newExport, std::string const &deltaFile);
+		static bool applyDelta(std::string const &previousExport, std::string const &deltaFile, std::string const &outputFile);
+
+		struct Chunk {
+			size_t offset;
+			size_t length;
+		};
+		static std::vector<Chunk> chunk(uint8 const *data, size_t size);
+	};
+
+}
@@ -0,0 +1,517 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "LinearRegex.h"
+
+#include <algorithm>
+#include <cctype>
+#include <memory>
+
+namespace midikraft {
+
+	struct LinearRegex::Node {
+		enum class Type { CLASS, BEGIN_LINE, END_LINE, WORD_BOUNDARY, NOT_WORD_BOUNDARY, SEQUENCE, ALTERNATIVE, REPEAT };
+
+		Node(Type type) : type(type), min(0), max(-1) {}
+
+		Type type;
+		std::bitset<256> chars;
+		std::vector<std::unique_ptr<Node>> children;
+		int min;
+		int max; // -1 is unbounded
+	};
+
+	namespace {
+
+		typedef std::bitset<256> CharSet;
+
+		bool isWordChar(int c) {
+			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+		}
+
+		CharSet charRange(int from, int to) {
+			CharSet result;
+			for (int c = from; c <= to; c++) result.set((size_t)c);
+			return result;
+		}
+
+		CharSet singleChar(int c) {
+			CharSet result;
+			result.set((size_t)(unsigned char)c);
+			return result;
+		}
+
+		CharSet digitChars() { return charRange('0', '9'); }
+		CharSet wordChars() { return charRange('a', 'z') | charRange('A', 'Z') | charRange('0', '9') | singleChar('_'); }
+		CharSet spaceChars() { return singleChar(' ') | singleChar('\t') | singleChar('\n') | singleChar('\r') | singleChar('\f') | singleChar('\v'); }
+
+		int hexValue(char c) {
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+			return -1;
+		}
+
+	}
+
+	class LinearRegexParser {
+	public:
+		typedef LinearRegex::Node Node;
+
+		LinearRegexParser(std::string const &pattern, bool caseSensitive) : p_(pattern), caseSensitive_(caseSensitive), pos_(0) {}
+
+		std::unique_ptr<Node> parse(std::string &outError) {
+			auto result = parseAlternative();
+			if (result && pos_ != p_.size()) {
+				result = fail("Unmatched )");
+			}
+			outError = error_;
+			return result;
+		}
+
+	private:
+		std::unique_ptr<Node> fail(std::string const &message) {
+			if (error_.empty()) {
+				error_ = message + " at position " + std::to_string(pos_);
+			}
+			return nullptr;
+		}
+
+		bool atEnd() const { return pos_ >= p_.size(); }
+		char peek() const { return p_[pos_]; }
+
+		std::unique_ptr<Node> parseAlternative() {
+			auto first = parseSequence();
+			if (!first || atEnd() || peek() != '|') {
+				return first;
+			}
+			auto alternative = std::make_unique<Node>(Node::Type::ALTERNATIVE);
+			alternative->children.push_back(std::move(first));
+			while (!atEnd() && peek() == '|') {
+				pos_++;
+				auto next = parseSequence();
+				if (!next) return nullptr;
+				alternative->children.push_back(std::move(next));
+			}
+			return alternative;
+		}
+
+		std::unique_ptr<Node> parseSequence() {
+			auto sequence = std::make_unique<Node>(Node::Type::SEQUENCE);
+			while (!atEnd() && peek() != '|' && peek() != ')') {
+				auto item = parseRepeat();
+				if (!item) return nullptr;
+				sequence->children.push_back(std::move(item));
+			}
+			return sequence;
+		}
+
+		// Parses {m}, {m,} or {m,n} at the current position. Returns false and leaves the position untouched if there is none
+		bool parseBraces(int &outMin, int &outMax) {
+			size_t p = pos_ + 1;
+			auto readNumber = [this, &p](int &outNumber) {
+				size_t start = p;
+				long long number = 0;
+				while (p < p_.size() && std::isdigit((unsigned char)p_[p])) {
+					number = std::min(number * 10 + (p_[p] - '0'), 1000000LL);
+					p++;
+				}
+				outNumber = (int)number;
+				return p > start;
+			};
+			if (!readNumber(outMin)) return false;
+			outMax = outMin;
+			if (p < p_.size() && p_[p] == ',') {
+				p++;
+				if (!readNumber(outMax)) {
+					outMax = -1;
+				}
+			}
+			if (p >= p_.size() || p_[p] != '}') return false;
+			pos_ = p + 1;
+			return true;
+		}
+
+		std::unique_ptr<Node> parseRepeat() {
+			auto atom = parseAtom();
+			while (atom && !atEnd()) {
+				int min, max;
+				char c = peek();
+				if (c == '*') { min = 0; max = -1; pos_++; }
+				else if (c == '+') { min = 1; max = -1; pos_++; }
+				else if (c == '?') { min = 0; max = 1; pos_++; }
+				else if (c == '{' && parseBraces(min, max)) {
+					if (max != -1 && max < min) return fail("Invalid range in {}");
+				}
+				else break;
+				if (!atEnd() && peek() == '?') {
+					// Lazy quantifier, makes no difference for a search without captures
+					pos_++;
+				}
+				if (atom->type != Node::Type::CLASS && atom->type != Node::Type::SEQUENCE && atom->type != Node::Type::ALTERNATIVE && atom->type != Node::Type::REPEAT) {
+					return fail("Nothing to repeat");
+				}
+				auto repeat = std::make_unique<Node>(Node::Type::REPEAT);
+				repeat->min = min;
+				repeat->max = max;
+				repeat->children.push_back(std::move(atom));
+				atom = std::move(repeat);
+			}
+			return atom;
+		}
+
+		CharSet caseFolded(CharSet chars) const {
+			if (!caseSensitive_) {
+				for (int c = 'a'; c <= 'z'; c++) {
+					if (chars.test((size_t)c) || chars.test((size_t)(c - 'a' + 'A'))) {
+						chars.set((size_t)c);
+						chars.set((size_t)(c - 'a' + 'A'));
+					}
+				}
+			}
+			return chars;
+		}
+
+		std::unique_ptr<Node> classNode(CharSet const &chars) {
+			auto node = std::make_unique<Node>(Node::Type::CLASS);
+			node->chars = caseFolded(chars);
+			return node;
+		}
+
+		std::unique_ptr<Node> parseAtom() {
+			char c = p_[pos_++];
+			switch (c) {
+			case '(': {
+				if (!atEnd() && peek() == '?') {
+					if (pos_ + 1 < p_.size() && p_[pos_ + 1] == ':') {
+						pos_ += 2;
+					}
+					else {
+						return fail("Lookarounds are not supported");
+					}
+				}
+				auto inner = parseAlternative();
+				if (!inner) return nullptr;
+				if (atEnd() || peek() != ')') return fail("Missing )");
+				pos_++;
+				return inner;
+			}
+			case '[':
+				return parseClass();
+			case '.':
+				return classNode(~(singleChar('\n') | singleChar('\r')));
+			case '^':
+				return std::make_unique<Node>(Node::Type::BEGIN_LINE);
+			case '$':
+				return std::make_unique<Node>(Node::Type::END_LINE);
+			case '*':
+			case '+':
+			case '?':
+				return fail("Nothing to repeat");
+			case '\\': {
+				if (atEnd()) return fail("Trailing backslash");
+				char e = p_[pos_];
+				if (e == 'b' || e == 'B') {
+					pos_++;
+					return std::make_unique<Node>(e == 'b' ? Node::Type::WORD_BOUNDARY : Node::Type::NOT_WORD_BOUNDARY);
+				}
+				CharSet chars;
+				if (!parseEscape(false, chars)) return nullptr;
+				return classNode(chars);
+			}
+			default:
+				return classNode(singleChar(c));
+			}
+		}
+
+		bool parseEscape(bool inClass, CharSet &outChars) {
+			char e = p_[pos_++];
+			switch (e) {
+			case 'd': outChars = digitChars(); return true;
+			case 'D': outChars = ~digitChars(); return true;
+			case 'w': outChars = wordChars(); return true;
+			case 'W': outChars = ~wordChars(); return true;
+			case 's': outChars = spaceChars(); return true;
+			case 'S': outChars = ~spaceChars(); return true;
+			case 'n': outChars = singleChar('\n'); return true;
+			case 'r': outChars = singleChar('\r'); return true;
+			case 't': outChars = singleChar('\t'); return true;
+			case 'f': outChars = singleChar('\f'); return true;
+			case 'v': outChars = singleChar('\v'); return true;
+			case '0': outChars = singleChar('\0'); return true;
+			case 'b':
+				// Only reached inside a class, where \b is the backspace character
+				outChars = singleChar('\b');
+				return true;
+			case 'x':
+			case 'u': {
+				size_t digits = e == 'x' ? 2 : 4;
+				int value = 0;
+				for (size_t i = 0; i < digits; i++) {
+					if (atEnd() || hexValue(peek()) < 0) {
+						fail("Invalid hex escape");
+						return false;
+					}
+					value = value * 16 + hexValue(p_[pos_++]);
+				}
+				if (value > 255) {
+					fail("Characters beyond \\xff are not supported");
+					return false;
+				}
+				outChars = singleChar(value);
+				return true;
+			}
+			case 'c':
+				if (atEnd() || !std::isalpha((unsigned char)peek())) {
+					fail("Invalid control escape");
+					return false;
+				}
+				outChars = singleChar(p_[pos_++] % 32);
+				return true;
+			default:
+				if (e >= '1' && e <= '9' && !inClass) {
+					fail("Backreferences are not supported");
+					return false;
+				}
+				// Identity escape
+				outChars = singleChar(e);
+				return true;
+			}
+		}
+
+		// Reads a single class member, returns true in isSingle if it is exactly one character (usable in a range)
+		bool parseClassMember(CharSet &outChars, bool &isSingle, int &outChar) {
+			char c = p_[pos_++];
+			if (c == '\\') {
+				if (atEnd()) {
+					fail("Trailing backslash");
+					return false;
+				}
+				if (!parseEscape(true, outChars)) return false;
+			}
+			else {
+				outChars = singleChar(c);
+			}
+			isSingle = outChars.count() == 1;
+			outChar = -1;
+			if (isSingle) {
+				for (int i = 0; i < 256; i++) {
+					if (outChars.test((size_t)i)) outChar = i;
+				}
+			}
+			return true;
+		}
+
+		std::unique_ptr<Node> parseClass() {
+			bool negate = false;
+			if (!atEnd() && peek() == '^') {
+				negate = true;
+				pos_++;
+			}
+			CharSet chars;
+			while (true) {
+				if (atEnd()) return fail("Missing ]");
+				if (peek() == ']') {
+					pos_++;
+					break;
+				}
+				CharSet member;
+				bool isSingle;
+				int from;
+				if (!parseClassMember(member, isSingle, from)) return nullptr;
+				if (pos_ + 1 < p_.size() && peek() == '-' && p_[pos_ + 1] != ']') {
+					pos_++;
+					CharSet upper;
+					bool upperIsSingle;
+					int to;
+					if (!parseClassMember(upper, upperIsSingle, to)) return nullptr;
+					if (isSingle && upperIsSingle) {
+						if (to < from) return fail("Invalid range in character class");
+						member = charRange(from, to);
+					}
+					else {
+						// Something like [\d-x], the - is a literal then
+						member |= singleChar('-') | upper;
+					}
+				}
+				chars |= member;
+			}
+			// Fold the case before negating, [^h] must not match H when case insensitive
+			return classNode(negate ? ~caseFolded(chars) : chars);
+		}
+
+		std::string const &p_;
+		bool caseSensitive_;
+		size_t pos_;
+		std::string error_;
+	};
+
+	LinearRegex::LinearRegex(std::string const &pattern, bool caseSensitive) : pattern_(pattern), caseSensitive_(caseSensitive)
+	{
+		LinearRegexParser parser(pattern, caseSensitive);
+		auto root = parser.parse(error_);
+		if (root && compile(*root)) {
+			emit(Instruction::Op::MATCH);
+		}
+		else {
+			program_.clear();
+			classes_.clear();
+		}
+	}
+
+	bool LinearRegex::isValid() const
+	{
+		return !program_.empty();
+	}
+
+	std::string LinearRegex::error() const
+	{
+		return error_;
+	}
+
+	std::string LinearRegex::pattern() const
+	{
+		return pattern_;
+	}
+
+	bool LinearRegex::isCaseSensitive() const
+	{
+		return caseSensitive_;
+	}
+
+	size_t LinearRegex::memoryUsage() const
+	{
+		return sizeof(LinearRegex) + pattern_.capacity() + error_.capacity() + program_.capacity() * sizeof(Instruction) + classes_.capacity() * sizeof(std::bitset<256>);
+	}
+
+	int LinearRegex::emit(Instruction::Op op, int x, int y)
+	{
+		program_.push_back({ op, x, y });
+		return (int)program_.size() - 1;
+	}
+
+	bool LinearRegex::compile(Node const &node)
+	{
+		if (program_.size() > kMaxInstructions) {
+			error_ = "Pattern too large";
+			return false;
+		}
+		switch (node.type) {
+		case Node::Type::CLASS:
+			classes_.push_back(node.chars);
+			emit(Instruction::Op::CLASS, (int)classes_.size() - 1);
+			return true;
+		case Node::Type::BEGIN_LINE: emit(Instruction::Op::BEGIN_LINE); return true;
+		case Node::Type::END_LINE: emit(Instruction::Op::END_LINE); return true;
+		case Node::Type::WORD_BOUNDARY: emit(Instruction::Op::WORD_BOUNDARY); return true;
+		case Node::Type::NOT_WORD_BOUNDARY: emit(Instruction::Op::NOT_WORD_BOUNDARY); return true;
+		case Node::Type::SEQUENCE:
+			for (auto const &child : node.children) {
+				if (!compile(*child)) return false;
+			}
+			return true;
+		case Node::Type::ALTERNATIVE: {
+			std::vector<int> jumpsToEnd;
+			for (size_t i = 0; i < node.children.size(); i++) {
+				if (i + 1 < node.children.size()) {
+					int split = emit(Instruction::Op::SPLIT, (int)program_.size() + 1);
+					if (!compile(*node.children[i])) return false;
+					jumpsToEnd.push_back(emit(Instruction::Op::JUMP));
+					program_[(size_t)split].y = (int)program_.size();
+				}
+				else {
+					if (!compile(*node.children[i])) return false;
+				}
+			}
+			for (auto jump : jumpsToEnd) {
+				program_[(size_t)jump].x = (int)program_.size();
+			}
+			return true;
+		}
+		case Node::Type::REPEAT: {
+			auto const &child = *node.children[0];
+			for (int i = 0; i < node.min; i++) {
+				if (!compile(child)) return false;
+			}
+			if (node.max == -1) {
+				int split = emit(Instruction::Op::SPLIT, (int)program_.size() + 1);
+				if (!compile(child)) return false;
+				emit(Instruction::Op::JUMP, split);
+				program_[(size_t)split].y = (int)program_.size();
+			}
+			else {
+				std::vector<int> splits;
+				for (int i = node.min; i < node.max; i++) {
+					splits.push_back(emit(Instruction::Op::SPLIT, (int)program_.size() + 1));
+					if (!compile(child)) return false;
+				}
+				for (auto split : splits) {
+					program_[(size_t)split].y = (int)program_.size();
+				}
+			}
+			return true;
+		}
+		}
+		return false;
+	}
+
+	bool LinearRegex::search(std::string const &text) const
+	{
+		if (!isValid()) {
+			return false;
+		}
+
+		// Breadth first simulation of all threads, each instruction is on the thread list at most once per input position
+		std::vector<int> current, next, stack;
+		current.reserve(program_.size());
+		next.reserve(program_.size());
+		std::vector<size_t> onListAtPosition(program_.size(), std::string::npos);
+
+		auto addThread = [&](std::vector<int> &list, int startPc, size_t position) {
+			stack.push_back(startPc);
+			while (!stack.empty()) {
+				int pc = stack.back();
+				stack.pop_back();
+				if (onListAtPosition[(size_t)pc] == position) continue;
+				onListAtPosition[(size_t)pc] = position;
+				auto const &instruction = program_[(size_t)pc];
+				switch (instruction.op) {
+				case Instruction::Op::CLASS: list.push_back(pc); break;
+				case Instruction::Op::SPLIT: stack.push_back(instruction.y); stack.push_back(instruction.x); break;
+				case Instruction::Op::JUMP: stack.push_back(instruction.x); break;
+				case Instruction::Op::BEGIN_LINE: if (position == 0) stack.push_back(pc + 1); break;
+				case Instruction::Op::END_LINE: if (position == text.size()) stack.push_back(pc + 1); break;
+				case Instruction::Op::WORD_BOUNDARY:
+				case Instruction::Op::NOT_WORD_BOUNDARY: {
+					bool before = position > 0 && isWordChar((unsigned char)text[position - 1]);
+					bool after = position < text.size() && isWordChar((unsigned char)text[position]);
+					if ((before != after) == (instruction.op == Instruction::Op::WORD_BOUNDARY)) stack.push_back(pc + 1);
+					break;
+				}
+				case Instruction::Op::MATCH:
+					stack.clear();
+					return true;
+				}
+			}
+			return false;
+		};
+
+		for (size_t position = 0; ; position++) {
+			// Unanchored search - a new thread starts at every position
+			if (addThread(current, 0, position)) return true;
+			if (position == text.size()) return false;
+			auto c = (unsigned char)text[position];
+			next.clear();
+			for (int pc : current) {
+				if (classes_[(size_t)program_[(size_t)pc].x].test(c)) {
+					if (addThread(next, pc + 1, position + 1)) return true;
+				}
+			}
+			current.swap(next);
+		}
+	}
+
+}
@@ -0,0 +1,60 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include <bitset>
+#include <string>
+#include <vector>
+
+namespace midikraft {
+
+	class LinearRegexParser;
+
+	// Regular expression search with guaranteed linear run time in the length of the input, no matter what pattern the user wrote.
+	//
+	// The pattern is compiled into a Thompson NFA which is simulated breadth first (Pike VM), so there is no backtracking.
+	// Supported is the ECMAScript subset without backreferences and lookarounds: literals, escapes, ., character classes,
+	// \d \w \s \b and their negations, ^ $, groups, alternation, and the quantifiers * + ? {m} {m,} {m,n}.
+	class LinearRegex {
+	public:
+		// Check isValid() and error() after construction, patterns using unsupported features are rejected
+		LinearRegex(std::string const &pattern, bool caseSensitive);
+
+		bool isValid() const;
+		std::string error() const;
+		std::string pattern() const;
+		bool isCaseSensitive() const;
+
+		// Same semantics as std::regex_search, i.e. true if the pattern matches anywhere in the text
+		bool search(std::string const &text) const;
+
+		// Bytes held by the compiled program, for the memory accounting
+		size_t memoryUsage() const;
+
+	private:
+		friend class LinearRegexParser;
+		struct Node;
+		struct Instruction {
+			enum class Op { CLASS, SPLIT, JUMP, BEGIN_LINE, END_LINE, WORD_BOUNDARY, NOT_WORD_BOUNDARY, MATCH };
+			Op op;
+			int x; // Class index or jump target
+			int y; // Second target of split
+		};
+
+		bool compile(Node const &node);
+		int emit(Instruction::Op op, int x = 0, int y = 0);
+
+		static const size_t kMaxInstructions = 20000;
+
+		std::string pattern_;
+		bool caseSensitive_;
+		std::string error_;
+		std::vector<Instruction> program_;
+		std::vector<std::bitset<256>> classes_;
+	};
+
+}
@@ -0,0 +1,184 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "MemoryAccounting.h"
+
+#include "Trace.h"
+
+#include "nlohmann/json.hpp"
+
+namespace midikraft {
+
+	MemoryAccounting &MemoryAccounting::instance()
+	{
+		static MemoryAccounting instance_;
+		return instance_;
+	}
+
+	const char *MemoryAccounting::kindName(Kind kind)
+	{
+		switch (kind) {
+		case Kind::PATCH_HOLDER: return "PatchHolder";
+		case Kind::SYSEX_PAYLOAD: return "Sysex payload";
+		case Kind::SOURCE_INFO: return "SourceInfo";
+		case Kind::REGEX: return "Regex";
+		case Kind::DOWNLOAD_BUFFER: return "Download buffer";
+		case Kind::CACHE: return "Cache";
+		default: return "Unknown";
+		}
+	}
+
+	void MemoryAccounting::add(Kind kind, int64 bytes)
+	{
+		auto &c = counters_[(size_t)kind];
+		c.liveObjects++;
+		c.allocations++;
+		int64 live = c.liveBytes += bytes;
+		int64 peak = c.peakBytes.load(std::memory_order_relaxed);
+		while (live > peak && !c.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+			// peak was reloaded, try again
+		}
+	}
+
+	void MemoryAccounting::remove(Kind kind, int64 bytes)
+	{
+		auto &c = counters_[(size_t)kind];
+		c.liveObjects--;
+		c.liveBytes -= bytes;
+	}
+
+	void MemoryAccounting::resize(Kind kind, int64 oldBytes, int64 newBytes)
+	{
+		auto &c = counters_[(size_t)kind];
+		int64 live = c.liveBytes += newBytes - oldBytes;
+		int64 peak = c.peakBytes.load(std::memory_order_relaxed);
+		while (live > peak && !c.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+			// peak was reloaded, try again
+		}
+	}
+
+	MemoryAccounting::Usage MemoryAccounting::usage(Kind kind) const
+	{
+		auto const &c = counters_[(size_t)kind];
+		Usage result;
+		result.liveBytes = c.liveBytes;
+		result.liveObjects = c.liveObjects;
+		result.peakBytes = c.peakBytes;
+		result.allocations = c.allocations;
+		return result;
+	}
+
+	MemoryAccounting::Snapshot MemoryAccounting::snapshot() const
+	{
+		Snapshot result;
+		for (size_t i = 0; i < result.size(); i++) {
+			result[i] = usage((Kind)i);
+		}
+		return result;
+	}
+
+	MemoryAccounting::Snapshot MemoryAccounting::lastOperationDelta(std::string const &operationName) const
+	{
+		std::lock_guard<std::mutex> lock(operationsLock_);
+		auto found = lastOperations_.find(operationName);
+		return found != lastOperations_.end() ? found->second : Snapshot();
+	}
+
+	void MemoryAccounting::traceCounters() const
+	{
+		for (size_t i = 0; i < counters_.size(); i++) {
+			Trace::instance().addCounter(kindName((Kind)i), counters_[i].liveBytes);
+		}
+	}
+
+	std::string MemoryAccounting::report() const
+	{
+		auto toJson = [](Snapshot const &snapshot) {
+			nlohmann::json result = nlohmann::json::object();
+			for (size_t i = 0; i < snapshot.size(); i++) {
+				result[kindName((Kind)i)] = {
+					{ "liveBytes", snapshot[i].liveBytes },
+					{ "liveObjects", snapshot[i].liveObjects },
+					{ "peakBytes", snapshot[i].peakBytes },
+					{ "allocations", snapshot[i].allocations }
+				};
+			}
+			return result;
+		};
+		nlohmann::json result;
+		result["live"] = toJson(snapshot());
+		std::lock_guard<std::mutex> lock(operationsLock_);
+		for (auto const &operation : lastOperations_) {
+			result["operations"][operation.first] = toJson(operation.second);
+		}
+		return result.dump(2);
+	}
+
+	MemoryAccounting::ScopedOperation::ScopedOperation(const char *name) : name_(name), start_(MemoryAccounting::instance().snapshot())
+	{
+		MemoryAccounting::instance().traceCounters();
+	}
+
+	MemoryAccounting::ScopedOperation::~ScopedOperation()
+	{
+		auto &accounting = MemoryAccounting::instance();
+		accounting.traceCounters();
+		auto d = delta();
+		std::lock_guard<std::mutex> lock(accounting.operationsLock_);
+		accounting.lastOperations_[name_] = d;
+	}
+
+	MemoryAccounting::Snapshot MemoryAccounting::ScopedOperation::delta() const
+	{
+		auto now = MemoryAccounting::instance().snapshot();
+		Snapshot result;
+		for (size_t i = 0; i < result.size(); i++) {
+			result[i].liveBytes = now[i].liveBytes - start_[i].liveBytes;
+			result[i].liveObjects = now[i].liveObjects - start_[i].liveObjects;
+			result[i].peakBytes = now[i].peakBytes; // The peak can't be attributed, report the absolute value
+			result[i].allocations = now[i].allocations - start_[i].allocations;
+		}
+		return result;
+	}
+
+	TrackedAllocation::TrackedAllocation(MemoryAccounting::Kind kind, int64 bytes) : kind_(kind), bytes_(bytes)
+	{
+		MemoryAccounting::instance().add(kind_, bytes_);
+	}
+
+	TrackedAllocation::TrackedAllocation(TrackedAllocation const &other) : kind_(other.kind_), bytes_(other.bytes_)
+	{
+		MemoryAccounting::instance().add(kind_, bytes_);
+	}
+
+	TrackedAllocation &TrackedAllocation::operator=(TrackedAllocation const &other)
+	{
+		if (this != &other) {
+			MemoryAccounting::instance().remove(kind_, bytes_);
+			kind_ = other.kind_;
+			bytes_ = other.bytes_;
+			MemoryAccounting::instance().add(kind_, bytes_);
+		}
+		return *this;
+	}
+
+	TrackedAllocation::~TrackedAllocation()
+	{
+		MemoryAccounting::instance().remove(kind_, bytes_);
+	}
+
+	void TrackedAllocation::setBytes(int64 bytes)
+	{
+		MemoryAccounting::instance().resize(kind_, bytes_, bytes);
+		bytes_ = bytes;
+	}
+
+	int64 TrackedAllocation::bytes() const
+	{
+		return bytes_;
+	}
+
+}
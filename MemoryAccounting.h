@@ -0,0 +1,96 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <mutex>
+
+namespace midikraft {
+
+	// Bookkeeping of how much memory the library data structures hold, per kind of object.
+	//
+	// This does not hook the allocator, the objects report their own size through a TrackedAllocation member. The numbers are
+	// therefore estimates of the payload, not of the allocator overhead, but good enough to see which kind of data dominates.
+	class MemoryAccounting {
+	public:
+		enum class Kind { PATCH_HOLDER = 0, SYSEX_PAYLOAD, SOURCE_INFO, REGEX, DOWNLOAD_BUFFER, CACHE, NUMBER_OF_KINDS };
+
+		struct Usage {
+			int64 liveBytes = 0;
+			int64 liveObjects = 0;
+			int64 peakBytes = 0;
+			int64 allocations = 0; // Total since program start
+		};
+		typedef std::array<Usage, (size_t)Kind::NUMBER_OF_KINDS> Snapshot;
+
+		// Measures the change in memory during an operation like an import. The delta is kept under the name of the operation
+		// when it ends, and shows up as counters in the trace. The counters are process wide, so the delta includes everything
+		// else running at the same time - use it for whole operations only, not for the many small steps running in parallel
+		// inside one.
+		class ScopedOperation {
+		public:
+			ScopedOperation(const char *name);
+			~ScopedOperation();
+
+			Snapshot delta() const;
+
+		private:
+			const char *name_;
+			Snapshot start_;
+		};
+
+		static MemoryAccounting &instance();
+		static const char *kindName(Kind kind);
+
+		void add(Kind kind, int64 bytes);
+		void remove(Kind kind, int64 bytes);
+		void resize(Kind kind, int64 oldBytes, int64 newBytes);
+
+		Usage usage(Kind kind) const;
+		Snapshot snapshot() const;
+		Snapshot lastOperationDelta(std::string const &operationName) const;
+
+		// Live totals and the deltas of the last operations as JSON, e.g. for the log or a diagnostics dialog
+		std::string report() const;
+
+	private:
+		MemoryAccounting() = default;
+		void traceCounters() const;
+
+		// Each kind gets its own cache line, PatchHolder copies on pool threads would otherwise contend with the other kinds
+		struct alignas(64) Counters {
+			std::atomic<int64> liveBytes{ 0 };
+			std::atomic<int64> liveObjects{ 0 };
+			std::atomic<int64> peakBytes{ 0 };
+			std::atomic<int64> allocations{ 0 };
+		};
+		std::array<Counters, (size_t)Kind::NUMBER_OF_KINDS> counters_;
+		mutable std::mutex operationsLock_;
+		std::map<std::string, Snapshot> lastOperations_;
+	};
+
+	// Member to put into an accounted object. Copies count as new allocations, which matches the deep copies of the objects
+	class TrackedAllocation {
+	public:
+		TrackedAllocation(MemoryAccounting::Kind kind, int64 bytes = 0);
+		TrackedAllocation(TrackedAllocation const &other);
+		TrackedAllocation &operator=(TrackedAllocation const &other);
+		~TrackedAllocation();
+
+		void setBytes(int64 bytes);
+		int64 bytes() const;
+
+	private:
+		MemoryAccounting::Kind kind_;
+		int64 bytes_;
+	};
+
+}
@@ -0,0 +1,180 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "MemoryBudget.h"
+
+#include "Trace.h"
+
+#include "nlohmann/json.hpp"
+
+#include <algorithm>
+
+namespace midikraft {
+
+	// Generous for the caches alone, a 200k patch library needs far less than this for the name memo
+	const int64 kDefaultLimit = 256 * 1024 * 1024;
+
+	MemoryBudget &MemoryBudget::instance()
+	{
+		static MemoryBudget instance_;
+		return instance_;
+	}
+
+	MemoryBudget::MemoryBudget() : limit_(kDefaultLimit), used_(0)
+	{
+	}
+
+	void MemoryBudget::setLimit(int64 bytes)
+	{
+		limit_ = bytes;
+		enforce();
+	}
+
+	int64 MemoryBudget::limit() const
+	{
+		return limit_;
+	}
+
+	int64 MemoryBudget::usedBytes() const
+	{
+		return used_;
+	}
+
+	void MemoryBudget::registerCache(BudgetedCache *cache)
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		caches_.push_back(cache);
+	}
+
+	void MemoryBudget::unregisterCache(BudgetedCache *cache)
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		caches_.erase(std::remove(caches_.begin(), caches_.end(), cache), caches_.end());
+	}
+
+	void MemoryBudget::charge(int64 bytes)
+	{
+		if ((used_ += bytes) > limit_) {
+			enforce();
+		}
+	}
+
+	void MemoryBudget::release(int64 bytes)
+	{
+		used_ -= bytes;
+	}
+
+	void MemoryBudget::enforce()
+	{
+		// If another thread is already evicting, it will bring us below the limit as well
+		std::unique_lock<std::mutex> evicting(evictionLock_, std::try_to_lock);
+		if (!evicting.owns_lock()) {
+			return;
+		}
+		MIDIKRAFT_TRACE_SCOPE("MemoryBudget::enforce", "memory");
+		std::lock_guard<std::mutex> lock(lock_);
+		while (used_ > limit_) {
+			BudgetedCache *cheapest = nullptr;
+			double cheapestScore = std::numeric_limits<double>::infinity();
+			for (auto cache : caches_) {
+				double score = cache->evictionScore();
+				if (score < cheapestScore) {
+					cheapestScore = score;
+					cheapest = cache;
+				}
+			}
+			if (!cheapest) {
+				// All caches empty, the remaining bytes are not ours to free
+				break;
+			}
+			int64 freed = cheapest->evictOne();
+			if (freed <= 0) {
+				break;
+			}
+			used_ -= freed;
+		}
+	}
+
+	std::vector<BudgetedCache::Statistics> MemoryBudget::statistics() const
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		std::vector<BudgetedCache::Statistics> result;
+		for (auto cache : caches_) {
+			result.push_back(cache->statistics());
+		}
+		return result;
+	}
+
+	std::string MemoryBudget::report() const
+	{
+		nlohmann::json caches = nlohmann::json::array();
+		for (auto const &s : statistics()) {
+			int64 lookups = s.hits + s.misses;
+			caches.push_back({
+				{ "name", s.name },
+				{ "bytes", s.bytes },
+				{ "entries", s.entries },
+				{ "hits", s.hits },
+				{ "misses", s.misses },
+				{ "evictions", s.evictions },
+				{ "hitRate", lookups > 0 ? s.hits / (double)lookups : 0.0 }
+			});
+		}
+		nlohmann::json result = {
+			{ "limit", limit() },
+			{ "used", usedBytes() },
+			{ "caches", caches }
+		};
+		return result.dump(2);
+	}
+
+	BudgetedAllocation::BudgetedAllocation(std::string const &name, MemoryAccounting::Kind kind) : memory_(kind)
+	{
+		statistics_.name = name;
+		MemoryBudget::instance().registerCache(this);
+	}
+
+	BudgetedAllocation::~BudgetedAllocation()
+	{
+		MemoryBudget::instance().unregisterCache(this);
+		setBytes(0, 0);
+	}
+
+	void BudgetedAllocation::setBytes(int64 bytes, int64 entries)
+	{
+		int64 grown;
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			grown = bytes - statistics_.bytes;
+			statistics_.bytes = bytes;
+			statistics_.entries = entries;
+			memory_.setBytes(bytes);
+		}
+		if (grown > 0) {
+			MemoryBudget::instance().charge(grown);
+		}
+		else if (grown < 0) {
+			MemoryBudget::instance().release(-grown);
+		}
+	}
+
+	BudgetedCache::Statistics BudgetedAllocation::statistics() const
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		return statistics_;
+	}
+
+	double BudgetedAllocation::evictionScore() const
+	{
+		return std::numeric_limits<double>::infinity();
+	}
+
+	int64 BudgetedAllocation::evictOne()
+	{
+		return 0;
+	}
+
+}
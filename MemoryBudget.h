@@ -0,0 +1,231 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "MemoryAccounting.h"
+
+#include <atomic>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace midikraft {
+
+	// Interface the MemoryBudget uses to shrink a cache
+	class BudgetedCache {
+	public:
+		struct Statistics {
+			std::string name;
+			int64 bytes = 0;
+			int64 entries = 0;
+			int64 hits = 0;
+			int64 misses = 0;
+			int64 evictions = 0;
+		};
+
+		virtual ~BudgetedCache() = default;
+
+		virtual Statistics statistics() const = 0;
+		// Recomputation cost per byte of the entry evictOne() would remove, lower is evicted first. Infinity if the cache is empty.
+		virtual double evictionScore() const = 0;
+		// Removes that entry and returns the bytes freed, 0 if nothing was left
+		virtual int64 evictOne() = 0;
+	};
+
+	// One global byte limit for all caches of the librarian.
+	//
+	// Caches register on construction and report their size changes. When the sum goes over the limit, entries are evicted across
+	// all caches, always the one that is cheapest to recompute per byte, until the total is below the limit again. So a large cache
+	// of cheap entries gives way before a small cache of expensive ones. Data that can't be dropped is registered as a
+	// BudgetedAllocation, it counts against the limit so the caches shrink around it, and shows up in the report.
+	class MemoryBudget {
+	public:
+		static MemoryBudget &instance();
+
+		void setLimit(int64 bytes);
+		int64 limit() const;
+		int64 usedBytes() const;
+
+		void registerCache(BudgetedCache *cache);
+		void unregisterCache(BudgetedCache *cache);
+
+		// Called by the caches after they grew. Must not be called while holding a cache lock, as this evicts from all caches.
+		void charge(int64 bytes);
+		void release(int64 bytes);
+
+		std::vector<BudgetedCache::Statistics> statistics() const;
+		std::string report() const; // JSON with the usage and hit rate per cache
+
+	private:
+		MemoryBudget();
+		void enforce();
+
+		mutable std::mutex lock_;
+		std::vector<BudgetedCache *> caches_;
+		std::atomic<int64> limit_;
+		std::atomic<int64> used_;
+		std::mutex evictionLock_; // Only one thread evicts at a time
+	};
+
+	// Memory held by a structure that can't simply be evicted, e.g. because it can't be recomputed or only by its owner.
+	// Never evicts anything, the owner reports the current size with setBytes(). Thread safe.
+	class BudgetedAllocation : public BudgetedCache {
+	public:
+		BudgetedAllocation(std::string const &name, MemoryAccounting::Kind kind);
+		virtual ~BudgetedAllocation() override;
+
+		void setBytes(int64 bytes, int64 entries);
+
+		Statistics statistics() const override;
+		double evictionScore() const override;
+		int64 evictOne() override;
+
+	private:
+		mutable std::mutex lock_;
+		Statistics statistics_;
+		TrackedAllocation memory_;
+
+		JUCE_DECLARE_NON_COPYABLE(BudgetedAllocation)
+	};
+
+	// LRU cache whose entries carry their size and the cost to recompute them, and which is kept in check by the MemoryBudget.
+	// Thread safe, the values are returned by copy.
+	template<typename Key, typename Value, typename Hash = std::hash<Key>>
+	class BudgetedLruCache : public BudgetedCache {
+	public:
+		BudgetedLruCache(std::string const &name) : memory_(MemoryAccounting::Kind::CACHE) {
+			statistics_.name = name;
+			MemoryBudget::instance().registerCache(this);
+		}
+
+		virtual ~BudgetedLruCache() override {
+			MemoryBudget::instance().unregisterCache(this);
+			clear();
+		}
+
+		bool get(Key const &key, Value &outValue) {
+			std::lock_guard<std::mutex> lock(lock_);
+			auto found = index_.find(key);
+			if (found == index_.end()) {
+				statistics_.misses++;
+				return false;
+			}
+			statistics_.hits++;
+			entries_.splice(entries_.begin(), entries_, found->second);
+			outValue = found->second->value;
+			return true;
+		}
+
+		// bytes is the estimated size of key and value, cost a measure of the work to recompute the value, e.g. microseconds
+		void put(Key const &key, Value const &value, int64 bytes, double cost) {
+			int64 grown;
+			{
+				std::lock_guard<std::mutex> lock(lock_);
+				int64 before = statistics_.bytes;
+				auto found = index_.find(key);
+				if (found != index_.end()) {
+					statistics_.bytes -= found->second->bytes;
+					entries_.erase(found->second);
+					index_.erase(found);
+				}
+				entries_.push_front({ key, value, bytes, cost });
+				index_[key] = entries_.begin();
+				statistics_.bytes += bytes;
+				statistics_.entries = (int64)entries_.size();
+				memory_.setBytes(statistics_.bytes);
+				grown = statistics_.bytes - before;
+			}
+			if (grown > 0) {
+				MemoryBudget::instance().charge(grown);
+			}
+			else if (grown < 0) {
+				MemoryBudget::instance().release(-grown);
+			}
+		}
+
+		void clear() {
+			int64 freed;
+			{
+				std::lock_guard<std::mutex> lock(lock_);
+				freed = statistics_.bytes;
+				entries_.clear();
+				index_.clear();
+				statistics_.bytes = 0;
+				statistics_.entries = 0;
+				memory_.setBytes(0);
+			}
+			MemoryBudget::instance().release(freed);
+		}
+
+		Statistics statistics() const override {
+			std::lock_guard<std::mutex> lock(lock_);
+			return statistics_;
+		}
+
+		double evictionScore() const override {
+			std::lock_guard<std::mutex> lock(lock_);
+			auto victim = cheapestVictim();
+			if (victim == entries_.end()) {
+				return std::numeric_limits<double>::infinity();
+			}
+			return victim->cost / (double)std::max((int64)1, victim->bytes);
+		}
+
+		int64 evictOne() override {
+			std::lock_guard<std::mutex> lock(lock_);
+			auto victim = cheapestVictim();
+			if (victim == entries_.end()) {
+				return 0;
+			}
+			int64 freed = victim->bytes;
+			index_.erase(victim->key);
+			entries_.erase(victim);
+			statistics_.bytes -= freed;
+			statistics_.entries = (int64)entries_.size();
+			statistics_.evictions++;
+			memory_.setBytes(statistics_.bytes);
+			return freed;
+		}
+
+	private:
+		struct Entry {
+			Key key;
+			Value value;
+			int64 bytes;
+			double cost;
+		};
+		typedef typename std::list<Entry>::const_iterator EntryIterator;
+
+		// Looks at the least recently used few entries only, and picks the one cheapest to recompute per byte among them
+		EntryIterator cheapestVictim() const {
+			if (entries_.empty()) {
+				return entries_.end();
+			}
+			EntryIterator best = std::prev(entries_.end());
+			EntryIterator candidate = best;
+			for (int i = 0; i < kEvictionSample && candidate != entries_.begin(); i++) {
+				--candidate;
+				if (candidate->cost / (double)std::max((int64)1, candidate->bytes) < best->cost / (double)std::max((int64)1, best->bytes)) {
+					best = candidate;
+				}
+			}
+			return best;
+		}
+
+		static const int kEvictionSample = 8;
+
+		mutable std::mutex lock_;
+		std::list<Entry> entries_; // Most recently used first
+		std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> index_;
+		Statistics statistics_;
+		TrackedAllocation memory_;
+	};
+
+}
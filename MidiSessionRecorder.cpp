@@ -0,0 +1,239 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "MidiSessionRecorder.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace midikraft {
+
+	MidiSessionRecorder::MidiSessionRecorder() : startMillis_(0.0), handle_(MidiController::makeOneHandle()), handlerRegistered_(false)
+	{
+	}
+
+	MidiSessionRecorder::~MidiSessionRecorder()
+	{
+		stop();
+	}
+
+	bool MidiSessionRecorder::start(File const &traceFile)
+	{
+		stop();
+		if (traceFile.existsAsFile()) {
+			traceFile.deleteFile();
+		}
+		auto out = std::make_unique<FileOutputStream>(traceFile);
+		if (!out->openedOk()) {
+			SimpleLogger::instance()->postMessage("Can't record MIDI session, failed to create " + traceFile.getFullPathName());
+			return false;
+		}
+		{
+			ScopedLock lock(lock_);
+			out_ = std::move(out);
+			startMillis_ = Time::getMillisecondCounterHiRes();
+		}
+		MidiController::instance()->addMessageHandler(handle_, [this](MidiInput *source, MidiMessage const &message) {
+			ignoreUnused(source);
+			recordReceived(message);
+		});
+		handlerRegistered_ = true;
+		return true;
+	}
+
+	void MidiSessionRecorder::stop()
+	{
+		if (handlerRegistered_) {
+			MidiController::instance()->removeMessageHandler(handle_);
+			handlerRegistered_ = false;
+		}
+		ScopedLock lock(lock_);
+		if (out_) {
+			out_->flush();
+			out_.reset();
+		}
+	}
+
+	bool MidiSessionRecorder::isRecording() const
+	{
+		ScopedLock lock(lock_);
+		return out_ != nullptr;
+	}
+
+	void MidiSessionRecorder::recordSent(std::vector<MidiMessage> const &messages)
+	{
+		for (auto const &message : messages) {
+			write("out", message);
+		}
+	}
+
+	void MidiSessionRecorder::recordReceived(MidiMessage const &message)
+	{
+		write("in", message);
+	}
+
+	void MidiSessionRecorder::write(const char *direction, MidiMessage const &message)
+	{
+		ScopedLock lock(lock_);
+		if (out_) {
+			auto micros = (int64)((Time::getMillisecondCounterHiRes() - startMillis_) * 1000.0);
+			auto line = (boost::format("%d %s ") % micros % direction).str();
+			*out_ << String(line) << String::toHexString(message.getRawData(), message.getRawDataSize(), 0) << "\n";
+		}
+	}
+
+	MidiSessionReplay::MidiSessionReplay() : Thread("MidiSessionReplay"), speedFactor_(1.0), diverged_(false)
+	{
+	}
+
+	MidiSessionReplay::~MidiSessionReplay()
+	{
+		stop();
+	}
+
+	bool MidiSessionReplay::load(File const &traceFile)
+	{
+		jassert(!isThreadRunning());
+		events_.clear();
+		{
+			ScopedLock lock(sentLock_);
+			sent_.clear();
+		}
+		StringArray lines;
+		traceFile.readLines(lines);
+		for (auto const &line : lines) {
+			auto tokens = StringArray::fromTokens(line, " ", "");
+			if (tokens.size() != 3 || (tokens[1] != "in" && tokens[1] != "out")) {
+				if (line.trim().isNotEmpty()) {
+					SimpleLogger::instance()->postMessage("Skipping invalid line in MIDI session recording: " + line);
+				}
+				continue;
+			}
+			MemoryBlock data;
+			data.loadFromHexString(tokens[2]);
+			if (data.getSize() == 0) {
+				continue;
+			}
+			events_.push_back({ (double)tokens[0].getLargeIntValue(), tokens[1] == "in", MidiMessage(data.getData(), (int)data.getSize()) });
+		}
+		return !events_.empty();
+	}
+
+	std::vector<MidiSessionReplay::Event> const &MidiSessionReplay::events() const
+	{
+		return events_;
+	}
+
+	size_t MidiSessionReplay::numberOfReceived() const
+	{
+		return (size_t)std::count_if(events_.begin(), events_.end(), [](Event const &e) { return e.received; });
+	}
+
+	size_t MidiSessionReplay::numberOfSent() const
+	{
+		return events_.size() - numberOfReceived();
+	}
+
+	void MidiSessionReplay::start(double speedFactor, std::function<void()> onFinished)
+	{
+		stop();
+		speedFactor_ = speedFactor;
+		onFinished_ = onFinished;
+		diverged_ = false;
+		startThread();
+	}
+
+	void MidiSessionReplay::stop()
+	{
+		signalThreadShouldExit();
+		sentAvailable_.signal();
+		stopThread(1000);
+	}
+
+	bool MidiSessionReplay::isReplaying() const
+	{
+		return isThreadRunning();
+	}
+
+	bool MidiSessionReplay::hasDiverged() const
+	{
+		return diverged_;
+	}
+
+	void MidiSessionReplay::requestSent(std::vector<MidiMessage> const &messages)
+	{
+		{
+			ScopedLock lock(sentLock_);
+			sent_.insert(sent_.end(), messages.begin(), messages.end());
+		}
+		sentAvailable_.signal();
+	}
+
+	bool MidiSessionReplay::waitForRequest(MidiMessage const &expected)
+	{
+		while (!threadShouldExit()) {
+			{
+				ScopedLock lock(sentLock_);
+				if (!sent_.empty()) {
+					auto message = sent_.front();
+					sent_.pop_front();
+					if (message.getRawDataSize() != expected.getRawDataSize() || memcmp(message.getRawData(), expected.getRawData(), (size_t)expected.getRawDataSize()) != 0) {
+						SimpleLogger::instance()->postMessage("MIDI session replay diverged from the recording, expected request " + String::toHexString(expected.getRawData(), expected.getRawDataSize())
+							+ " but got " + String::toHexString(message.getRawData(), message.getRawDataSize()));
+						diverged_ = true;
+						return false;
+					}
+					return true;
+				}
+			}
+			sentAvailable_.wait(100);
+		}
+		return false;
+	}
+
+	void MidiSessionReplay::run()
+	{
+		// The spacing of the received messages is measured from the request they answer
+		double anchorMillis = Time::getMillisecondCounterHiRes();
+		double anchorMicros = -1.0;
+		for (auto const &event : events_) {
+			if (threadShouldExit()) {
+				return;
+			}
+			if (!event.received) {
+				if (!waitForRequest(event.message)) {
+					break;
+				}
+				anchorMillis = Time::getMillisecondCounterHiRes();
+				anchorMicros = event.micros;
+				continue;
+			}
+			if (anchorMicros < 0.0) {
+				// Received before the first request, e.g. a synth sending on its own. The time before that was spent by the user starting the download
+				anchorMicros = event.micros;
+			}
+			if (speedFactor_ > 0.0) {
+				double due = anchorMillis + (event.micros - anchorMicros) / 1000.0 / speedFactor_;
+				double delay = due - Time::getMillisecondCounterHiRes();
+				if (delay > 0.0) {
+					wait((int)std::ceil(delay));
+				}
+			}
+			// The source is null, see the class comment
+			MidiController::instance()->handleIncomingMidiMessage(nullptr, event.message);
+		}
+		if (threadShouldExit()) {
+			return;
+		}
+		if (onFinished_) {
+			onFinished_();
+		}
+	}
+
+}
@@ -0,0 +1,97 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "MidiController.h"
+
+#include <atomic>
+#include <deque>
+
+namespace midikraft {
+
+	// Records the MIDI traffic of a session with a real synth into a text file, one line per message:
+	//
+	//     <microseconds since start> <in|out> <hex bytes>
+	//
+	// Received messages are picked up by an own MidiController handler, sent messages have to be reported by the code sending
+	// them (the Librarian does this for all requests of its downloads).
+	class MidiSessionRecorder {
+	public:
+		MidiSessionRecorder();
+		~MidiSessionRecorder();
+
+		bool start(File const &traceFile);
+		void stop();
+		bool isRecording() const;
+
+		void recordSent(std::vector<MidiMessage> const &messages);
+		void recordReceived(MidiMessage const &message);
+
+	private:
+		void write(const char *direction, MidiMessage const &message);
+
+		CriticalSection lock_;
+		std::unique_ptr<FileOutputStream> out_;
+		double startMillis_;
+		MidiController::HandlerHandle handle_;
+		bool handlerRegistered_;
+	};
+
+	// Plays back a recorded session by feeding the received messages into MidiController, as if they came from the synth.
+	//
+	// The replay is closed loop: the recorded requests are not sent anywhere, instead each block of received messages is held back
+	// until the code under test has sent the request recorded before it. For this the replay has to be set as the send target,
+	// see Librarian::setSessionReplay, which hands all requests to requestSent() instead of the MIDI output. If a request differs
+	// from the recorded one the replay stops and hasDiverged() returns true.
+	//
+	// Within a block, the messages keep their recorded spacing to the request divided by the speed factor, a speed factor of 0 sends
+	// them as fast as possible.
+	//
+	// JUCE does not allow to construct a MidiInput, so the messages are delivered with a null source. Handlers active during a replay
+	// must not dereference the source, the ones of the Librarian and the MidiSessionRecorder ignore it.
+	class MidiSessionReplay : private Thread {
+	public:
+		struct Event {
+			double micros;
+			bool received;
+			MidiMessage message;
+		};
+
+		MidiSessionReplay();
+		virtual ~MidiSessionReplay() override;
+
+		bool load(File const &traceFile);
+		std::vector<Event> const &events() const;
+		size_t numberOfReceived() const;
+		size_t numberOfSent() const;
+
+		// Starts feeding in the messages on a background thread, onFinished is called from that thread when all are delivered or the
+		// replay diverged from the recording
+		void start(double speedFactor, std::function<void()> onFinished = nullptr);
+		void stop();
+		bool isReplaying() const;
+		bool hasDiverged() const;
+
+		// Takes the requests that would have been sent to the synth, can be called from any thread
+		void requestSent(std::vector<MidiMessage> const &messages);
+
+	private:
+		void run() override;
+		bool waitForRequest(MidiMessage const &expected);
+
+		std::vector<Event> events_;
+		double speedFactor_;
+		std::function<void()> onFinished_;
+		CriticalSection sentLock_;
+		std::deque<MidiMessage> sent_; // Requests not yet matched against the recording
+		WaitableEvent sentAvailable_;
+		std::atomic<bool> diverged_;
+	};
+
+}
@@ -17,7 +17,11 @@
 
 #include <boost/format.hpp>
 
+#include <map>
+
+#include "ConcurrentSynthAccess.h"
 #include "RapidjsonHelper.h"
+#include "TaskScheduler.h"
 #include "nlohmann/json.hpp"
 
 namespace midikraft {
@@ -35,18 +39,29 @@ namespace midikraft {
 
 	PatchHolder::PatchHolder(std::shared_ptr<Synth> activeSynth, std::shared_ptr<SourceInfo> sourceInfo, std::shared_ptr<DataFile> patch, 
 		MidiBankNumber bank, MidiProgramNumber place, std::shared_ptr<AutomaticCategory> detector /* = nullptr */)
-		: sourceInfo_(sourceInfo), patch_(patch), type_(0), isFavorite_(Favorite()), isHidden_(false), synth_(activeSynth), bankNumber_(bank), patchNumber_(place)
+		: sourceInfo_(sourceInfo), patch_(patch), type_(0), isFavorite_(Favorite()), isHidden_(false), synth_(activeSynth), bankNumber_(bank), patchNumber_(place),
+		memory_(MemoryAccounting::Kind::PATCH_HOLDER)
 	{
 		if (patch) {
 			name_ = patch->name();
+			payloadMemory_ = std::make_shared<TrackedAllocation>(MemoryAccounting::Kind::SYSEX_PAYLOAD, (int64)patch->data().size());
 			if (detector) {
 				categories_ = detector->determineAutomaticCategories(*this);
 			}
 		}
+		updateAccounting();
+	}
+
+	PatchHolder::PatchHolder() : isFavorite_(Favorite()), type_(0), isHidden_(false), bankNumber_(MidiBankNumber::fromZeroBase(0)), patchNumber_(MidiProgramNumber::fromZeroBase(0)),
+		memory_(MemoryAccounting::Kind::PATCH_HOLDER, (int64)sizeof(PatchHolder))
+	{
 	}
 
-	PatchHolder::PatchHolder() : isFavorite_(Favorite()), type_(0), isHidden_(false), bankNumber_(MidiBankNumber::fromZeroBase(0)), patchNumber_(MidiProgramNumber::fromZeroBase(0))
+	void PatchHolder::updateAccounting()
 	{
+		// Rough size of a std::set node holding a Category (three pointers, color, the shared_ptr)
+		const int64 kSetNodeBytes = 48;
+		memory_.setBytes((int64)(sizeof(PatchHolder) + name_.capacity() + sourceId_.capacity()) + kSetNodeBytes * (int64)(categories_.size() + userDecisions_.size()));
 	}
 
 	std::shared_ptr<DataFile> PatchHolder::patch() const
@@ -81,6 +96,7 @@ namespace midikraft {
 			// The name is only stored in the PatchHolder, and thus the database, anyway, so we just accept the string
 			name_ = newName;
 		}
+		updateAccounting();
 	}
 
 	std::string PatchHolder::name() const
@@ -91,6 +107,7 @@ namespace midikraft {
 	void PatchHolder::setSourceId(std::string const &source_id)
 	{
 		sourceId_ = source_id;
+		updateAccounting();
 	}
 
 	std::string PatchHolder::sourceId() const
@@ -163,16 +180,19 @@ namespace midikraft {
 		else {
 			categories_.insert(category);
 		}
+		updateAccounting();
 	}
 
 	void PatchHolder::setCategories(std::set<Category> const &cats)
 	{
 		categories_ = cats;
+		updateAccounting();
 	}
 
 	void PatchHolder::clearCategories()
 	{
 		categories_.clear();
+		updateAccounting();
 	}
 
 	std::set<Category> PatchHolder::categories() const
@@ -193,27 +213,31 @@ namespace midikraft {
 	bool PatchHolder::autoCategorizeAgain(std::shared_ptr<AutomaticCategory> detector)
 	{
 		auto previous = categories();
-		auto newCategories = detector->determineAutomaticCategories(*this);
-		if (previous != newCategories) {
+		categories_ = categoriesAfterAutoCategorization(detector->determineAutomaticCategories(*this));
+		updateAccounting();
+		return previous != categories_;
+	}
+
+	std::set<Category> PatchHolder::categoriesAfterAutoCategorization(std::set<Category> const &newCategories) const
+	{
+		auto result = categories_;
+		if (categories_ != newCategories) {
 			for (auto n : newCategories) {
 				if (userDecisions_.find(n) == userDecisions_.end()) {
 					// For this category no user decision has been recorded, so we can safely set it!
-					categories_.insert(n);
+					result.insert(n);
 				}
 			}
-			for (auto o : previous) {
+			for (auto o : categories_) {
 				if (newCategories.find(o) == newCategories.end()) {
 					// This category has been removed by the auto categorizer, let's check if there is no user decision on it!
 					if (userDecisions_.find(o) == userDecisions_.end()) {
-						categories_.erase(o);
+						result.erase(o);
 					}
 				}
 			}
-			return previous != categories_;
-		}
-		else {
-			return false;
 		}
+		return result;
 	}
 
 	std::string PatchHolder::md5() const
@@ -244,14 +268,138 @@ namespace midikraft {
 		}
 	}
 
+	std::string PatchHolder::createDragInfoString(std::vector<PatchHolder> const &patches)
+	{
+		// Record: uint16 synth index, int32 data type, uint8 fingerprint length (0 marks a 16 byte binary MD5), fingerprint bytes.
+		// Patches with an empty or too long fingerprint can't be referenced, they are left out
+		std::vector<std::string> fingerprints(patches.size());
+		parallelForSynths(TaskScheduler::Priority::INTERACTIVE, patches.size(), [&](size_t i) { return patches[i].synth(); }, [&](size_t i) {
+			if (patches[i].synth() && patches[i].patch()) {
+				fingerprints[i] = patches[i].md5();
+			}
+		});
+
+		std::vector<std::string> synthNames;
+		std::map<std::string, uint16> synthIndex;
+		std::vector<uint8> records;
+		records.reserve(patches.size() * 23);
+		size_t count = 0;
+		for (size_t i = 0; i < patches.size(); i++) {
+			auto const &patch = patches[i];
+			auto const &fingerprint = fingerprints[i];
+			if (!patch.synth() || !patch.patch() || fingerprint.empty() || fingerprint.size() > 255) continue;
+			auto name = patch.synth()->getName();
+			auto found = synthIndex.find(name);
+			if (found == synthIndex.end()) {
+				found = synthIndex.emplace(name, (uint16)synthNames.size()).first;
+				synthNames.push_back(name);
+			}
+			int dataType = patch.patch()->dataTypeID();
+			records.push_back((uint8)(found->second & 0xff));
+			records.push_back((uint8)(found->second >> 8));
+			for (int shift = 0; shift < 32; shift += 8) {
+				records.push_back((uint8)(((uint32)dataType >> shift) & 0xff));
+			}
+			MemoryBlock binary;
+			if (fingerprint.size() == 32 && String(fingerprint).containsOnly("0123456789abcdefABCDEF")) {
+				binary.loadFromHexString(fingerprint);
+			}
+			if (binary.getSize() == 16) {
+				records.push_back(0);
+				records.insert(records.end(), (uint8 *)binary.getData(), (uint8 *)binary.getData() + 16);
+			}
+			else {
+				records.push_back((uint8)fingerprint.size());
+				records.insert(records.end(), fingerprint.begin(), fingerprint.end());
+			}
+			count++;
+		}
+		nlohmann::json dragInfo = {
+			{ "drag_type", "PATCH_LIST" },
+			{ "synths", synthNames },
+			{ "count", count },
+			{ "patches", Base64::toBase64(records.data(), records.size()).toStdString() }
+		};
+		return dragInfo.dump(-1, ' ', true, nlohmann::detail::error_handler_t::replace);
+	}
+
+	bool PatchHolder::dragReferencesFromString(std::string const &s, std::vector<DragReference> &outReferences)
+	{
+		outReferences.clear();
+		auto dragInfo = dragInfoFromString(s);
+		if (!dragInfo.is_object() || !dragInfo.contains("drag_type") || !dragInfo["drag_type"].is_string()) {
+			return false;
+		}
+		std::string dragType = dragInfo["drag_type"];
+		if (dragType == "PATCH") {
+			if (dragInfo.contains("synth") && dragInfo["synth"].is_string() && dragInfo.contains("data_type") && dragInfo["data_type"].is_number_integer()
+				&& dragInfo.contains("md5") && dragInfo["md5"].is_string()) {
+				outReferences.push_back({ dragInfo["synth"].get<std::string>(), dragInfo["data_type"].get<int>(), dragInfo["md5"].get<std::string>() });
+				return true;
+			}
+			return false;
+		}
+		if (dragType != "PATCH_LIST" || !dragInfo.contains("synths") || !dragInfo["synths"].is_array() || !dragInfo.contains("patches") || !dragInfo["patches"].is_string()) {
+			return false;
+		}
+		std::vector<std::string> synthNames;
+		for (auto const &name : dragInfo["synths"]) {
+			if (!name.is_string()) {
+				return false;
+			}
+			synthNames.push_back(name.get<std::string>());
+		}
+		std::string const &packed = dragInfo["patches"].get_ref<std::string const &>();
+		MemoryOutputStream decoded;
+		if (!Base64::convertFromBase64(decoded, packed)) {
+			return false;
+		}
+		MemoryBlock records = decoded.getMemoryBlock();
+		if (dragInfo.contains("count") && dragInfo["count"].is_number_unsigned()) {
+			// Every record has at least 8 bytes, don't trust a larger count
+			outReferences.reserve(std::min(dragInfo["count"].get<size_t>(), records.getSize() / 8));
+		}
+		static const char *kHex = "0123456789abcdef";
+		uint8 const *data = static_cast<uint8 const *>(records.getData());
+		size_t pos = 0;
+		while (pos + 7 <= records.getSize()) {
+			uint16 synth = (uint16)(data[pos] | (data[pos + 1] << 8));
+			int dataType = (int)(int32)((uint32)data[pos + 2] | ((uint32)data[pos + 3] << 8) | ((uint32)data[pos + 4] << 16) | ((uint32)data[pos + 5] << 24));
+			size_t length = data[pos + 6];
+			pos += 7;
+			size_t bytes = length == 0 ? 16 : length;
+			if (synth >= synthNames.size() || pos + bytes > records.getSize()) {
+				// Truncated or corrupt
+				outReferences.clear();
+				return false;
+			}
+			DragReference reference{ synthNames[synth], dataType, std::string() };
+			if (length == 0) {
+				reference.md5.resize(32);
+				for (size_t i = 0; i < 16; i++) {
+					reference.md5[2 * i] = kHex[data[pos + i] >> 4];
+					reference.md5[2 * i + 1] = kHex[data[pos + i] & 0x0f];
+				}
+			}
+			else {
+				reference.md5.assign((const char *)data + pos, length);
+			}
+			pos += bytes;
+			outReferences.push_back(std::move(reference));
+		}
+		return pos == records.getSize();
+	}
+
 	void PatchHolder::setUserDecision(Category const& clicked)
 	{
 		userDecisions_.insert(clicked);
+		updateAccounting();
 	}
 
 	void PatchHolder::setUserDecisions(std::set<Category> const &cats)
 	{
 		userDecisions_ = cats;
+		updateAccounting();
 	}
 
 	Favorite::Favorite() : favorite_(TFavorite::DONTKNOW)
@@ -285,6 +433,15 @@ namespace midikraft {
 		return favorite_;
 	}
 
+	SourceInfo::SourceInfo() : memory_(MemoryAccounting::Kind::SOURCE_INFO)
+	{
+	}
+
+	void SourceInfo::accountJson()
+	{
+		memory_.setBytes((int64)jsonRep_.capacity());
+	}
+
 	std::string SourceInfo::toString() const
 	{
 		return jsonRep_;
@@ -326,6 +483,7 @@ namespace midikraft {
 			doc.AddMember(rapidjson::StringRef(kBankNumber), bankNo.toZeroBased(), doc.GetAllocator());
 		}
 		jsonRep_ = renderToJson(doc);
+		accountJson();
 	}
 
 	FromSynthSource::FromSynthSource(Time timestamp) : FromSynthSource(timestamp, MidiBankNumber::invalid())
@@ -398,6 +556,11 @@ namespace midikraft {
 		return nullptr;
 	}
 
+	Time FromSynthSource::timestamp() const
+	{
+		return timestamp_;
+	}
+
 	MidiBankNumber FromSynthSource::bankNumber() const
 	{
 		return bankNo_;
@@ -412,7 +575,7 @@ namespace midikraft {
 		doc.AddMember(rapidjson::StringRef(kFullPath), rapidjson::Value(fullpath.c_str(), (rapidjson::SizeType) fullpath.size()), doc.GetAllocator());
 		doc.AddMember(rapidjson::StringRef(kProgramNo), program.toZeroBased(), doc.GetAllocator());
 		jsonRep_ = renderToJson(doc);
-
+		accountJson();
 	}
 
 	std::string FromFileSource::md5(Synth *synth) const
@@ -443,6 +606,11 @@ namespace midikraft {
 		return nullptr;
 	}
 
+	std::string FromFileSource::filename() const
+	{
+		return filename_;
+	}
+
 	FromBulkImportSource::FromBulkImportSource(Time timestamp, std::shared_ptr<SourceInfo> individualInfo) : timestamp_(timestamp), individualInfo_(individualInfo)
 	{
 		rapidjson::Document doc;
@@ -455,6 +623,7 @@ namespace midikraft {
 			doc.AddMember(rapidjson::StringRef(kFileInBulk), rapidjson::Value(subinfo.c_str(), (rapidjson::SizeType)subinfo.size()), doc.GetAllocator());
 		} 
 		jsonRep_ = renderToJson(doc);
+		accountJson();
 	}
 
 	std::string FromBulkImportSource::md5(Synth *synth) const
@@ -513,4 +682,9 @@ namespace midikraft {
 		return individualInfo_;
 	}
 
+	Time FromBulkImportSource::timestamp() const
+	{
+		return timestamp_;
+	}
+
 }
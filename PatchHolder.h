@@ -11,6 +11,7 @@
 #include "Patch.h"
 #include "MidiBankNumber.h"
 #include "AutomaticCategory.h"
+#include "MemoryAccounting.h"
 // Turn off warning on unknown pragmas for VC++
 #pragma warning(push)
 #pragma warning(disable: 4068)
@@ -48,7 +49,11 @@ namespace midikraft {
 		static bool isEditBufferImport(std::shared_ptr<SourceInfo> sourceInfo);
 
 	protected:
+		SourceInfo();
+		void accountJson(); // Call after jsonRep_ has been set
+
 		std::string jsonRep_;
+		TrackedAllocation memory_;
 	};
 
 	class FromSynthSource : public SourceInfo {
@@ -60,6 +65,7 @@ namespace midikraft {
 		virtual std::string toDisplayString(Synth *synth, bool shortVersion) const override;
 		static std::shared_ptr<FromSynthSource> fromString(std::string const &jsonString);
 
+		Time timestamp() const;
 		MidiBankNumber bankNumber() const;
 
 	private:
@@ -74,6 +80,8 @@ namespace midikraft {
 		virtual std::string toDisplayString(Synth *synth, bool shortVersion) const override;
 		static std::shared_ptr<FromFileSource> fromString(std::string const &jsonString);
 
+		std::string filename() const;
+
 	private:
 		const std::string filename_;
 	};
@@ -85,6 +93,7 @@ namespace midikraft {
 		virtual std::string toDisplayString(Synth *synth, bool shortVersion) const override;
 		static std::shared_ptr<FromBulkImportSource> fromString(std::string const &jsonString);
 		std::shared_ptr<SourceInfo> individualInfo() const;
+		Time timestamp() const;
 
 	private:
 		const Time timestamp_;
@@ -136,11 +145,23 @@ namespace midikraft {
 		std::shared_ptr<SourceInfo> sourceInfo() const;
 
 		bool autoCategorizeAgain(std::shared_ptr<AutomaticCategory> detector); // Returns true if categories have changed!
+		std::set<Category> categoriesAfterAutoCategorization(std::set<Category> const &newAutomaticCategories) const; // Respects the user decisions, does not modify the patch
 		
 		std::string md5() const;
 		std::string createDragInfoString() const;
 		static nlohmann::json dragInfoFromString(std::string s);
 
+		// Compact drag payload for a multi-selection (drag_type PATCH_LIST): the synth names once, then one packed record of
+		// synth index, data type and fingerprint per patch, base64 encoded
+		struct DragReference {
+			std::string synth;
+			int dataType;
+			std::string md5;
+		};
+		static std::string createDragInfoString(std::vector<PatchHolder> const &patches);
+		// Decodes both PATCH_LIST and the single PATCH drag info, returns false if it is neither
+		static bool dragReferencesFromString(std::string const &s, std::vector<DragReference> &outReferences);
+
 	private:
 		std::shared_ptr<DataFile> patch_;
 		std::shared_ptr<Synth> synth_;
@@ -154,6 +175,10 @@ namespace midikraft {
 		MidiBankNumber bankNumber_;
 		MidiProgramNumber patchNumber_;
 		std::shared_ptr<SourceInfo> sourceInfo_;
+		TrackedAllocation memory_;
+		std::shared_ptr<TrackedAllocation> payloadMemory_; // Shared by all copies, like the DataFile itself
+
+		void updateAccounting();
 	};
 
 }
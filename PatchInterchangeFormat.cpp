@@ -6,8 +6,9 @@
 
 #include "PatchInterchangeFormat.h"
 
+#include "SynthRegistry.h"
+
 #include "Logger.h"
-#include "Sysex.h"
 
 // Turn off warning on unknown pragmas for VC++
 #pragma warning(push)
@@ -25,26 +26,12 @@
 
 #include "RapidjsonHelper.h"
 #include "JsonSerialization.h"
+#include "SysexSpan.h"
+#include "Trace.h"
 
 #include <cstdio>
 
-namespace {
-
-const char* kSynth = "Synth";
-const char* kName = "Name";
-const char* kSysex = "Sysex";
-const char* kFavorite = "Favorite";
-const char* kPlace = "Place";
-const char* kCategories = "Categories";
-const char* kNonCategories = "NonCategories";
-const char* kSourceInfo = "SourceInfo";
-const char* kLibrary = "Library";
-const char* kHeader = "Header";
-const char* kFileFormat = "FileFormat";
-const char* kPIF = "PatchInterchangeFormat";
-const char* kVersion = "Version";
-
-}
+using namespace midikraft::PatchInterchangeFormatFields;
 
 namespace midikraft {
 
@@ -81,20 +68,33 @@ namespace midikraft {
 	*   1  - First version with header containing name of file format and version number, else it is identical to version 0 containing the patches in the field "Library" (to mark it is not a bank!)
 	*/
 
-	std::vector<midikraft::PatchHolder> PatchInterchangeFormat::load(std::map<std::string, std::shared_ptr<Synth>> activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector)
+	std::vector<midikraft::PatchHolder> PatchInterchangeFormat::load(std::string const &filename, std::shared_ptr<AutomaticCategory> detector)
+	{
+		return load(SynthRegistry::instance().synthMap(), filename, detector);
+	}
+
+	std::vector<midikraft::PatchHolder> PatchInterchangeFormat::load(std::map<std::string, std::shared_ptr<Synth>> const &activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector)
 	{
+		MIDIKRAFT_TRACE_SCOPE("PatchInterchangeFormat::load", "pif");
 		std::vector<midikraft::PatchHolder> result;
 
 		// Check if file exists
 		File pif(filename);
 		auto fileSource = std::make_shared<FromFileSource>(pif.getFileName().toStdString(), pif.getFullPathName().toStdString(), MidiProgramNumber::fromZeroBase(0));
 		if (pif.existsAsFile()) {
-			FileInputStream in(pif);
-			String content = in.readEntireStreamAsString();
+			String content;
+			{
+				MIDIKRAFT_TRACE_SCOPE("Read file", "pif");
+				FileInputStream in(pif);
+				content = in.readEntireStreamAsString();
+			}
 
 			// Try to parse it!
 			rapidjson::Document jsonDoc;
-			jsonDoc.Parse(content.toStdString().c_str());
+			{
+				MIDIKRAFT_TRACE_SCOPE("Parse JSON", "pif");
+				jsonDoc.Parse(content.toRawUTF8());
+			}
 
 			int version = 0;
 			if (jsonDoc.IsObject()) {
@@ -145,11 +145,12 @@ namespace midikraft {
 						continue;
 					}
 					const char* synthname = (*item)[kSynth].GetString();
-					if (activeSynths.find(synthname) == activeSynths.end()) {
+					auto found = activeSynths.find(synthname);
+					if (found == activeSynths.end()) {
 						SimpleLogger::instance()->postMessage((boost::format("Skipping patch which is for synth %s and not for any present in the list given") % synthname).str());
 						continue;
 					}
-					auto activeSynth = activeSynths[synthname];
+					auto activeSynth = found->second;
 					if (!item->HasMember(kName)) {
 						SimpleLogger::instance()->postMessage("Skipping patch which has no 'Name' field");
 						continue;
@@ -227,14 +228,26 @@ namespace midikraft {
 						importInfo = SourceInfo::fromString(renderToJson((*item)[kSourceInfo]));
 					}
 
-					// All mandatory fields found, we can parse the data!
-					MemoryBlock sysexData;
-					MemoryOutputStream writeToBlock(sysexData, false);
-					String base64encoded = (*item)[kSysex].GetString();
-					if (Base64::convertFromBase64(writeToBlock, base64encoded)) {
-						writeToBlock.flush();
-						auto messages = Sysex::memoryBlockToMessages(sysexData);
-						auto patches = activeSynth->loadSysex(messages);
+					// All mandatory fields found, we can parse the data! Decode straight from the JSON string into one buffer, and split it
+					// into messages without copying - the only copy left is into the MidiMessages the Synth API requires
+					auto const &base64encoded = (*item)[kSysex];
+					SysexSpan sysexData;
+					bool decoded;
+					{
+						MIDIKRAFT_TRACE_SCOPE("Base64 decode", "pif");
+						decoded = base64encoded.IsString() && SysexSpan::fromBase64(base64encoded.GetString(), base64encoded.GetStringLength(), sysexData);
+					}
+					if (decoded) {
+						std::vector<MidiMessage> messages;
+						{
+							MIDIKRAFT_TRACE_SCOPE("Split messages", "pif");
+							messages = SysexSpan::toMidiMessages(sysexData.messages());
+						}
+						TPatchVector patches;
+						{
+							MIDIKRAFT_TRACE_SCOPE("Synth::loadSysex", "pif");
+							patches = activeSynth->loadSysex(messages);
+						}
 						//jassert(patches.size() == 1);
 						if (patches.size() == 1) {
 							//TODO The file format did not specify MIDI banks 
@@ -266,8 +279,60 @@ namespace midikraft {
 		return result;
 	}
 
+	static void patchToJson(PatchHolder const &patch, std::vector<MidiMessage> const &sysexMessages, rapidjson::Value &patchJson, rapidjson::Document &doc)
+	{
+		patchJson.SetObject();
+		addToJson(kSynth, patch.synth()->getName(), patchJson, doc);
+		addToJson(kName, patch.name(), patchJson, doc);
+		patchJson.AddMember(rapidjson::StringRef(kFavorite), patch.isFavorite() ? 1 : 0, doc.GetAllocator());
+		patchJson.AddMember(rapidjson::StringRef(kPlace), patch.patchNumber().toZeroBased(), doc.GetAllocator());
+		auto categoriesSet = patch.categories();
+		auto userDecisions = patch.userDecisionSet();
+		auto userDefinedCategories = category_intersection(categoriesSet, userDecisions);
+		if (!userDefinedCategories.empty()) {
+			// Here is a list of categories to write
+			rapidjson::Value categoryList;
+			categoryList.SetArray();
+			for (auto cat : userDefinedCategories) {
+				rapidjson::Value catValue;
+				catValue.SetString(cat.category().c_str(), doc.GetAllocator());
+				categoryList.PushBack(catValue, doc.GetAllocator());
+			}
+			patchJson.AddMember(rapidjson::StringRef(kCategories), categoryList, doc.GetAllocator());
+		}
+		auto userDefinedNonCategories = category_difference(userDecisions, categoriesSet);
+		if (!userDefinedNonCategories.empty()) {
+			// Here is a list of non-categories to write
+			rapidjson::Value nonCategoryList;
+			nonCategoryList.SetArray();
+			for (auto cat : userDefinedNonCategories) {
+				rapidjson::Value catValue;
+				catValue.SetString(cat.category().c_str(), doc.GetAllocator());
+				nonCategoryList.PushBack(catValue, doc.GetAllocator());
+			}
+			patchJson.AddMember(rapidjson::StringRef(kNonCategories), nonCategoryList, doc.GetAllocator());
+		}
+
+		if (patch.sourceInfo()) {
+			std::string jsonRep = patch.sourceInfo()->toString();
+			rapidjson::Document sourceInfoDoc(&doc.GetAllocator());
+			sourceInfoDoc.Parse(jsonRep.c_str());
+			patchJson.AddMember(rapidjson::StringRef(kSourceInfo), sourceInfoDoc, doc.GetAllocator());
+		}
+
+		// Now the fun part, pack the sysex for transport
+		std::vector<uint8> data;
+		// Just concatenate all messages generated into one uint8 array
+		for (auto const &m : sysexMessages) {
+			std::copy(m.getRawData(), m.getRawData() + m.getRawDataSize(), std::back_inserter(data));
+		}
+		std::string base64encoded = JsonSerialization::dataToString(data);
+		addToJson(kSysex, base64encoded, patchJson, doc);
+	}
+
 	void PatchInterchangeFormat::save(std::vector<PatchHolder> const &patches, std::string const &toFilename)
 	{
+		MIDIKRAFT_TRACE_SCOPE("PatchInterchangeFormat::save", "pif");
 		File outputFile(toFilename);
 		if (outputFile.existsAsFile()) {
 			outputFile.deleteFile();
@@ -284,57 +349,9 @@ namespace midikraft {
 
 		rapidjson::Value library;
 		library.SetArray();
-		for (auto patch : patches) {
+		for (auto const &patch : patches) {
 			rapidjson::Value patchJson;
-			patchJson.SetObject();
-			addToJson(kSynth, patch.synth()->getName(), patchJson, doc);
-			addToJson(kName, patch.name(), patchJson, doc);
-			patchJson.AddMember(rapidjson::StringRef(kFavorite), patch.isFavorite() ? 1 : 0, doc.GetAllocator());
-			patchJson.AddMember(rapidjson::StringRef(kPlace), patch.patchNumber().toZeroBased(), doc.GetAllocator());
- 			auto categoriesSet = patch.categories();
-			auto userDecisions = patch.userDecisionSet();
-			auto userDefinedCategories = category_intersection(categoriesSet, userDecisions);
-			if (!userDefinedCategories.empty()) {
-				// Here is a list of categories to write
-				rapidjson::Value categoryList;
-				categoryList.SetArray();
-				for (auto cat : userDefinedCategories) {
-					rapidjson::Value catValue;
-					catValue.SetString(cat.category().c_str(), doc.GetAllocator());
-					categoryList.PushBack(catValue, doc.GetAllocator());
-				}
-				patchJson.AddMember(rapidjson::StringRef(kCategories), categoryList, doc.GetAllocator());
-			}
-			auto userDefinedNonCategories = category_difference(userDecisions, categoriesSet);
-			if (!userDefinedNonCategories.empty()) {
-				// Here is a list of non-categories to write
-				rapidjson::Value nonCategoryList;
-				nonCategoryList.SetArray();
-				for (auto cat : userDefinedNonCategories) {
-					rapidjson::Value catValue;
-					catValue.SetString(cat.category().c_str(), doc.GetAllocator());
-					nonCategoryList.PushBack(catValue, doc.GetAllocator());
-				}
-				patchJson.AddMember(rapidjson::StringRef(kNonCategories), nonCategoryList, doc.GetAllocator());
-			}
-
-			if (patch.sourceInfo()) {
-				std::string jsonRep = patch.sourceInfo()->toString();
-				rapidjson::Document sourceInfoDoc(&doc.GetAllocator());
-				sourceInfoDoc.Parse(jsonRep.c_str());
-				patchJson.AddMember(rapidjson::StringRef(kSourceInfo), sourceInfoDoc, doc.GetAllocator());
-			}
-
-			// Now the fun part, pack the sysex for transport
-			auto sysexMessages = patch.synth()->dataFileToSysex(patch.patch(), nullptr);
-			std::vector<uint8> data;
-			// Just concatenate all messages generated into one uint8 array
-			for (auto m : sysexMessages) {
-				std::copy(m.getRawData(), m.getRawData() + m.getRawDataSize(), std::back_inserter(data));
-			}
-			std::string base64encoded = JsonSerialization::dataToString(data);
-			addToJson(kSysex, base64encoded, patchJson, doc);
-
+			patchToJson(patch, patch.synth()->dataFileToSysex(patch.patch(), nullptr), patchJson, doc);
 			library.PushBack(patchJson, doc.GetAllocator());
 		}
 		doc.AddMember(rapidjson::StringRef(kLibrary), library, doc.GetAllocator());
@@ -349,6 +366,7 @@ namespace midikraft {
 #else
 		FILE* fp = fopen(toFilename.c_str(), "w");
 #endif
+		MIDIKRAFT_TRACE_SCOPE("Write JSON", "pif");
 		char writeBuffer[65536];
 		rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
 		rapidjson::PrettyWriter<rapidjson::FileWriteStream> writer(os);
@@ -356,4 +374,81 @@ namespace midikraft {
 		fclose(fp);
 }
 
+	struct PatchInterchangeFormatWriter::Impl {
+		FILE *fp = nullptr;
+		bool ok = false;
+		char writeBuffer[65536];
+		std::unique_ptr<rapidjson::FileWriteStream> stream;
+		std::unique_ptr<rapidjson::PrettyWriter<rapidjson::FileWriteStream>> writer;
+	};
+
+	PatchInterchangeFormatWriter::PatchInterchangeFormatWriter(std::string const &toFilename) : impl_(std::make_unique<Impl>())
+	{
+		File outputFile(toFilename);
+		if (outputFile.existsAsFile()) {
+			outputFile.deleteFile();
+		}
+#if WIN32
+		if (fopen_s(&impl_->fp, toFilename.c_str(), "wb") != 0) {
+			impl_->fp = nullptr;
+		}
+#else
+		impl_->fp = fopen(toFilename.c_str(), "w");
+#endif
+		if (!impl_->fp) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to open file %s to write patch interchange format to") % toFilename).str());
+			return;
+		}
+		impl_->stream = std::make_unique<rapidjson::FileWriteStream>(impl_->fp, impl_->writeBuffer, sizeof(impl_->writeBuffer));
+		impl_->writer = std::make_unique<rapidjson::PrettyWriter<rapidjson::FileWriteStream>>(*impl_->stream);
+		// Same layout as save() produces
+		auto &writer = *impl_->writer;
+		writer.StartObject();
+		writer.Key(kHeader);
+		writer.StartObject();
+		writer.Key(kFileFormat);
+		writer.String(kPIF);
+		writer.Key(kVersion);
+		writer.Int(1);
+		writer.EndObject();
+		writer.Key(kLibrary);
+		writer.StartArray();
+	}
+
+	PatchInterchangeFormatWriter::~PatchInterchangeFormatWriter()
+	{
+		close();
+	}
+
+	bool PatchInterchangeFormatWriter::isOpen() const
+	{
+		return impl_->writer != nullptr;
+	}
+
+	void PatchInterchangeFormatWriter::add(PatchHolder const &patch, std::vector<MidiMessage> const &sysexMessages)
+	{
+		if (!impl_->writer || !patch.patch()) {
+			return;
+		}
+		rapidjson::Document doc;
+		rapidjson::Value patchJson;
+		patchToJson(patch, sysexMessages, patchJson, doc);
+		patchJson.Accept(*impl_->writer);
+	}
+
+	bool PatchInterchangeFormatWriter::close()
+	{
+		if (impl_->writer) {
+			impl_->writer->EndArray();
+			impl_->writer->EndObject();
+			impl_->stream->Flush();
+			impl_->writer.reset();
+			impl_->stream.reset();
+			bool writeError = ferror(impl_->fp) != 0;
+			impl_->ok = fclose(impl_->fp) == 0 && !writeError;
+			impl_->fp = nullptr;
+		}
+		return impl_->ok;
+	}
+
 }
@@ -13,12 +13,51 @@
 
 namespace midikraft {
 
+	// Field names of the PatchInterchangeFormat JSON, shared by load, save and the PatchInterchangeFormatChecker
+	namespace PatchInterchangeFormatFields {
+		const char * const kSynth = "Synth";
+		const char * const kName = "Name";
+		const char * const kSysex = "Sysex";
+		const char * const kFavorite = "Favorite";
+		const char * const kPlace = "Place";
+		const char * const kCategories = "Categories";
+		const char * const kNonCategories = "NonCategories";
+		const char * const kSourceInfo = "SourceInfo";
+		const char * const kLibrary = "Library";
+		const char * const kHeader = "Header";
+		const char * const kFileFormat = "FileFormat";
+		const char * const kPIF = "PatchInterchangeFormat";
+		const char * const kVersion = "Version";
+	}
+
+	// Resolves a category name as stored in a PatchInterchangeFormat file, including the names used by older tools
+	bool findCategory(std::shared_ptr<AutomaticCategory> detector, const char *categoryName, midikraft::Category &outCategory);
+
 	class PatchInterchangeFormat {
 	public:
-		static std::vector<PatchHolder> load(std::map<std::string, std::shared_ptr<Synth>> activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector);
+		static std::vector<PatchHolder> load(std::map<std::string, std::shared_ptr<Synth>> const &activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector);
+		// With the synths from the SynthRegistry
+		static std::vector<PatchHolder> load(std::string const &filename, std::shared_ptr<AutomaticCategory> detector);
 		static void save(std::vector<PatchHolder> const &patches, std::string const &toFilename);
 	};
 
+	// Writes a PatchInterchangeFormat file one patch at a time, for exports that don't want to build the whole document in memory.
+	// The caller passes the edit buffer sysex of each patch, so it can be shared with other exports of the same patch.
+	class PatchInterchangeFormatWriter {
+	public:
+		PatchInterchangeFormatWriter(std::string const &toFilename);
+		~PatchInterchangeFormatWriter();
+
+		bool isOpen() const;
+		void add(PatchHolder const &patch, std::vector<MidiMessage> const &sysexMessages);
+		// Returns false if the file could not be opened or not be written completely
+		bool close();
+
+	private:
+		struct Impl;
+		std::unique_ptr<Impl> impl_;
+	};
+
 }
 
 
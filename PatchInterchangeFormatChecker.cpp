@@ -0,0 +1,467 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "PatchInterchangeFormatChecker.h"
+
+#include "PatchInterchangeFormat.h"
+#include "ConcurrentSynthAccess.h"
+#include "PatchHolder.h"
+#include "SynthRegistry.h"
+#include "SysexSpan.h"
+#include "TaskScheduler.h"
+#include "Trace.h"
+
+#include "Logger.h"
+
+// Turn off warning on unknown pragmas for VC++
+#pragma warning(push)
+#pragma warning(disable: 4068)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wzero-as-null-pointer-constant"
+#include "rapidjson/document.h"
+#include "rapidjson/reader.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/filereadstream.h"
+#include "rapidjson/filewritestream.h"
+#include "rapidjson/error/en.h"
+#pragma GCC diagnostic pop
+#pragma warning(pop)
+
+#include <boost/format.hpp>
+
+#include "RapidjsonHelper.h"
+
+#include <algorithm>
+#include <cstdio>
+
+using namespace midikraft::PatchInterchangeFormatFields;
+
+namespace {
+
+	const size_t kBatchSize = 256;
+
+	FILE *openFile(std::string const &filename, const char *mode) {
+#if WIN32
+		FILE *fp = nullptr;
+		if (fopen_s(&fp, filename.c_str(), mode) != 0) {
+			return nullptr;
+		}
+		return fp;
+#else
+		return fopen(filename.c_str(), mode);
+#endif
+	}
+
+	// SAX handler that cuts the records of the Library array (and the Header object) out of the stream, each as its own JSON text
+	class RecordCollector {
+	public:
+		RecordCollector(std::function<void(std::string &&)> onRecord) : onRecord_(onRecord), depth_(0), libraryDepth_(-1), captureDepth_(-1), capturingHeader_(false), writer_(buffer_) {}
+
+		std::string const &header() const { return header_; }
+		bool isVersion0() const { return libraryDepth_ == 1; }
+
+		bool Null() { return capturing() ? writer_.Null() : scalar(); }
+		bool Bool(bool b) { return capturing() ? writer_.Bool(b) : scalar(); }
+		bool Int(int i) { return capturing() ? writer_.Int(i) : scalar(); }
+		bool Uint(unsigned u) { return capturing() ? writer_.Uint(u) : scalar(); }
+		bool Int64(int64_t i) { return capturing() ? writer_.Int64(i) : scalar(); }
+		bool Uint64(uint64_t u) { return capturing() ? writer_.Uint64(u) : scalar(); }
+		bool Double(double d) { return capturing() ? writer_.Double(d) : scalar(); }
+		bool RawNumber(const char *str, rapidjson::SizeType length, bool copy) { return capturing() ? writer_.RawNumber(str, length, copy) : scalar(); }
+		bool String(const char *str, rapidjson::SizeType length, bool copy) { return capturing() ? writer_.String(str, length, copy) : scalar(); }
+
+		bool Key(const char *str, rapidjson::SizeType length, bool copy) {
+			if (capturing()) {
+				return writer_.Key(str, length, copy);
+			}
+			if (depth_ == 1) {
+				rootKey_.assign(str, length);
+			}
+			return true;
+		}
+
+		bool StartObject() {
+			if (!capturing()) {
+				bool header = depth_ == 1 && rootKey_ == kHeader;
+				if (header || (libraryDepth_ >= 0 && depth_ == libraryDepth_)) {
+					buffer_.Clear();
+					writer_.Reset(buffer_);
+					captureDepth_ = depth_ + 1;
+					capturingHeader_ = header;
+				}
+			}
+			depth_++;
+			return capturing() ? writer_.StartObject() : true;
+		}
+
+		bool EndObject(rapidjson::SizeType memberCount) {
+			bool ok = true;
+			if (capturing()) {
+				ok = writer_.EndObject(memberCount);
+				if (depth_ == captureDepth_) {
+					std::string json(buffer_.GetString(), buffer_.GetSize());
+					if (capturingHeader_) {
+						header_ = json;
+					}
+					else {
+						onRecord_(std::move(json));
+					}
+					captureDepth_ = -1;
+				}
+			}
+			depth_--;
+			return ok;
+		}
+
+		bool StartArray() {
+			if (capturing()) {
+				depth_++;
+				return writer_.StartArray();
+			}
+			if (depth_ == 0) {
+				// Version 0 had no header, the whole file is the array of patches
+				libraryDepth_ = 1;
+			}
+			else if (depth_ == 1 && rootKey_ == kLibrary) {
+				libraryDepth_ = 2;
+			}
+			depth_++;
+			return true;
+		}
+
+		bool EndArray(rapidjson::SizeType elementCount) {
+			depth_--;
+			return capturing() ? writer_.EndArray(elementCount) : true;
+		}
+
+	private:
+		bool capturing() const { return captureDepth_ >= 0; }
+
+		bool scalar() {
+			if (libraryDepth_ >= 0 && depth_ == libraryDepth_) {
+				// Something that is not an object in the Library array, still counts as a record so the numbering stays right
+				onRecord_(std::string());
+			}
+			return true;
+		}
+
+		std::function<void(std::string &&)> onRecord_;
+		int depth_;
+		int libraryDepth_;
+		int captureDepth_;
+		bool capturingHeader_;
+		std::string rootKey_;
+		std::string header_;
+		rapidjson::StringBuffer buffer_;
+		rapidjson::Writer<rapidjson::StringBuffer> writer_;
+	};
+
+	struct Issue {
+		std::string problem;
+		std::string detail;
+		bool error; // Errors drop the record from the repaired output
+	};
+
+	struct RecordResult {
+		std::string synth;
+		std::string name;
+		std::vector<Issue> issues;
+		bool dropped = false;
+		bool repaired = false;
+		bool unverified = false;
+		std::string json; // What goes into the repaired output
+		std::shared_ptr<midikraft::Synth> verifyWith; // Set if the patch data still needs to be checked with the adaptation
+		std::vector<MidiMessage> sysex;
+	};
+
+	bool isIntOrIntString(rapidjson::Value const &value) {
+		if (value.IsInt()) return true;
+		if (!value.IsString()) return false;
+		try {
+			std::stoi(value.GetString());
+			return true;
+		}
+		catch (std::exception &) {
+			return false;
+		}
+	}
+
+	void checkCategoryList(rapidjson::Document &doc, const char *key, std::shared_ptr<midikraft::AutomaticCategory> detector, RecordResult &result) {
+		if (!doc.HasMember(key)) {
+			return;
+		}
+		auto &list = doc[key];
+		if (!list.IsArray()) {
+			result.issues.push_back({ "invalid_categories", (boost::format("%s is not an array") % key).str(), false });
+			doc.RemoveMember(key);
+			result.repaired = true;
+			return;
+		}
+		for (auto cat = list.Begin(); cat != list.End(); ) {
+			midikraft::Category category(nullptr);
+			if (cat->IsString() && midikraft::findCategory(detector, cat->GetString(), category)) {
+				cat++;
+			}
+			else {
+				result.issues.push_back({ "unknown_category", cat->IsString() ? cat->GetString() : "not a string", false });
+				cat = list.Erase(cat);
+				result.repaired = true;
+			}
+		}
+	}
+
+	RecordResult checkRecord(std::string const &json, std::map<std::string, std::shared_ptr<midikraft::Synth>> const &activeSynths, std::shared_ptr<midikraft::AutomaticCategory> detector) {
+		MIDIKRAFT_TRACE_SCOPE("Check record", "fsck");
+		RecordResult result;
+		auto drop = [&result](const char *problem, std::string const &detail) {
+			result.issues.push_back({ problem, detail, true });
+			result.dropped = true;
+			return result;
+		};
+
+		rapidjson::Document doc;
+		if (json.empty() || doc.Parse(json.c_str(), json.size()).HasParseError() || !doc.IsObject()) {
+			return drop("not_an_object", "Library entry is not a JSON object");
+		}
+		if (doc.HasMember(kSynth) && doc[kSynth].IsString()) result.synth = doc[kSynth].GetString();
+		if (doc.HasMember(kName) && doc[kName].IsString()) result.name = doc[kName].GetString();
+		if (result.synth.empty()) {
+			return drop("missing_synth", "No string field 'Synth'");
+		}
+		if (!doc.HasMember(kName) || !doc[kName].IsString()) {
+			return drop("missing_name", "No string field 'Name'");
+		}
+		if (!doc.HasMember(kSysex) || !doc[kSysex].IsString()) {
+			return drop("missing_sysex", "No string field 'Sysex'");
+		}
+
+		// Optional fields are repaired by removing them
+		for (auto key : { kFavorite, kPlace }) {
+			if (doc.HasMember(key) && !isIntOrIntString(doc[key])) {
+				result.issues.push_back({ std::string("invalid_") + String(key).toLowerCase().toStdString(), renderToJson(doc[key]), false });
+				doc.RemoveMember(key);
+				result.repaired = true;
+			}
+		}
+		checkCategoryList(doc, kCategories, detector, result);
+		checkCategoryList(doc, kNonCategories, detector, result);
+		if (doc.HasMember(kSourceInfo) && !midikraft::SourceInfo::fromString(renderToJson(doc[kSourceInfo]))) {
+			result.issues.push_back({ "invalid_source_info", renderToJson(doc[kSourceInfo]), false });
+			doc.RemoveMember(kSourceInfo);
+			result.repaired = true;
+		}
+
+		auto const &base64 = doc[kSysex];
+		midikraft::SysexSpan sysex;
+		if (!midikraft::SysexSpan::fromBase64(base64.GetString(), base64.GetStringLength(), sysex)) {
+			return drop("invalid_base64", (boost::format("%d characters") % base64.GetStringLength()).str());
+		}
+		auto messages = sysex.messages();
+		size_t unterminated = (size_t)std::count_if(messages.begin(), messages.end(), [](midikraft::SysexSpan const &message) {
+			return message.data()[0] == 0xf0 && (message.size() < 2 || message.data()[message.size() - 1] != 0xf7);
+		});
+		if (messages.empty() || unterminated > 0) {
+			result.issues.push_back({ "incomplete_sysex", (boost::format("%d of %d messages are sysex without F7") % unterminated % messages.size()).str(), false });
+		}
+
+		auto found = activeSynths.find(result.synth);
+		if (found == activeSynths.end()) {
+			result.issues.push_back({ "unknown_synth", "Synth is not active, patch data not verified", false });
+			result.unverified = true;
+		}
+		else {
+			result.verifyWith = found->second;
+			result.sysex = midikraft::SysexSpan::toMidiMessages(messages);
+		}
+
+		result.json = result.repaired ? renderToJson(doc) : json;
+		return result;
+	}
+
+	// Second step of checkRecord, separate because it calls into the adaptation and that might not allow concurrent calls
+	void verifyRecord(RecordResult &result) {
+		MIDIKRAFT_TRACE_SCOPE("Verify record", "fsck");
+		auto drop = [&result](const char *problem, std::string const &detail) {
+			result.issues.push_back({ problem, detail, true });
+			result.dropped = true;
+		};
+
+		auto synth = result.verifyWith;
+		try {
+			auto patches = synth->loadSysex(result.sysex);
+			if (patches.size() != 1) {
+				drop("load_failed", (boost::format("loadSysex returned %d patches instead of 1") % patches.size()).str());
+				return;
+			}
+			auto fingerprint = synth->calculateFingerprint(patches[0]);
+			auto reloaded = synth->loadSysex(synth->dataFileToSysex(patches[0], nullptr));
+			if (reloaded.size() != 1) {
+				result.issues.push_back({ "roundtrip_failed", (boost::format("Reloading the generated sysex returned %d patches") % reloaded.size()).str(), false });
+			}
+			else if (synth->calculateFingerprint(reloaded[0]) != fingerprint) {
+				result.issues.push_back({ "fingerprint_unstable", fingerprint, false });
+			}
+		}
+		catch (std::exception &e) {
+			drop("exception", e.what());
+		}
+	}
+
+}
+
+namespace midikraft {
+
+	nlohmann::json PatchInterchangeFormatChecker::check(std::string const &filename, std::shared_ptr<AutomaticCategory> detector, std::string const &repairedFilename)
+	{
+		return check(SynthRegistry::instance().synthMap(), filename, detector, repairedFilename);
+	}
+
+	nlohmann::json PatchInterchangeFormatChecker::check(std::map<std::string, std::shared_ptr<Synth>> const &activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector, std::string const &repairedFilename)
+	{
+		MIDIKRAFT_TRACE_SCOPE("PatchInterchangeFormatChecker::check", "fsck");
+		nlohmann::json report = {
+			{ "file", filename },
+			{ "records", 0 },
+			{ "valid", 0 },
+			{ "repaired", 0 },
+			{ "dropped", 0 },
+			{ "unverified", 0 },
+			{ "problems", nlohmann::json::object() },
+			{ "issues", nlohmann::json::array() }
+		};
+
+		FILE *in = openFile(filename, "rb");
+		if (!in) {
+			report["error"] = "Can't open file";
+			return report;
+		}
+
+		// The repaired file is always written in the current format version
+		FILE *out = nullptr;
+		char writeBuffer[65536];
+		std::unique_ptr<rapidjson::FileWriteStream> outStream;
+		std::unique_ptr<rapidjson::Writer<rapidjson::FileWriteStream>> writer;
+		if (!repairedFilename.empty()) {
+			out = openFile(repairedFilename, "wb");
+			if (!out) {
+				SimpleLogger::instance()->postMessage((boost::format("Failure to open file %s to write the repaired patch interchange format to") % repairedFilename).str());
+			}
+			else {
+				outStream = std::make_unique<rapidjson::FileWriteStream>(out, writeBuffer, sizeof(writeBuffer));
+				writer = std::make_unique<rapidjson::Writer<rapidjson::FileWriteStream>>(*outStream);
+				writer->StartObject();
+				writer->Key(kHeader);
+				writer->StartObject();
+				writer->Key(kFileFormat);
+				writer->String(kPIF);
+				writer->Key(kVersion);
+				writer->Int(1);
+				writer->EndObject();
+				writer->Key(kLibrary);
+				writer->StartArray();
+			}
+		}
+
+		size_t recordCount = 0;
+		std::map<std::string, int> problemCounts;
+		std::map<std::string, int> unknownSynths;
+		std::vector<std::string> batch;
+		auto processBatch = [&]() {
+			std::vector<RecordResult> results(batch.size());
+			TaskScheduler::instance().parallelFor(TaskScheduler::Priority::IMPORT, batch.size(), [&](size_t i) {
+				results[i] = checkRecord(batch[i], activeSynths, detector);
+			});
+			parallelForSynths(TaskScheduler::Priority::IMPORT, results.size(), [&](size_t i) { return results[i].verifyWith.get(); }, [&](size_t i) {
+				if (results[i].verifyWith && !results[i].dropped) {
+					verifyRecord(results[i]);
+				}
+			});
+			// Report and write in file order
+			for (size_t i = 0; i < results.size(); i++) {
+				auto const &result = results[i];
+				size_t recordNo = recordCount + i;
+				for (auto const &issue : result.issues) {
+					problemCounts[issue.problem]++;
+					if (issue.problem == "unknown_synth") {
+						// Typically all records of a synth, so these are summarized per synth instead of listed
+						unknownSynths[result.synth]++;
+						continue;
+					}
+					report["issues"].push_back({
+						{ "record", recordNo },
+						{ "synth", result.synth },
+						{ "name", result.name },
+						{ "problem", issue.problem },
+						{ "severity", issue.error ? "error" : "warning" },
+						{ "detail", issue.detail }
+					});
+				}
+				if (result.issues.empty()) report["valid"] = report["valid"].get<int>() + 1;
+				if (result.repaired && !result.dropped) report["repaired"] = report["repaired"].get<int>() + 1;
+				if (result.dropped) report["dropped"] = report["dropped"].get<int>() + 1;
+				if (result.unverified) report["unverified"] = report["unverified"].get<int>() + 1;
+				if (writer && !result.dropped) {
+					writer->RawValue(result.json.c_str(), result.json.size(), rapidjson::kObjectType);
+				}
+			}
+			recordCount += batch.size();
+			batch.clear();
+		};
+
+		RecordCollector collector([&](std::string &&record) {
+			batch.push_back(std::move(record));
+			if (batch.size() >= kBatchSize) {
+				processBatch();
+			}
+		});
+		char readBuffer[65536];
+		rapidjson::FileReadStream inStream(in, readBuffer, sizeof(readBuffer));
+		rapidjson::Reader reader;
+		auto parseResult = reader.Parse(inStream, collector);
+		processBatch();
+		fclose(in);
+
+		if (parseResult.IsError()) {
+			// Typically a truncated file, everything before the error has been checked
+			report["error"] = (boost::format("JSON parse error at offset %d: %s") % parseResult.Offset() % rapidjson::GetParseError_En(parseResult.Code())).str();
+		}
+		if (collector.isVersion0()) {
+			report["version"] = 0;
+		}
+		else {
+			rapidjson::Document header;
+			header.Parse(collector.header().c_str());
+			if (header.HasParseError() || !header.IsObject() || !header.HasMember(kFileFormat) || !header[kFileFormat].IsString() || header[kFileFormat] != kPIF) {
+				report["error"] = "Not a PatchInterchangeFormat file, header missing or wrong FileFormat";
+			}
+			else if (header.HasMember(kVersion) && header[kVersion].IsInt()) {
+				report["version"] = header[kVersion].GetInt();
+			}
+		}
+
+		if (writer) {
+			writer->EndArray();
+			writer->EndObject();
+			outStream->Flush();
+			fclose(out);
+		}
+
+		for (auto const &unknown : unknownSynths) {
+			report["issues"].push_back({
+				{ "synth", unknown.first },
+				{ "problem", "unknown_synth" },
+				{ "severity", "warning" },
+				{ "records", unknown.second },
+				{ "detail", "Synth is not active, patch data not verified" }
+			});
+		}
+		report["records"] = recordCount;
+		report["problems"] = problemCounts;
+		return report;
+	}
+
+}
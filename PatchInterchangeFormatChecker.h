@@ -0,0 +1,40 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "AutomaticCategory.h"
+#include "Synth.h"
+
+#include "nlohmann/json.hpp"
+
+namespace midikraft {
+
+	// Offline integrity check (fsck) of PatchInterchangeFormat archives.
+	//
+	// The file is streamed with a SAX parser, so only one batch of records is in memory at any time. The records of a batch are
+	// verified in parallel:
+	//
+	//   - the mandatory fields are present and have the types load() expects
+	//   - the sysex is valid and complete base64, and decodes into complete sysex messages
+	//   - the active adaptation loads it into exactly one patch
+	//   - the fingerprint survives a round trip through dataFileToSysex and loadSysex
+	//   - all categories and non-categories can be resolved
+	//
+	// The report is JSON with one entry per problem and a count per kind of problem. Records of synths that are not active are not listed
+	// one by one, there is one unknown_synth entry per synth with the number of its records instead. If a repaired filename is given, a new archive is
+	// written alongside: records that can't be loaded are dropped, unresolvable categories and malformed optional fields are removed,
+	// and records of synths that are not active are passed through unchanged, as they can't be verified.
+	class PatchInterchangeFormatChecker {
+	public:
+		static nlohmann::json check(std::map<std::string, std::shared_ptr<Synth>> const &activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector, std::string const &repairedFilename = "");
+		// With the synths from the SynthRegistry
+		static nlohmann::json check(std::string const &filename, std::shared_ptr<AutomaticCategory> detector, std::string const &repairedFilename = "");
+	};
+
+}
@@ -0,0 +1,336 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "PatchMetadataTable.h"
+
+#include "Synth.h"
+#include "Trace.h"
+
+namespace midikraft {
+
+	namespace {
+
+		const char kMagic[4] = { 'K', 'M', 'D', 'T' };
+		const uint32 kVersion = 1;
+		const uint32 kByteOrderMark = 0x01020304;
+
+		template<typename T> void writeRaw(OutputStream &out, T value) {
+			out.write(&value, sizeof(T));
+		}
+
+		template<typename T> void writeColumn(OutputStream &out, std::vector<T> const &column) {
+			if (!column.empty()) {
+				out.write(column.data(), column.size() * sizeof(T));
+			}
+		}
+
+		void writeStrings(OutputStream &out, std::vector<std::string> const &strings) {
+			writeRaw(out, (uint32)strings.size());
+			for (auto const &s : strings) {
+				writeRaw(out, (uint32)s.size());
+				out.write(s.data(), s.size());
+			}
+		}
+
+		class Cursor {
+		public:
+			Cursor(MemoryBlock const &data) : data_(static_cast<const uint8 *>(data.getData())), remaining_(data.getSize()) {}
+
+			bool take(void *destination, size_t bytes) {
+				if (bytes > remaining_) {
+					return false;
+				}
+				if (bytes > 0) {
+					memcpy(destination, data_, bytes);
+				}
+				data_ += bytes;
+				remaining_ -= bytes;
+				return true;
+			}
+
+			template<typename T> bool read(T &outValue) {
+				return take(&outValue, sizeof(T));
+			}
+
+			// Checks the size before allocating, a corrupt row count must not make us allocate gigabytes
+			template<typename T> bool readColumn(std::vector<T> &column, size_t rows) {
+				if (!fits(rows, sizeof(T))) {
+					return false;
+				}
+				size_t previous = column.size();
+				column.resize(previous + rows);
+				return take(column.data() + previous, rows * sizeof(T));
+			}
+
+			bool fits(size_t count, size_t elementSize) const {
+				return elementSize == 0 || count <= remaining_ / elementSize;
+			}
+
+			bool readStrings(std::vector<std::string> &strings) {
+				uint32 count;
+				if (!read(count)) return false;
+				for (uint32 i = 0; i < count; i++) {
+					uint32 length;
+					if (!read(length) || length > remaining_) return false;
+					strings.emplace_back(reinterpret_cast<const char *>(data_), length);
+					data_ += length;
+					remaining_ -= length;
+				}
+				return true;
+			}
+
+		private:
+			const uint8 *data_;
+			size_t remaining_;
+		};
+
+		void appendFingerprint(std::vector<uint8> &column, std::string const &md5) {
+			uint8 bytes[16] = { 0 };
+			if (md5.size() == 32) {
+				for (size_t i = 0; i < 16; i++) {
+					bytes[i] = (uint8)((CharacterFunctions::getHexDigitValue((juce_wchar)md5[2 * i]) << 4) | CharacterFunctions::getHexDigitValue((juce_wchar)md5[2 * i + 1]));
+				}
+			}
+			column.insert(column.end(), bytes, bytes + 16);
+		}
+
+		void decodeSource(std::shared_ptr<SourceInfo> info, PatchMetadataTable::SourceType &outType, int64 &outTimestamp, std::string &outFile) {
+			outType = PatchMetadataTable::SourceType::UNKNOWN;
+			outTimestamp = 0;
+			outFile.clear();
+			if (auto synthSource = std::dynamic_pointer_cast<FromSynthSource>(info)) {
+				outType = PatchMetadataTable::SourceType::SYNTH;
+				outTimestamp = synthSource->timestamp().toMilliseconds();
+			}
+			else if (auto fileSource = std::dynamic_pointer_cast<FromFileSource>(info)) {
+				outType = PatchMetadataTable::SourceType::FILE;
+				outFile = fileSource->filename();
+			}
+			else if (auto bulkSource = std::dynamic_pointer_cast<FromBulkImportSource>(info)) {
+				outType = PatchMetadataTable::SourceType::BULK;
+				outTimestamp = bulkSource->timestamp().toMilliseconds();
+				if (auto individualFile = std::dynamic_pointer_cast<FromFileSource>(bulkSource->individualInfo())) {
+					outFile = individualFile->filename();
+				}
+			}
+		}
+
+	}
+
+	size_t PatchMetadataTable::size() const
+	{
+		return synth.size();
+	}
+
+	std::string const & PatchMetadataTable::string(uint32 id) const
+	{
+		static const std::string empty;
+		return id < strings.size() ? strings[id] : empty;
+	}
+
+	std::string PatchMetadataTable::md5(size_t row) const
+	{
+		return String::toHexString(fingerprint.data() + row * 16, 16, 0).toStdString();
+	}
+
+	bool PatchMetadataTable::hasCategory(size_t row, size_t categoryIndex) const
+	{
+		if (categoryIndex >= categoryWords * 64) {
+			return false;
+		}
+		return (categories[row * categoryWords + categoryIndex / 64] >> (categoryIndex % 64)) & 1;
+	}
+
+	bool PatchMetadataTable::read(File const &file, PatchMetadataTable &outTable)
+	{
+		MIDIKRAFT_TRACE_SCOPE("PatchMetadataTable::read", "io");
+		MemoryBlock data;
+		if (!file.loadFileAsData(data)) {
+			return false;
+		}
+		outTable = PatchMetadataTable();
+		Cursor cursor(data);
+		char magic[4];
+		uint32 version, byteOrder;
+		if (!cursor.take(magic, 4) || memcmp(magic, kMagic, 4) != 0 || !cursor.read(version) || version != kVersion || !cursor.read(byteOrder) || byteOrder != kByteOrderMark) {
+			return false;
+		}
+		while (true) {
+			uint32 rows;
+			if (!cursor.read(rows)) return false;
+			if (rows == 0) {
+				uint64 totalRows;
+				return cursor.read(totalRows) && totalRows == outTable.size();
+			}
+			uint32 words;
+			if (!cursor.readStrings(outTable.strings) || !cursor.readStrings(outTable.categoryNames) || !cursor.read(words)) return false;
+			// Every row needs at least its fixed size columns, and the category bitsets must fit as well, check before allocating
+			const size_t kFixedRowBytes = 4 + 4 + 16 + 1 + 1 + 4 + 4 + 1 + 8 + 4;
+			if (!cursor.fits(rows, kFixedRowBytes) || (words > 0 && !cursor.fits((size_t)rows * words, sizeof(uint64)))
+				|| words > (outTable.categoryNames.size() + 63) / 64) {
+				return false;
+			}
+
+			// The category dictionary only grows, so an earlier group never has more words than a later one
+			if (words > outTable.categoryWords) {
+				std::vector<uint64> widened(outTable.size() * words, 0);
+				for (size_t row = 0; row < outTable.size(); row++) {
+					std::copy_n(outTable.categories.begin() + row * outTable.categoryWords, outTable.categoryWords, widened.begin() + row * words);
+				}
+				outTable.categories.swap(widened);
+				outTable.categoryWords = words;
+			}
+
+			if (!cursor.readColumn(outTable.synth, rows)
+				|| !cursor.readColumn(outTable.name, rows)
+				|| !cursor.readColumn(outTable.fingerprint, (size_t)rows * 16)
+				|| !cursor.readColumn(outTable.favorite, rows)
+				|| !cursor.readColumn(outTable.hidden, rows)) {
+				return false;
+			}
+			std::vector<uint64> groupCategories;
+			if (!cursor.readColumn(groupCategories, (size_t)rows * words)) return false;
+			for (size_t row = 0; row < rows; row++) {
+				outTable.categories.insert(outTable.categories.end(), groupCategories.begin() + row * words, groupCategories.begin() + (row + 1) * words);
+				outTable.categories.insert(outTable.categories.end(), outTable.categoryWords - words, 0);
+			}
+			if (!cursor.readColumn(outTable.bank, rows)
+				|| !cursor.readColumn(outTable.program, rows)
+				|| !cursor.readColumn(outTable.sourceType, rows)
+				|| !cursor.readColumn(outTable.timestamp, rows)
+				|| !cursor.readColumn(outTable.sourceFile, rows)) {
+				return false;
+			}
+		}
+	}
+
+	PatchMetadataWriter::PatchMetadataWriter(File const &file) : totalRows_(0)
+	{
+		if (file.existsAsFile()) {
+			file.deleteFile();
+		}
+		out_ = std::make_unique<FileOutputStream>(file);
+		if (out_->openedOk()) {
+			out_->write(kMagic, 4);
+			writeRaw(*out_, kVersion);
+			writeRaw(*out_, kByteOrderMark);
+		}
+		else {
+			SimpleLogger::instance()->postMessage("ERROR: Can't write metadata table " + file.getFullPathName());
+			out_.reset();
+		}
+	}
+
+	PatchMetadataWriter::~PatchMetadataWriter()
+	{
+		close();
+	}
+
+	bool PatchMetadataWriter::isOpen() const
+	{
+		return out_ != nullptr;
+	}
+
+	uint32 PatchMetadataWriter::stringId(std::string const &s)
+	{
+		auto found = stringIds_.find(s);
+		if (found != stringIds_.end()) {
+			return found->second;
+		}
+		uint32 id = (uint32)stringIds_.size();
+		stringIds_.emplace(s, id);
+		group_.strings.push_back(s);
+		return id;
+	}
+
+	void PatchMetadataWriter::add(PatchHolder const &patch)
+	{
+		if (!out_) {
+			return;
+		}
+		group_.synth.push_back(stringId(patch.synth() ? patch.synth()->getName() : ""));
+		group_.name.push_back(stringId(patch.name()));
+		appendFingerprint(group_.fingerprint, patch.patch() ? patch.md5() : "");
+		group_.favorite.push_back((int8)patch.howFavorite().is());
+		group_.hidden.push_back(patch.isHidden() ? 1 : 0);
+
+		std::vector<uint32> categoryIds;
+		for (auto const &category : patch.categories()) {
+			auto found = categoryIds_.find(category.category());
+			if (found == categoryIds_.end()) {
+				found = categoryIds_.emplace(category.category(), (uint32)categoryIds_.size()).first;
+				group_.categoryNames.push_back(category.category());
+			}
+			categoryIds.push_back(found->second);
+		}
+		rowCategories_.push_back(categoryIds);
+
+		group_.bank.push_back(patch.bankNumber().isValid() ? patch.bankNumber().toZeroBased() : -1);
+		group_.program.push_back(patch.patchNumber().toZeroBased());
+		PatchMetadataTable::SourceType sourceType;
+		int64 timestamp;
+		std::string sourceFile;
+		decodeSource(patch.sourceInfo(), sourceType, timestamp, sourceFile);
+		group_.sourceType.push_back((uint8)sourceType);
+		group_.timestamp.push_back(timestamp);
+		group_.sourceFile.push_back(sourceFile.empty() ? PatchMetadataTable::kNoString : stringId(sourceFile));
+
+		if (group_.size() >= kRowGroupSize) {
+			writeRowGroup();
+		}
+	}
+
+	void PatchMetadataWriter::writeRowGroup()
+	{
+		MIDIKRAFT_TRACE_SCOPE("PatchMetadataWriter::writeRowGroup", "io");
+		size_t rows = group_.size();
+		if (rows == 0) {
+			return;
+		}
+		size_t words = (categoryIds_.size() + 63) / 64;
+		group_.categories.assign(rows * words, 0);
+		for (size_t row = 0; row < rows; row++) {
+			for (auto id : rowCategories_[row]) {
+				group_.categories[row * words + id / 64] |= ((uint64)1) << (id % 64);
+			}
+		}
+
+		writeRaw(*out_, (uint32)rows);
+		writeStrings(*out_, group_.strings);
+		writeStrings(*out_, group_.categoryNames);
+		writeRaw(*out_, (uint32)words);
+		writeColumn(*out_, group_.synth);
+		writeColumn(*out_, group_.name);
+		writeColumn(*out_, group_.fingerprint);
+		writeColumn(*out_, group_.favorite);
+		writeColumn(*out_, group_.hidden);
+		writeColumn(*out_, group_.categories);
+		writeColumn(*out_, group_.bank);
+		writeColumn(*out_, group_.program);
+		writeColumn(*out_, group_.sourceType);
+		writeColumn(*out_, group_.timestamp);
+		writeColumn(*out_, group_.sourceFile);
+
+		totalRows_ += rows;
+		group_ = PatchMetadataTable();
+		rowCategories_.clear();
+	}
+
+	bool PatchMetadataWriter::close()
+	{
+		if (!out_) {
+			return false;
+		}
+		writeRowGroup();
+		writeRaw(*out_, (uint32)0);
+		writeRaw(*out_, totalRows_);
+		out_->flush();
+		bool ok = out_->getStatus().wasOk();
+		out_.reset();
+		return ok;
+	}
+
+}
@@ -0,0 +1,87 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "PatchHolder.h"
+
+#include <unordered_map>
+
+namespace midikraft {
+
+	// Compact columnar file with only the metadata of the patches, for analysis with external tools without parsing PIF and
+	// its sysex.
+	//
+	// Layout, all numbers in the byte order of the writer (little endian on every platform we build for), which is checked on read:
+	//
+	//   "KMDT", uint32 version, uint32 0x01020304 as byte order check
+	//   row groups, each:
+	//     uint32 rows (0 marks the end of the file, followed by uint64 total rows)
+	//     uint32 count, then count times uint32 length + UTF-8 bytes    - strings added to the string dictionary
+	//     uint32 count, then count times uint32 length + UTF-8 bytes    - categories added to the category dictionary
+	//     uint32 words                                                   - uint64 per row in the category bitset column
+	//     columns in the order of the members of PatchMetadataTable, each rows values (rows * 16 bytes for the fingerprint)
+	//
+	// Strings (synth, name, source file) are ids into the string dictionary. Because the dictionaries grow with each row group,
+	// the file can be written while streaming and read sequentially.
+	class PatchMetadataTable {
+	public:
+		enum class SourceType : uint8 { UNKNOWN = 0, SYNTH = 1, FILE = 2, BULK = 3 };
+
+		static const uint32 kNoString = 0xffffffff;
+
+		std::vector<std::string> strings; // Dictionary
+		std::vector<std::string> categoryNames; // Dictionary, position is the bit in the category bitset
+
+		std::vector<uint32> synth;
+		std::vector<uint32> name;
+		std::vector<uint8> fingerprint; // 16 bytes per row, the binary md5
+		std::vector<int8> favorite; // Favorite::TFavorite
+		std::vector<uint8> hidden;
+		size_t categoryWords = 0;
+		std::vector<uint64> categories; // categoryWords per row
+		std::vector<int32> bank; // -1 if unknown
+		std::vector<int32> program;
+		std::vector<uint8> sourceType;
+		std::vector<int64> timestamp; // Milliseconds since epoch of the import, 0 if unknown
+		std::vector<uint32> sourceFile; // File name the patch was imported from, kNoString if none
+
+		size_t size() const;
+		std::string const &string(uint32 id) const; // Empty string for kNoString
+		std::string md5(size_t row) const;
+		bool hasCategory(size_t row, size_t categoryIndex) const;
+
+		// Returns false if the file is missing, not a metadata table or truncated
+		static bool read(File const &file, PatchMetadataTable &outTable);
+	};
+
+	// Streams patches into a PatchMetadataTable file, one row group every kRowGroupSize patches
+	class PatchMetadataWriter {
+	public:
+		explicit PatchMetadataWriter(File const &file);
+		~PatchMetadataWriter();
+
+		bool isOpen() const;
+		void add(PatchHolder const &patch);
+		bool close();
+
+		static const size_t kRowGroupSize = 8192;
+
+	private:
+		uint32 stringId(std::string const &s);
+		void writeRowGroup();
+
+		std::unique_ptr<FileOutputStream> out_;
+		std::unordered_map<std::string, uint32> stringIds_;
+		std::unordered_map<std::string, uint32> categoryIds_;
+		uint64 totalRows_;
+		std::vector<std::vector<uint32>> rowCategories_; // Turned into bitsets when the group is written, the dictionary might still grow
+		PatchMetadataTable group_; // Pending rows, the dictionaries only hold the entries new in this group
+	};
+
+}
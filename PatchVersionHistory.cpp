@@ -0,0 +1,273 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "PatchVersionHistory.h"
+
+#include "Synth.h"
+
+#include <boost/format.hpp>
+
+namespace {
+
+	void writeVarint(std::vector<uint8> &out, size_t value) {
+		do {
+			uint8 byte = (uint8)(value & 0x7f);
+			value >>= 7;
+			if (value != 0) byte |= 0x80;
+			out.push_back(byte);
+		} while (value != 0);
+	}
+
+	bool readVarint(std::vector<uint8> const &in, size_t &pos, size_t &outValue) {
+		outValue = 0;
+		int shift = 0;
+		while (pos < in.size() && shift < 64) {
+			uint8 byte = in[pos++];
+			outValue |= ((size_t)(byte & 0x7f)) << shift;
+			if ((byte & 0x80) == 0) {
+				return true;
+			}
+			shift += 7;
+		}
+		return false;
+	}
+
+	std::shared_ptr<midikraft::FromSynthSource> synthSourceOf(std::shared_ptr<midikraft::SourceInfo> sourceInfo) {
+		auto bulkSource = std::dynamic_pointer_cast<midikraft::FromBulkImportSource>(sourceInfo);
+		if (bulkSource) {
+			// Multi bank downloads wrap the individual synth source
+			return std::dynamic_pointer_cast<midikraft::FromSynthSource>(bulkSource->individualInfo());
+		}
+		return std::dynamic_pointer_cast<midikraft::FromSynthSource>(sourceInfo);
+	}
+
+}
+
+namespace midikraft {
+
+	std::vector<uint8> PatchDelta::create(std::vector<uint8> const &from, std::vector<uint8> const &to)
+	{
+		// Format: target size, then a sequence of (bytes to keep, length of replaced run, replacement bytes)
+		std::vector<uint8> delta;
+		writeVarint(delta, to.size());
+		size_t lastEnd = 0;
+		size_t pos = 0;
+		while (pos < to.size()) {
+			if (pos < from.size() && from[pos] == to[pos]) {
+				pos++;
+				continue;
+			}
+			// Start of a differing run. Extend it, but allow short stretches of equal bytes inside the run to avoid op overhead
+			size_t runStart = pos;
+			size_t runEnd = pos;
+			while (pos < to.size()) {
+				if (pos >= from.size() || from[pos] != to[pos]) {
+					runEnd = ++pos;
+				}
+				else if (pos - runEnd < 3) {
+					pos++;
+				}
+				else {
+					break;
+				}
+			}
+			writeVarint(delta, runStart - lastEnd);
+			writeVarint(delta, runEnd - runStart);
+			std::copy(to.begin() + (ptrdiff_t)runStart, to.begin() + (ptrdiff_t)runEnd, std::back_inserter(delta));
+			lastEnd = runEnd;
+			pos = runEnd;
+		}
+		return delta;
+	}
+
+	bool PatchDelta::apply(std::vector<uint8> const &from, std::vector<uint8> const &delta, std::vector<uint8> &outTo)
+	{
+		size_t pos = 0;
+		size_t targetSize;
+		if (!readVarint(delta, pos, targetSize)) {
+			return false;
+		}
+		outTo.assign(targetSize, 0);
+		std::copy(from.begin(), from.begin() + (ptrdiff_t)std::min(from.size(), targetSize), outTo.begin());
+		size_t write = 0;
+		while (pos < delta.size()) {
+			size_t keep, length;
+			if (!readVarint(delta, pos, keep) || !readVarint(delta, pos, length)) {
+				return false;
+			}
+			write += keep;
+			if (write + length > targetSize || pos + length > delta.size()) {
+				return false;
+			}
+			std::copy(delta.begin() + (ptrdiff_t)pos, delta.begin() + (ptrdiff_t)(pos + length), outTo.begin() + (ptrdiff_t)write);
+			pos += length;
+			write += length;
+		}
+		return true;
+	}
+
+	PatchVersionHistory::PatchVersionHistory() : heldBytes_(0), numberOfVersions_(0), budget_("Patch version history", MemoryAccounting::Kind::SYSEX_PAYLOAD)
+	{
+	}
+
+	std::string PatchVersionHistory::slotKey(PatchHolder const &patch)
+	{
+		auto synthSource = synthSourceOf(patch.sourceInfo());
+		if (!patch.synth() || !patch.patch() || !synthSource || !synthSource->bankNumber().isValid()) {
+			// Without a program place there is no lineage
+			return "";
+		}
+		return (boost::format("%s-%d-%d") % patch.synth()->getName() % synthSource->bankNumber().toZeroBased() % patch.patchNumber().toZeroBased()).str();
+	}
+
+	bool PatchVersionHistory::belongsToChain(Chain const &chain, PatchHolder const &patch, std::vector<uint8> const &data) const
+	{
+		jassert(!chain.versions.empty());
+		if (chain.versions.back().info.name == patch.name()) {
+			return true;
+		}
+		// Renamed on the synth? Then it still is the same patch if only a small part of the bytes changed
+		if (chain.head.size() != data.size()) {
+			return false;
+		}
+		return PatchDelta::create(chain.head, data).size() < data.size() / 4;
+	}
+
+	std::string PatchVersionHistory::addVersion(PatchHolder const &patch)
+	{
+		std::string slot = slotKey(patch);
+		if (slot.empty()) {
+			return "";
+		}
+
+		auto data = patch.patch()->data();
+		auto fingerprint = patch.md5();
+		auto synthSource = synthSourceOf(patch.sourceInfo());
+		Time timestamp = synthSource->timestamp().toMilliseconds() != 0 ? synthSource->timestamp() : Time::getCurrentTime();
+
+		std::lock_guard<std::mutex> lock(lock_);
+		auto &chains = chainsPerSlot_[slot];
+		Chain *chain = nullptr;
+		for (auto &candidate : chains) {
+			if (belongsToChain(candidate, patch, data)) {
+				chain = &candidate;
+				break;
+			}
+		}
+		if (!chain) {
+			// A different patch has been stored in this program place, start a new lineage
+			Chain newChain;
+			newChain.lineageId = (boost::format("%s#%d") % slot % chains.size()).str();
+			chains.push_back(newChain);
+			chain = &chains.back();
+		}
+		else if (chain->versions.back().info.fingerprint == fingerprint) {
+			// Identical download, nothing changed
+			return chain->lineageId;
+		}
+
+		Version version;
+		version.info = { timestamp, patch.name(), fingerprint, 0 };
+		version.isKeyframe = chain->versions.size() % kKeyframeInterval == 0;
+		version.bytes = version.isKeyframe ? data : PatchDelta::create(chain->head, data);
+		version.info.storedBytes = version.bytes.size();
+		heldBytes_ += (int64)version.bytes.size() + (int64)data.size() - (int64)chain->head.size();
+		numberOfVersions_++;
+		chain->versions.push_back(version);
+		chain->head = data;
+		// Safe under our lock, the budget never evicts from us
+		budget_.setBytes(heldBytes_, numberOfVersions_);
+		return chain->lineageId;
+	}
+
+	std::vector<std::string> PatchVersionHistory::lineages() const
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		std::vector<std::string> result;
+		for (auto const &slot : chainsPerSlot_) {
+			for (auto const &chain : slot.second) {
+				result.push_back(chain.lineageId);
+			}
+		}
+		return result;
+	}
+
+	std::vector<std::string> PatchVersionHistory::lineagesForPatch(PatchHolder const &patch) const
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		std::vector<std::string> result;
+		auto slot = chainsPerSlot_.find(slotKey(patch));
+		if (slot != chainsPerSlot_.end()) {
+			for (auto const &chain : slot->second) {
+				result.push_back(chain.lineageId);
+			}
+		}
+		return result;
+	}
+
+	PatchVersionHistory::Chain const *PatchVersionHistory::findChain(std::string const &lineageId) const
+	{
+		auto slot = chainsPerSlot_.find(lineageId.substr(0, lineageId.rfind('#')));
+		if (slot != chainsPerSlot_.end()) {
+			for (auto const &chain : slot->second) {
+				if (chain.lineageId == lineageId) {
+					return &chain;
+				}
+			}
+		}
+		return nullptr;
+	}
+
+	std::vector<PatchVersionHistory::VersionInfo> PatchVersionHistory::versions(std::string const &lineageId) const
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		std::vector<VersionInfo> result;
+		auto chain = findChain(lineageId);
+		if (chain) {
+			for (auto const &version : chain->versions) {
+				result.push_back(version.info);
+			}
+		}
+		return result;
+	}
+
+	bool PatchVersionHistory::reconstruct(std::string const &lineageId, size_t versionIndex, std::vector<uint8> &outData) const
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		auto chain = findChain(lineageId);
+		if (!chain || versionIndex >= chain->versions.size()) {
+			return false;
+		}
+		// Start at the last keyframe at or before the requested version, and roll forward
+		size_t start = versionIndex - versionIndex % kKeyframeInterval;
+		jassert(chain->versions[start].isKeyframe);
+		outData = chain->versions[start].bytes;
+		std::vector<uint8> next;
+		for (size_t i = start + 1; i <= versionIndex; i++) {
+			if (!PatchDelta::apply(outData, chain->versions[i].bytes, next)) {
+				SimpleLogger::instance()->postMessage((boost::format("Program error: Corrupt delta in version %d of patch history %s") % i % lineageId).str());
+				return false;
+			}
+			outData.swap(next);
+		}
+		return true;
+	}
+
+	size_t PatchVersionHistory::storedBytes() const
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		size_t result = 0;
+		for (auto const &slot : chainsPerSlot_) {
+			for (auto const &chain : slot.second) {
+				for (auto const &version : chain.versions) {
+					result += version.bytes.size();
+				}
+			}
+		}
+		return result;
+	}
+
+}
@@ -0,0 +1,79 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "PatchHolder.h"
+#include "MemoryBudget.h"
+
+#include <map>
+#include <mutex>
+
+namespace midikraft {
+
+	// Byte level delta between two sysex data blocks. As most synths use a fixed layout for their patch data, the delta
+	// only records the runs of bytes that differ at the same position, plus the size of the target.
+	class PatchDelta {
+	public:
+		static std::vector<uint8> create(std::vector<uint8> const &from, std::vector<uint8> const &to);
+		static bool apply(std::vector<uint8> const &from, std::vector<uint8> const &delta, std::vector<uint8> &outTo);
+	};
+
+	// Optional version chain for patches that were downloaded from the same program slot of a synth again and again.
+	// Only the first version of a chain (and every kKeyframeInterval-th version) is stored in full, all others as a PatchDelta
+	// against their predecessor.
+	class PatchVersionHistory {
+	public:
+		PatchVersionHistory();
+
+		struct VersionInfo {
+			Time timestamp;
+			std::string name;
+			std::string fingerprint;
+			size_t storedBytes;
+		};
+
+		// Records the patch as a new version. Returns the lineage ID of the chain it was added to, or an empty string
+		// if the patch has no known program slot (e.g. file imports or edit buffer downloads)
+		std::string addVersion(PatchHolder const &patch);
+
+		std::vector<std::string> lineages() const;
+		std::vector<std::string> lineagesForPatch(PatchHolder const &patch) const;
+		std::vector<VersionInfo> versions(std::string const &lineageId) const;
+		bool reconstruct(std::string const &lineageId, size_t versionIndex, std::vector<uint8> &outData) const;
+
+		size_t storedBytes() const;
+
+	private:
+		struct Version {
+			VersionInfo info;
+			bool isKeyframe;
+			std::vector<uint8> bytes; // Either full data or the delta to the predecessor
+		};
+
+		struct Chain {
+			std::string lineageId;
+			std::vector<Version> versions;
+			std::vector<uint8> head; // Full data of the latest version, needed to create the next delta
+		};
+
+		static std::string slotKey(PatchHolder const &patch);
+		bool belongsToChain(Chain const &chain, PatchHolder const &patch, std::vector<uint8> const &data) const;
+		Chain const *findChain(std::string const &lineageId) const;
+
+		static const size_t kKeyframeInterval = 32;
+
+		mutable std::mutex lock_;
+		std::map<std::string, std::vector<Chain>> chainsPerSlot_;
+		int64 heldBytes_; // Versions and heads of all chains
+		int64 numberOfVersions_;
+		// The versions are the only copy of the history, so they count against the memory budget but are never evicted
+		BudgetedAllocation budget_;
+	};
+
+}
@@ -0,0 +1,251 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "PipelinedDataDownload.h"
+
+#include "Synth.h"
+#include "Trace.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+
+namespace midikraft {
+
+	const int kTimeoutPollMilliseconds = 50;
+
+	PipelinedDataDownload::PipelinedDataDownload(std::shared_ptr<SafeMidiOutput> midiOutput, DataFileLoadCapability *sequencer, int dataFileIdentifier, Options const &options, ProgressHandler *progressHandler) :
+		midiOutput_(midiOutput), sequencer_(sequencer), dataFileIdentifier_(dataFileIdentifier), options_(options), progressHandler_(progressHandler), nextRequest_(0), received_(0), retriesSent_(0), finished_(false)
+	{
+		options_.window = std::max(1, options_.window);
+		options_.retries = std::max(0, options_.retries);
+		if (!options_.itemIndex && options_.retries > 0) {
+			// Matching by order can't tell a late answer to the first request from the answer to the retry, which would assign the
+			// data to the wrong item. Without itemIndex an item that does not answer in time fails the download instead.
+			options_.retries = 0;
+		}
+		items_.resize((size_t)std::max(0, sequencer->numberOfDataItemsPerType(dataFileIdentifier)));
+	}
+
+	PipelinedDataDownload::~PipelinedDataDownload()
+	{
+		stopTimer();
+	}
+
+	void PipelinedDataDownload::setFinishedHandler(TFinishedHandler onFinished)
+	{
+		onFinished_ = onFinished;
+	}
+
+	void PipelinedDataDownload::start()
+	{
+		{
+			ScopedLock lock(lock_);
+			if (!items_.empty()) {
+				fillWindow();
+				startTimer(kTimeoutPollMilliseconds);
+				return;
+			}
+		}
+		finish(Result::SUCCESS);
+	}
+
+	void PipelinedDataDownload::handleMessage(MidiMessage const &message)
+	{
+		if (!sequencer_->isDataFile(message, dataFileIdentifier_)) {
+			return;
+		}
+		MIDIKRAFT_TRACE_SCOPE("PipelinedDataDownload::handleMessage", "download");
+		int itemNo;
+		bool complete;
+		{
+			ScopedLock lock(lock_);
+			if (finished_) {
+				return;
+			}
+			itemNo = matchResponse(message);
+			if (itemNo < 0) {
+				SimpleLogger::instance()->postMessage("Ignoring data item that does not answer an outstanding request");
+				return;
+			}
+			auto &item = items_[(size_t)itemNo];
+			item.state = Item::State::DONE;
+			item.response = message;
+			received_++;
+			complete = received_ == (int)items_.size();
+			if (!complete) {
+				fillWindow();
+			}
+		}
+
+		if (options_.onItemLoaded) {
+			// Parse outside of the lock, the item is DONE and won't be touched by anybody else anymore
+			auto &item = items_[(size_t)itemNo];
+			item.loaded = sequencer_->loadData({ message }, dataFileIdentifier_);
+			options_.onItemLoaded(itemNo, item.loaded);
+		}
+		if (complete) {
+			finish(Result::SUCCESS);
+		}
+		else if (progressHandler_) {
+			if (progressHandler_->shouldAbort()) {
+				finish(Result::CANCELLED);
+			}
+			else {
+				progressHandler_->setProgressPercentage(received_ / (double)items_.size());
+			}
+		}
+	}
+
+	void PipelinedDataDownload::cancel()
+	{
+		ScopedLock lock(lock_);
+		finished_ = true;
+		stopTimer();
+	}
+
+	int PipelinedDataDownload::numberOfItems() const
+	{
+		return (int)items_.size();
+	}
+
+	int PipelinedDataDownload::numberOfRetries() const
+	{
+		return retriesSent_;
+	}
+
+	void PipelinedDataDownload::timerCallback()
+	{
+		// Keep this alive until the callback is done, finish() might drop the owner's reference
+		auto self = weak_from_this().lock();
+		if (!self) {
+			return;
+		}
+		bool timedOut = false;
+		{
+			ScopedLock lock(lock_);
+			if (finished_) {
+				return;
+			}
+			double now = Time::getMillisecondCounterHiRes();
+			// Copy, as request() reorders the outstanding queue
+			std::vector<int> expired;
+			for (int itemNo : outstanding_) {
+				if (items_[(size_t)itemNo].deadline <= now) {
+					expired.push_back(itemNo);
+				}
+			}
+			for (int itemNo : expired) {
+				if (items_[(size_t)itemNo].attempts > options_.retries) {
+					SimpleLogger::instance()->postMessage((boost::format("Data item %d did not answer after %d requests, aborting download") % itemNo % items_[(size_t)itemNo].attempts).str());
+					timedOut = true;
+					break;
+				}
+				retriesSent_++;
+				request(itemNo);
+			}
+		}
+		if (timedOut) {
+			finish(Result::TIMED_OUT);
+		}
+		else if (progressHandler_ && progressHandler_->shouldAbort()) {
+			finish(Result::CANCELLED);
+		}
+	}
+
+	void PipelinedDataDownload::fillWindow()
+	{
+		while ((int)outstanding_.size() < options_.window && nextRequest_ < (int)items_.size()) {
+			request(nextRequest_++);
+		}
+	}
+
+	void PipelinedDataDownload::request(int itemNo)
+	{
+		auto &item = items_[(size_t)itemNo];
+		item.state = Item::State::REQUESTED;
+		item.attempts++;
+		item.deadline = Time::getMillisecondCounterHiRes() + options_.timeoutMilliseconds;
+		auto found = std::find(outstanding_.begin(), outstanding_.end(), itemNo);
+		if (found != outstanding_.end()) {
+			outstanding_.erase(found);
+		}
+		outstanding_.push_back(itemNo);
+
+		std::vector<MidiMessage> request = sequencer_->requestDataItem(itemNo, dataFileIdentifier_);
+		if (options_.recorder) {
+			options_.recorder->recordSent(request);
+		}
+		// If this is a synth, it has a throttled send method
+		auto synth = dynamic_cast<Synth *>(sequencer_);
+		if (options_.replay) {
+			options_.replay->requestSent(request);
+		}
+		else if (synth) {
+			synth->sendBlockOfMessagesToSynth(midiOutput_->name(), request);
+		}
+		else {
+			midiOutput_->sendBlockOfMessagesFullSpeed(request);
+		}
+	}
+
+	int PipelinedDataDownload::matchResponse(MidiMessage const &message)
+	{
+		int itemNo = -1;
+		if (options_.itemIndex) {
+			itemNo = options_.itemIndex(message);
+		}
+		else if (!outstanding_.empty()) {
+			// In order device, the answer belongs to the oldest request
+			itemNo = outstanding_.front();
+		}
+		if (itemNo < 0 || itemNo >= (int)items_.size() || items_[(size_t)itemNo].state != Item::State::REQUESTED) {
+			// Late answer to a request that was repeated, or garbage
+			return -1;
+		}
+		outstanding_.erase(std::find(outstanding_.begin(), outstanding_.end(), itemNo));
+		return itemNo;
+	}
+
+	void PipelinedDataDownload::finish(Result result)
+	{
+		// The finished handler usually ends the owner's reference to this download
+		auto self = shared_from_this();
+		std::vector<std::shared_ptr<DataFile>> loadedData;
+		{
+			ScopedLock lock(lock_);
+			if (finished_) {
+				return;
+			}
+			finished_ = true;
+			stopTimer();
+			if (result == Result::SUCCESS) {
+				if (options_.onItemLoaded) {
+					for (auto const &item : items_) {
+						loadedData.insert(loadedData.end(), item.loaded.begin(), item.loaded.end());
+					}
+				}
+				else {
+					std::vector<MidiMessage> responses;
+					responses.reserve(items_.size());
+					for (auto const &item : items_) {
+						responses.push_back(item.response);
+					}
+					loadedData = sequencer_->loadData(responses, dataFileIdentifier_);
+				}
+			}
+		}
+		if (onFinished_) {
+			onFinished_(result, loadedData);
+		}
+		if (!MessageManager::getInstance()->isThisTheMessageThread()) {
+			// When called from handleMessage, self might be the last reference. The destructor stops the timer, which must happen on
+			// the message thread, where a timerCallback may be waiting for the lock right now
+			MessageManager::callAsync([self]() {});
+		}
+	}
+
+}
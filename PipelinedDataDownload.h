@@ -0,0 +1,96 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "DataFileLoadCapability.h"
+#include "MidiController.h"
+#include "ProgressHandler.h"
+#include "MidiSessionRecorder.h"
+
+#include <deque>
+
+namespace midikraft {
+
+	// Downloads all data items of one type from a sequencer with several requests in flight at the same time.
+	//
+	// Instead of waiting for each answer before sending the next request, a window of requests is kept outstanding. Answers are
+	// matched to their request either by the itemIndex function of the options, or in the order the requests were sent if the device
+	// answers strictly in order. Every outstanding item has its own timeout and is requested again a few times before the whole
+	// download gives up.
+	//
+	// Messages arrive on the MIDI thread, the timeouts are checked on the message thread, so all state is guarded by a lock and the
+	// handlers are called without holding it.
+	class PipelinedDataDownload : private Timer, public std::enable_shared_from_this<PipelinedDataDownload> {
+	public:
+		enum class Result { SUCCESS, CANCELLED, TIMED_OUT };
+
+		typedef std::function<void(int itemNo, std::vector<std::shared_ptr<DataFile>> const &)> TItemHandler;
+		typedef std::function<void(Result, std::vector<std::shared_ptr<DataFile>>)> TFinishedHandler;
+
+		struct Options {
+			int window = 8; // Requests in flight, 1 gives the classic one by one download
+			int timeoutMilliseconds = 1000; // Per item, counted from the (last) request
+			int retries = 2; // Additional requests for an item that did not answer in time
+			// Maps an answer to the number of the item it contains, -1 if that can't be determined. If not set, answers are assumed to
+			// come in the order of the requests, and retries are disabled as a late answer could not be told apart.
+			std::function<int(MidiMessage const &)> itemIndex;
+			// If set, each item is parsed with loadData as soon as it has arrived, and the final result is the concatenation of the items
+			TItemHandler onItemLoaded;
+			// If set, all requests are written to the session recording
+			std::shared_ptr<MidiSessionRecorder> recorder;
+			// If set, the requests are handed to the replay instead of being sent to the device
+			std::shared_ptr<MidiSessionReplay> replay;
+		};
+
+		PipelinedDataDownload(std::shared_ptr<SafeMidiOutput> midiOutput, DataFileLoadCapability *sequencer, int dataFileIdentifier, Options const &options, ProgressHandler *progressHandler);
+		virtual ~PipelinedDataDownload() override;
+
+		void setFinishedHandler(TFinishedHandler onFinished);
+
+		void start();
+		void handleMessage(MidiMessage const &message);
+		void cancel(); // Stops without calling the finished handler
+
+		int numberOfItems() const;
+		int numberOfRetries() const;
+
+	private:
+		struct Item {
+			enum class State { WAITING, REQUESTED, DONE };
+			State state = State::WAITING;
+			int attempts = 0;
+			double deadline = 0.0;
+			MidiMessage response;
+			std::vector<std::shared_ptr<DataFile>> loaded;
+		};
+
+		void timerCallback() override;
+
+		void fillWindow();
+		void request(int itemNo);
+		int matchResponse(MidiMessage const &message);
+		void finish(Result result);
+
+		std::shared_ptr<SafeMidiOutput> midiOutput_;
+		DataFileLoadCapability *sequencer_;
+		int dataFileIdentifier_;
+		Options options_;
+		ProgressHandler *progressHandler_;
+		TFinishedHandler onFinished_;
+
+		CriticalSection lock_;
+		std::vector<Item> items_;
+		std::deque<int> outstanding_; // Item numbers in the order of their last request
+		int nextRequest_;
+		int received_;
+		int retriesSent_;
+		bool finished_;
+	};
+
+}
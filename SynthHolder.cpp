@@ -21,12 +21,21 @@ namespace midikraft {
 
 	SynthHolder::SynthHolder(std::shared_ptr<SimpleDiscoverableDevice> synth, Colour const &color) : device_(synth)
 	{
+		resolveTypes();
 		// Override the constructor color with the one from the settings file, if set
 		color_ = Colour::fromString(Settings::instance().get(colorSynthKey(synth), color.toString().toStdString()));
 	}
 
 	SynthHolder::SynthHolder(std::shared_ptr<SoundExpanderCapability> synth) : device_(synth)
 	{
+		resolveTypes();
+	}
+
+	void SynthHolder::resolveTypes()
+	{
+		synth_ = std::dynamic_pointer_cast<Synth>(device_);
+		discoverable_ = std::dynamic_pointer_cast<SimpleDiscoverableDevice>(device_);
+		soundExpander_ = Capability::hasCapability<SoundExpanderCapability>(device_);
 	}
 
 	void SynthHolder::setColor(Colour const &newColor)
@@ -45,9 +54,9 @@ namespace midikraft {
 		return "invalid";
 	}
 
-	std::shared_ptr<Synth> SynthHolder::findSynth(std::vector<SynthHolder> &synths, std::string const &synthName)
+	std::shared_ptr<Synth> SynthHolder::findSynth(std::vector<SynthHolder> const &synths, std::string const &synthName)
 	{
-		for (auto synth : synths) {
+		for (auto const &synth : synths) {
 			if (synth.synth() && synth.synth()->getName() == synthName) {
 				return synth.synth();
 			}
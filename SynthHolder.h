@@ -20,18 +20,24 @@ namespace midikraft {
 		SynthHolder(std::shared_ptr<SoundExpanderCapability> synth);
 		virtual ~SynthHolder() = default;
 
-		std::shared_ptr<Synth> synth() { return std::dynamic_pointer_cast<Synth>(device_); }
-		std::shared_ptr<SimpleDiscoverableDevice> device() { return std::dynamic_pointer_cast<SimpleDiscoverableDevice>(device_); }
-		std::shared_ptr<SoundExpanderCapability> soundExpander() { return Capability::hasCapability<SoundExpanderCapability>(device_); }
-		Colour color() { return color_; }
+		// The typed pointers are resolved once in the constructor, so the accessors are cheap enough for per patch lookups
+		std::shared_ptr<Synth> synth() const { return synth_; }
+		std::shared_ptr<SimpleDiscoverableDevice> device() const { return discoverable_; }
+		std::shared_ptr<SoundExpanderCapability> soundExpander() const { return soundExpander_; }
+		Colour color() const { return color_; }
 		void setColor(Colour const &newColor);
 
 		std::string getName() const;
 
-		static std::shared_ptr<Synth> findSynth(std::vector<SynthHolder> &synths, std::string const &synthName);
+		static std::shared_ptr<Synth> findSynth(std::vector<SynthHolder> const &synths, std::string const &synthName);
 
 	private:
+		void resolveTypes();
+
 		std::shared_ptr<NamedDeviceCapability> device_;
+		std::shared_ptr<Synth> synth_;
+		std::shared_ptr<SimpleDiscoverableDevice> discoverable_;
+		std::shared_ptr<SoundExpanderCapability> soundExpander_;
 		Colour color_;
 	};
 
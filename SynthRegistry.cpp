@@ -0,0 +1,119 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "SynthRegistry.h"
+
+namespace midikraft {
+
+	SynthRegistry &SynthRegistry::instance()
+	{
+		static SynthRegistry instance_;
+		return instance_;
+	}
+
+	SynthRegistry::SynthRegistry() : index_(std::make_shared<const Index>())
+	{
+	}
+
+	void SynthRegistry::setSynths(std::vector<SynthHolder> const &synths)
+	{
+		auto index = std::make_shared<Index>();
+		index->reserve(synths.size());
+		for (auto const &synth : synths) {
+			index->emplace(synth.getName(), synth);
+		}
+		std::lock_guard<std::mutex> lock(writeLock_);
+		publish(index);
+	}
+
+	void SynthRegistry::add(SynthHolder const &synth)
+	{
+		add(std::vector<SynthHolder>{ synth });
+	}
+
+	void SynthRegistry::add(std::vector<SynthHolder> const &synths)
+	{
+		std::lock_guard<std::mutex> lock(writeLock_);
+		auto index = std::make_shared<Index>(*snapshot());
+		for (auto const &synth : synths) {
+			index->erase(synth.getName());
+			index->emplace(synth.getName(), synth);
+		}
+		publish(index);
+	}
+
+	void SynthRegistry::clear()
+	{
+		std::lock_guard<std::mutex> lock(writeLock_);
+		publish(std::make_shared<const Index>());
+	}
+
+	void SynthRegistry::publish(std::shared_ptr<const Index> index)
+	{
+#if defined(__cpp_lib_atomic_shared_ptr)
+		index_.store(index);
+#else
+		std::atomic_store(&index_, index);
+#endif
+	}
+
+	std::shared_ptr<const SynthRegistry::Index> SynthRegistry::snapshot() const
+	{
+#if defined(__cpp_lib_atomic_shared_ptr)
+		return index_.load();
+#else
+		return std::atomic_load(&index_);
+#endif
+	}
+
+	size_t SynthRegistry::size() const
+	{
+		return snapshot()->size();
+	}
+
+	SynthHolder SynthRegistry::find(std::string const &name) const
+	{
+		auto index = snapshot();
+		auto found = index->find(name);
+		if (found != index->end()) {
+			return found->second;
+		}
+		return SynthHolder(std::shared_ptr<SoundExpanderCapability>());
+	}
+
+	std::shared_ptr<Synth> SynthRegistry::findSynth(std::string const &name) const
+	{
+		auto index = snapshot();
+		auto found = index->find(name);
+		return found != index->end() ? found->second.synth() : nullptr;
+	}
+
+	std::shared_ptr<SimpleDiscoverableDevice> SynthRegistry::findDevice(std::string const &name) const
+	{
+		auto index = snapshot();
+		auto found = index->find(name);
+		return found != index->end() ? found->second.device() : nullptr;
+	}
+
+	std::shared_ptr<SoundExpanderCapability> SynthRegistry::findSoundExpander(std::string const &name) const
+	{
+		auto index = snapshot();
+		auto found = index->find(name);
+		return found != index->end() ? found->second.soundExpander() : nullptr;
+	}
+
+	std::map<std::string, std::shared_ptr<Synth>> SynthRegistry::synthMap() const
+	{
+		std::map<std::string, std::shared_ptr<Synth>> result;
+		for (auto const &entry : *snapshot()) {
+			if (entry.second.synth()) {
+				result.emplace(entry.first, entry.second.synth());
+			}
+		}
+		return result;
+	}
+
+}
@@ -0,0 +1,66 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "SynthHolder.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace midikraft {
+
+	// Index of all loaded synths and sound expanders by name.
+	//
+	// Every Librarian adds the synths it is constructed with, replacing entries of the same name. Only setSynths and clear remove
+	// synths. Writers (the UI thread when the list of synths changes) build a new index and publish it with one atomic store,
+	// readers only do an atomic load of the current index and then a hash lookup.
+	// Background threads therefore never wait for a writer building an index. The atomic shared_ptr is not necessarily lock-free
+	// (libstdc++ guards the pre C++20 functions with a small internal spinlock), but it is held only for the pointer copy.
+	// A reader keeps the index it loaded alive, so a concurrent update never invalidates its pointers.
+	class SynthRegistry {
+	public:
+		typedef std::unordered_map<std::string, SynthHolder> Index;
+
+		static SynthRegistry &instance();
+
+		// Replaces the registered synths, e.g. when the list of adaptations was (re)loaded
+		void setSynths(std::vector<SynthHolder> const &synths);
+		void add(SynthHolder const &synth);
+		void add(std::vector<SynthHolder> const &synths);
+		void clear();
+
+		std::shared_ptr<const Index> snapshot() const;
+		size_t size() const;
+
+		// Returns a holder with a null device if the name is not known
+		SynthHolder find(std::string const &name) const;
+		std::shared_ptr<Synth> findSynth(std::string const &name) const;
+		std::shared_ptr<SimpleDiscoverableDevice> findDevice(std::string const &name) const;
+		std::shared_ptr<SoundExpanderCapability> findSoundExpander(std::string const &name) const;
+
+		// All registered synths by name, in the form PatchInterchangeFormat::load takes them
+		std::map<std::string, std::shared_ptr<Synth>> synthMap() const;
+
+	private:
+		SynthRegistry();
+
+		void publish(std::shared_ptr<const Index> index);
+
+#if defined(__cpp_lib_atomic_shared_ptr)
+		std::atomic<std::shared_ptr<const Index>> index_;
+#else
+		std::shared_ptr<const Index> index_; // Only accessed with std::atomic_load and std::atomic_store
+#endif
+		std::mutex writeLock_; // Serializes the writers, so no update gets lost between their load and store
+	};
+
+}
@@ -0,0 +1,201 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "SysexSpan.h"
+
+#include <algorithm>
+#include <array>
+
+namespace midikraft {
+
+	SysexSpan::SysexSpan() : offset_(0), length_(0)
+	{
+	}
+
+	SysexSpan::SysexSpan(std::shared_ptr<const std::vector<uint8>> buffer) : buffer_(buffer), offset_(0), length_(buffer ? buffer->size() : 0)
+	{
+	}
+
+	SysexSpan::SysexSpan(std::shared_ptr<const std::vector<uint8>> buffer, size_t offset, size_t length) : buffer_(buffer), offset_(offset), length_(length)
+	{
+		jassert(!buffer_ || offset_ + length_ <= buffer_->size());
+	}
+
+	SysexSpan SysexSpan::fromVector(std::vector<uint8> &&data)
+	{
+		return SysexSpan(std::make_shared<const std::vector<uint8>>(std::move(data)));
+	}
+
+	SysexSpan SysexSpan::fromFile(File const &file)
+	{
+		FileInputStream in(file);
+		if (!in.openedOk()) {
+			return SysexSpan();
+		}
+		std::vector<uint8> data((size_t)in.getTotalLength());
+		if (!data.empty()) {
+			data.resize((size_t)in.read(data.data(), (int)data.size())); // 2 GB Limit
+		}
+		return fromVector(std::move(data));
+	}
+
+	bool SysexSpan::fromBase64(const char *base64, size_t length, SysexSpan &outSpan)
+	{
+		static const std::array<int8, 256> kDecode = []() {
+			std::array<int8, 256> table;
+			table.fill(-1);
+			const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+			for (int i = 0; i < 64; i++) {
+				table[(uint8)alphabet[i]] = (int8)i;
+			}
+			return table;
+		}();
+
+		if (!isCompleteBase64(base64, length)) {
+			return false;
+		}
+		std::vector<uint8> data;
+		data.reserve(length / 4 * 3);
+		uint32 accumulator = 0;
+		int bits = 0;
+		for (size_t i = 0; i < length; i++) {
+			char c = base64[i];
+			if (c == '=') break; // Only padding can follow
+			if (c == '\n' || c == '\r' || c == ' ') continue;
+			int8 value = kDecode[(uint8)c];
+			if (value < 0) {
+				return false;
+			}
+			accumulator = (accumulator << 6) | (uint32)value;
+			bits += 6;
+			if (bits >= 8) {
+				bits -= 8;
+				data.push_back((uint8)(accumulator >> bits));
+			}
+		}
+		outSpan = fromVector(std::move(data));
+		return true;
+	}
+
+	bool SysexSpan::isCompleteBase64(const char *base64, size_t length)
+	{
+		size_t characters = 0;
+		size_t padding = 0;
+		for (size_t i = 0; i < length; i++) {
+			char c = base64[i];
+			if (c == '\n' || c == '\r' || c == ' ') continue;
+			if (c == '=') {
+				padding++;
+				continue;
+			}
+			bool valid = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '+' || c == '/';
+			if (!valid || padding > 0) {
+				// Invalid character, or data after the padding
+				return false;
+			}
+			characters++;
+		}
+		if (padding > 2 || characters % 4 == 1) {
+			return false;
+		}
+		return padding == 0 || (characters + padding) % 4 == 0;
+	}
+
+	uint8 const *SysexSpan::data() const
+	{
+		return buffer_ ? buffer_->data() + offset_ : nullptr;
+	}
+
+	size_t SysexSpan::size() const
+	{
+		return length_;
+	}
+
+	bool SysexSpan::empty() const
+	{
+		return length_ == 0;
+	}
+
+	long SysexSpan::useCount() const
+	{
+		return buffer_.use_count();
+	}
+
+	SysexSpan SysexSpan::subspan(size_t offset, size_t length) const
+	{
+		jassert(offset + length <= length_);
+		return SysexSpan(buffer_, offset_ + offset, length);
+	}
+
+	std::vector<SysexSpan> SysexSpan::messages() const
+	{
+		std::vector<SysexSpan> result;
+		auto bytes = data();
+		uint8 runningStatus = 0;
+		size_t i = 0;
+		while (i < length_) {
+			uint8 first = bytes[i];
+			if (first == 0xf0) {
+				size_t end = i + 1;
+				while (end < length_ && bytes[end] < 0x80) {
+					end++;
+				}
+				if (end < length_ && bytes[end] == 0xf7) {
+					end++;
+				}
+				result.push_back(subspan(i, end - i));
+				runningStatus = 0;
+				i = end;
+			}
+			else if (first >= 0x80) {
+				size_t length = std::min((size_t)MidiMessage::getMessageLengthFromFirstByte(first), length_ - i);
+				result.push_back(subspan(i, length));
+				if (first < 0xf0) {
+					runningStatus = first;
+				}
+				else if (first < 0xf8) {
+					// System common messages cancel the running status, realtime messages don't
+					runningStatus = 0;
+				}
+				i += length;
+			}
+			else if (runningStatus != 0) {
+				// The only case where the message is not a view into the buffer, it needs the status byte in front
+				size_t dataBytes = std::min((size_t)MidiMessage::getMessageLengthFromFirstByte(runningStatus) - 1, length_ - i);
+				std::vector<uint8> message(1, runningStatus);
+				message.insert(message.end(), bytes + i, bytes + i + dataBytes);
+				result.push_back(fromVector(std::move(message)));
+				i += dataBytes;
+			}
+			else {
+				// Data byte without any status to belong to
+				i++;
+			}
+		}
+		return result;
+	}
+
+	std::vector<uint8> SysexSpan::copy() const
+	{
+		return std::vector<uint8>(data(), data() + length_);
+	}
+
+	MidiMessage SysexSpan::toMidiMessage() const
+	{
+		return MidiMessage(data(), (int)length_);
+	}
+
+	std::vector<MidiMessage> SysexSpan::toMidiMessages(std::vector<SysexSpan> const &spans)
+	{
+		std::vector<MidiMessage> result;
+		result.reserve(spans.size());
+		for (auto const &span : spans) {
+			result.push_back(span.toMidiMessage());
+		}
+		return result;
+	}
+
+}
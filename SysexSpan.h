@@ -0,0 +1,52 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+namespace midikraft {
+
+	// Non-owning view into a shared, immutable byte buffer holding sysex data.
+	//
+	// The buffer is filled once (from a file, base64, or received MIDI) and then split into one span per message without copying.
+	// Copies only happen when a mutable vector is asked for, and at the API boundary to Synth::loadSysex, which takes MidiMessages.
+	class SysexSpan {
+	public:
+		SysexSpan();
+		SysexSpan(std::shared_ptr<const std::vector<uint8>> buffer);
+		SysexSpan(std::shared_ptr<const std::vector<uint8>> buffer, size_t offset, size_t length);
+
+		static SysexSpan fromVector(std::vector<uint8> &&data);
+		static SysexSpan fromFile(File const &file);
+		// Decodes directly into the shared buffer, returns false if the input is not valid base64 (see isCompleteBase64)
+		static bool fromBase64(const char *base64, size_t length, SysexSpan &outSpan);
+		// Only the base64 alphabet and whitespace, at most two padding characters at the very end and no incomplete group
+		static bool isCompleteBase64(const char *base64, size_t length);
+
+		uint8 const *data() const;
+		size_t size() const;
+		bool empty() const;
+		long useCount() const; // Number of spans sharing the buffer
+
+		SysexSpan subspan(size_t offset, size_t length) const;
+
+		// Splits the bytes into one span per MIDI message, like the MidiMessage parsing of Sysex::loadSysex did. A sysex message
+		// runs to its F7, or up to the next status byte or the end if the F7 is missing, and is kept either way. Other messages get
+		// the length given by their status byte, running status is resolved into a copy with the status byte.
+		std::vector<SysexSpan> messages() const;
+
+		std::vector<uint8> copy() const; // Use this if the bytes need to be modified
+		MidiMessage toMidiMessage() const;
+		static std::vector<MidiMessage> toMidiMessages(std::vector<SysexSpan> const &spans);
+
+	private:
+		std::shared_ptr<const std::vector<uint8>> buffer_;
+		size_t offset_;
+		size_t length_;
+	};
+
+}
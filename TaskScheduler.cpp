@@ -0,0 +1,205 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "TaskScheduler.h"
+
+namespace midikraft {
+
+	struct TaskScheduler::GroupState {
+		GroupState(CancellationToken token) : pending(0), token(token) {}
+
+		std::atomic<int> pending;
+		CancellationToken token;
+		std::mutex errorLock;
+		std::exception_ptr error;
+	};
+
+	CancellationToken::CancellationToken() : cancelled_(std::make_shared<std::atomic<bool>>(false))
+	{
+	}
+
+	void CancellationToken::cancel()
+	{
+		*cancelled_ = true;
+	}
+
+	bool CancellationToken::isCancelled() const
+	{
+		return *cancelled_;
+	}
+
+	TaskScheduler &TaskScheduler::instance()
+	{
+		// One thread less than cores, because the thread waiting for the result is helping
+		static TaskScheduler instance_(std::max(1, SystemStats::getNumCpus() - 1));
+		return instance_;
+	}
+
+	TaskScheduler::TaskScheduler(int numberOfWorkers) : shutdown_(false)
+	{
+		for (int i = 0; i < numberOfWorkers; i++) {
+			workers_.emplace_back([this]() { workerLoop(); });
+		}
+	}
+
+	TaskScheduler::~TaskScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			shutdown_ = true;
+		}
+		workAvailable_.notify_all();
+		for (auto &worker : workers_) {
+			worker.join();
+		}
+	}
+
+	int TaskScheduler::numberOfWorkers() const
+	{
+		return (int)workers_.size();
+	}
+
+	void TaskScheduler::enqueue(Priority priority, Task task)
+	{
+		task.group->pending++;
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			queues_[(size_t)priority].push_back(std::move(task));
+		}
+		workAvailable_.notify_one();
+	}
+
+	void TaskScheduler::execute(Task &task)
+	{
+		if (!task.group->token.isCancelled()) {
+			try {
+				task.function();
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(task.group->errorLock);
+				if (!task.group->error) {
+					task.group->error = std::current_exception();
+				}
+				task.group->token.cancel();
+			}
+		}
+		{
+			// Decrement under the lock, so a waiter can't miss the notification
+			std::lock_guard<std::mutex> lock(lock_);
+			task.group->pending--;
+		}
+		taskDone_.notify_all();
+	}
+
+	void TaskScheduler::workerLoop()
+	{
+		while (true) {
+			Task task;
+			{
+				std::unique_lock<std::mutex> lock(lock_);
+				workAvailable_.wait(lock, [this]() {
+					return shutdown_ || std::any_of(queues_.begin(), queues_.end(), [](std::deque<Task> const &queue) { return !queue.empty(); });
+				});
+				if (shutdown_) {
+					return;
+				}
+				for (auto &queue : queues_) {
+					if (!queue.empty()) {
+						task = std::move(queue.front());
+						queue.pop_front();
+						break;
+					}
+				}
+			}
+			execute(task);
+		}
+	}
+
+	void TaskScheduler::helpUntilDone(std::shared_ptr<GroupState> group)
+	{
+		while (group->pending > 0) {
+			Task task;
+			{
+				std::unique_lock<std::mutex> lock(lock_);
+				// Only pick up tasks of our own group, an unrelated long running task would block us for no reason
+				for (auto &queue : queues_) {
+					auto found = std::find_if(queue.begin(), queue.end(), [&group](Task const &candidate) { return candidate.group == group; });
+					if (found != queue.end()) {
+						task = std::move(*found);
+						queue.erase(found);
+						break;
+					}
+				}
+				if (!task.group) {
+					// All remaining tasks are running on other threads, wait for them
+					taskDone_.wait(lock, [&group]() { return group->pending == 0; });
+					break;
+				}
+			}
+			execute(task);
+		}
+	}
+
+	void TaskScheduler::parallelFor(Priority priority, size_t count, std::function<void(size_t)> body, CancellationToken const &token)
+	{
+		// Submit a few more chunks than there are threads to balance uneven work items
+		size_t chunks = std::min(count, (size_t)(workers_.size() + 1) * 4);
+		TaskGroup group(priority, token);
+		for (size_t chunk = 0; chunk < chunks; chunk++) {
+			size_t start = count * chunk / chunks;
+			size_t end = count * (chunk + 1) / chunks;
+			group.run([start, end, &body, token]() {
+				for (size_t i = start; i < end && !token.isCancelled(); i++) {
+					body(i);
+				}
+			});
+		}
+		group.wait();
+	}
+
+	TaskGroup::TaskGroup(TaskScheduler::Priority priority, CancellationToken token) : priority_(priority), state_(std::make_shared<TaskScheduler::GroupState>(token))
+	{
+	}
+
+	TaskGroup::~TaskGroup()
+	{
+		try {
+			wait();
+		}
+		catch (...) {
+			// Errors not retrieved by calling wait() are lost
+		}
+	}
+
+	void TaskGroup::run(std::function<void()> task)
+	{
+		TaskScheduler::instance().enqueue(priority_, { task, state_ });
+	}
+
+	void TaskGroup::wait()
+	{
+		TaskScheduler::instance().helpUntilDone(state_);
+		std::exception_ptr error;
+		{
+			std::lock_guard<std::mutex> lock(state_->errorLock);
+			std::swap(error, state_->error);
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	void TaskGroup::cancel()
+	{
+		state_->token.cancel();
+	}
+
+	CancellationToken TaskGroup::token() const
+	{
+		return state_->token;
+	}
+
+}
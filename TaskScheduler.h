@@ -0,0 +1,88 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace midikraft {
+
+	// Copies share the same state, so a token can be handed to the tasks and cancelled from the outside
+	class CancellationToken {
+	public:
+		CancellationToken();
+
+		void cancel();
+		bool isCancelled() const;
+
+	private:
+		std::shared_ptr<std::atomic<bool>> cancelled_;
+	};
+
+	// Process wide pool of worker threads shared by all batch operations of the librarian, so they don't oversubscribe the cores.
+	// Tasks are executed in order of their priority class. A thread waiting for a TaskGroup helps executing the tasks of that group,
+	// which makes nested parallelFor calls from within tasks safe.
+	class TaskScheduler {
+	public:
+		enum class Priority { INTERACTIVE = 0, IMPORT = 1, CATEGORIZATION = 2, EXPORT = 3 };
+
+		static TaskScheduler &instance();
+		~TaskScheduler();
+
+		int numberOfWorkers() const;
+
+		// Runs body(i) for all i in [0, count) and returns when all are done. Rethrows the first exception thrown by body.
+		// Indexes not yet started when the token is cancelled are skipped.
+		void parallelFor(Priority priority, size_t count, std::function<void(size_t)> body, CancellationToken const &token = CancellationToken());
+
+	private:
+		friend class TaskGroup;
+		struct GroupState;
+		struct Task {
+			std::function<void()> function;
+			std::shared_ptr<GroupState> group;
+		};
+
+		TaskScheduler(int numberOfWorkers);
+
+		void enqueue(Priority priority, Task task);
+		void execute(Task &task);
+		void helpUntilDone(std::shared_ptr<GroupState> group);
+		void workerLoop();
+
+		std::mutex lock_;
+		std::condition_variable workAvailable_;
+		std::condition_variable taskDone_;
+		std::array<std::deque<Task>, 4> queues_;
+		std::vector<std::thread> workers_;
+		bool shutdown_;
+	};
+
+	// A set of tasks submitted to the TaskScheduler that can be waited for and cancelled together
+	class TaskGroup {
+	public:
+		TaskGroup(TaskScheduler::Priority priority, CancellationToken token = CancellationToken());
+		~TaskGroup(); // Waits for all tasks
+
+		void run(std::function<void()> task);
+		void wait(); // Rethrows the first exception of any task
+		void cancel();
+		CancellationToken token() const;
+
+	private:
+		TaskScheduler::Priority priority_;
+		std::shared_ptr<TaskScheduler::GroupState> state_;
+	};
+
+}
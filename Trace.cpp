@@ -0,0 +1,173 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "Trace.h"
+
+#include "Logger.h"
+
+// Turn off warning on unknown pragmas for VC++
+#pragma warning(push)
+#pragma warning(disable: 4068)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wzero-as-null-pointer-constant"
+#include "rapidjson/writer.h"
+#include "rapidjson/filewritestream.h"
+#pragma GCC diagnostic pop
+#pragma warning(pop)
+
+#include <boost/format.hpp>
+
+#include <cstdio>
+
+namespace midikraft {
+
+	Trace &Trace::instance()
+	{
+		static Trace instance_;
+		return instance_;
+	}
+
+	Trace::Trace() : enabled_(false), nextThreadId_(1)
+	{
+	}
+
+	void Trace::setEnabled(bool enabled)
+	{
+		enabled_ = enabled;
+	}
+
+	int64 Trace::nowMicros()
+	{
+		static const double ticksPerMicrosecond = Time::getHighResolutionTicksPerSecond() / 1e6;
+		return (int64)(Time::getHighResolutionTicks() / ticksPerMicrosecond);
+	}
+
+	Trace::ThreadBuffer &Trace::currentThreadBuffer()
+	{
+		thread_local std::shared_ptr<ThreadBuffer> buffer;
+		if (!buffer) {
+			buffer = std::make_shared<ThreadBuffer>();
+			buffer->threadId = nextThreadId_++;
+			auto juceThread = Thread::getCurrentThread();
+			if (juceThread) {
+				buffer->threadName = juceThread->getThreadName().toStdString();
+			}
+			else if (MessageManager::existsAndIsCurrentThread()) {
+				buffer->threadName = "Message thread";
+			}
+			else {
+				buffer->threadName = (boost::format("Thread %d") % buffer->threadId).str();
+			}
+			std::lock_guard<std::mutex> lock(buffersLock_);
+			buffers_.push_back(buffer);
+		}
+		return *buffer;
+	}
+
+	void Trace::add(Event const &event)
+	{
+		auto &buffer = currentThreadBuffer();
+		std::lock_guard<std::mutex> lock(buffer.lock);
+		if (buffer.events.size() < kMaxEventsPerThread) {
+			buffer.events.push_back(event);
+		}
+	}
+
+	void Trace::addSpan(const char *name, const char *category, int64 startMicros, int64 durationMicros)
+	{
+		if (isEnabled()) {
+			add({ name, category, 'X', startMicros, durationMicros });
+		}
+	}
+
+	void Trace::addCounter(const char *name, int64 value)
+	{
+		if (isEnabled()) {
+			add({ name, "counter", 'C', nowMicros(), value });
+		}
+	}
+
+	void Trace::clear()
+	{
+		std::lock_guard<std::mutex> lock(buffersLock_);
+		for (auto &buffer : buffers_) {
+			std::lock_guard<std::mutex> bufferLock(buffer->lock);
+			buffer->events.clear();
+		}
+	}
+
+	bool Trace::writeChromeTrace(std::string const &filename) const
+	{
+#if WIN32
+		FILE *fp;
+		if (fopen_s(&fp, filename.c_str(), "wb") != 0) fp = nullptr;
+#else
+		FILE *fp = fopen(filename.c_str(), "w");
+#endif
+		if (!fp) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to open file %s to write trace to") % filename).str());
+			return false;
+		}
+		char writeBuffer[65536];
+		rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+		rapidjson::Writer<rapidjson::FileWriteStream> writer(os);
+		writer.StartObject();
+		writer.Key("traceEvents");
+		writer.StartArray();
+		{
+			std::lock_guard<std::mutex> lock(buffersLock_);
+			for (auto const &buffer : buffers_) {
+				std::lock_guard<std::mutex> bufferLock(buffer->lock);
+				// Metadata event so the viewer shows thread names
+				writer.StartObject();
+				writer.Key("name"); writer.String("thread_name");
+				writer.Key("ph"); writer.String("M");
+				writer.Key("pid"); writer.Int(1);
+				writer.Key("tid"); writer.Int(buffer->threadId);
+				writer.Key("args"); writer.StartObject(); writer.Key("name"); writer.String(buffer->threadName.c_str()); writer.EndObject();
+				writer.EndObject();
+				for (auto const &event : buffer->events) {
+					writer.StartObject();
+					writer.Key("name"); writer.String(event.name);
+					writer.Key("cat"); writer.String(event.category);
+					writer.Key("ph"); writer.String(&event.phase, 1);
+					writer.Key("ts"); writer.Int64(event.timestamp);
+					writer.Key("pid"); writer.Int(1);
+					writer.Key("tid"); writer.Int(buffer->threadId);
+					if (event.phase == 'X') {
+						writer.Key("dur"); writer.Int64(event.durationOrValue);
+					}
+					else {
+						writer.Key("args"); writer.StartObject(); writer.Key("value"); writer.Int64(event.durationOrValue); writer.EndObject();
+					}
+					writer.EndObject();
+				}
+			}
+		}
+		writer.EndArray();
+		writer.Key("displayTimeUnit");
+		writer.String("ms");
+		writer.EndObject();
+		os.Flush();
+		fclose(fp);
+		return true;
+	}
+
+	TraceScope::TraceScope(const char *name, const char *category) : name_(name), category_(category), start_(-1)
+	{
+		if (Trace::instance().isEnabled()) {
+			start_ = Trace::nowMicros();
+		}
+	}
+
+	TraceScope::~TraceScope()
+	{
+		if (start_ >= 0) {
+			Trace::instance().addSpan(name_, category_, start_, Trace::nowMicros() - start_);
+		}
+	}
+
+}
@@ -0,0 +1,83 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include <atomic>
+#include <mutex>
+
+namespace midikraft {
+
+	// Collects timed spans for inspection in a trace viewer (chrome://tracing, Perfetto).
+	//
+	// Use the MIDIKRAFT_TRACE_SCOPE macro, which compiles to nothing unless MIDIKRAFT_LIBRARIAN_TRACING is defined. When compiled
+	// in, recording still needs to be switched on with setEnabled(), until then a span costs one relaxed atomic load.
+	// Names and categories must be string literals, they are stored as pointers only.
+	class Trace {
+	public:
+		static Trace &instance();
+
+		void setEnabled(bool enabled);
+		bool isEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+		void addSpan(const char *name, const char *category, int64 startMicros, int64 durationMicros);
+		void addCounter(const char *name, int64 value);
+		void clear();
+
+		// Writes all events recorded so far in the Chrome trace-event JSON format
+		bool writeChromeTrace(std::string const &filename) const;
+
+		static int64 nowMicros();
+
+	private:
+		Trace();
+
+		struct Event {
+			const char *name;
+			const char *category;
+			char phase; // 'X' for a complete span, 'C' for a counter
+			int64 timestamp;
+			int64 durationOrValue;
+		};
+
+		struct ThreadBuffer {
+			std::mutex lock; // Only contended while writing the trace
+			std::vector<Event> events;
+			int threadId;
+			std::string threadName;
+		};
+
+		ThreadBuffer &currentThreadBuffer();
+		void add(Event const &event);
+
+		static const size_t kMaxEventsPerThread = 1 << 20;
+
+		std::atomic<bool> enabled_;
+		std::atomic<int> nextThreadId_;
+		mutable std::mutex buffersLock_;
+		std::vector<std::shared_ptr<ThreadBuffer>> buffers_; // Kept alive after their threads ended
+	};
+
+	class TraceScope {
+	public:
+		TraceScope(const char *name, const char *category);
+		~TraceScope();
+
+	private:
+		const char *name_;
+		const char *category_;
+		int64 start_;
+	};
+
+}
+
+#if MIDIKRAFT_LIBRARIAN_TRACING
+#define MIDIKRAFT_TRACE_SCOPE(name, category) midikraft::TraceScope JUCE_JOIN_MACRO(midikraftTraceScope_, __LINE__)(name, category)
+#else
+#define MIDIKRAFT_TRACE_SCOPE(name, category)
+#endif
@@ -0,0 +1,149 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "WatchFolderImporter.h"
+
+#include "ConcurrentSynthAccess.h"
+
+#include "Logger.h"
+#include "LegacyLoaderCapability.h"
+
+#include <boost/format.hpp>
+
+#if JUCE_LINUX
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace midikraft {
+
+	WatchFolderImporter::WatchFolderImporter(Librarian &librarian, std::shared_ptr<Synth> synth, std::shared_ptr<AutomaticCategory> detector, std::string const &folder, TImportHandler onImported) :
+		Thread("WatchFolderImporter"), librarian_(librarian), synth_(synth), detector_(detector), folder_(folder), onImported_(onImported), inotifyHandle_(-1)
+	{
+	}
+
+	WatchFolderImporter::~WatchFolderImporter()
+	{
+		stop();
+	}
+
+	bool WatchFolderImporter::start()
+	{
+#if JUCE_LINUX
+		if (!folder_.isDirectory()) {
+			SimpleLogger::instance()->postMessage((boost::format("Can't watch %s, it is not a directory") % folder_.getFullPathName().toStdString()).str());
+			return false;
+		}
+		inotifyHandle_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotifyHandle_ < 0 || inotify_add_watch(inotifyHandle_, folder_.getFullPathName().toRawUTF8(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY) < 0) {
+			SimpleLogger::instance()->postMessage((boost::format("Failed to watch directory %s for new patch files") % folder_.getFullPathName().toStdString()).str());
+			stop();
+			return false;
+		}
+		imports_ = std::make_unique<TaskGroup>(TaskScheduler::Priority::IMPORT);
+		startThread();
+		return true;
+#else
+		SimpleLogger::instance()->postMessage("Watch folders are only supported on Linux");
+		return false;
+#endif
+	}
+
+	void WatchFolderImporter::stop()
+	{
+		stopThread(1000);
+		if (imports_) {
+			// Imports not yet started are dropped, running ones are waited for
+			imports_->cancel();
+			imports_.reset();
+		}
+#if JUCE_LINUX
+		if (inotifyHandle_ >= 0) {
+			close(inotifyHandle_);
+			inotifyHandle_ = -1;
+		}
+#endif
+	}
+
+	void WatchFolderImporter::addKnownFingerprints(std::set<std::string> const &fingerprints)
+	{
+		std::lock_guard<std::mutex> lock(fingerprintLock_);
+		knownFingerprints_.insert(fingerprints.begin(), fingerprints.end());
+	}
+
+	void WatchFolderImporter::run()
+	{
+#if JUCE_LINUX
+		alignas(struct inotify_event) char buffer[4096];
+		while (!threadShouldExit()) {
+			struct pollfd pfd = { inotifyHandle_, POLLIN, 0 };
+			if (poll(&pfd, 1, 100) > 0) {
+				ssize_t length;
+				while ((length = read(inotifyHandle_, buffer, sizeof(buffer))) > 0) {
+					for (char *ptr = buffer; ptr < buffer + length; ) {
+						auto event = reinterpret_cast<struct inotify_event *>(ptr);
+						if (event->len > 0 && (event->mask & IN_ISDIR) == 0) {
+							// Files are often written in several steps, so only record the time and wait until it settled down
+							pendingFiles_[event->name] = Time::getMillisecondCounter();
+						}
+						ptr += sizeof(struct inotify_event) + event->len;
+					}
+				}
+			}
+
+			auto now = Time::getMillisecondCounter();
+			for (auto pending = pendingFiles_.begin(); pending != pendingFiles_.end(); ) {
+				if (now - pending->second >= (uint32)kDebounceMilliseconds) {
+					std::string filename = pending->first;
+					if (isImportable(filename)) {
+						std::string fullpath = folder_.getChildFile(filename).getFullPathName().toStdString();
+						imports_->run([this, fullpath, filename]() { importFile(fullpath, filename); });
+					}
+					pending = pendingFiles_.erase(pending);
+				}
+				else {
+					pending++;
+				}
+			}
+		}
+#endif
+	}
+
+	bool WatchFolderImporter::isImportable(std::string const &filename) const
+	{
+		String extension = File::createFileWithoutCheckingPath(filename).getFileExtension().toLowerCase();
+		if (extension == ".syx" || extension == ".mid" || extension == ".json" || extension == ".zip") {
+			return true;
+		}
+		auto legacyLoader = midikraft::Capability::hasCapability<LegacyLoaderCapability>(synth_);
+		return legacyLoader && legacyLoader->supportsExtension(filename);
+	}
+
+	void WatchFolderImporter::importFile(std::string const &fullpath, std::string const &filename)
+	{
+		// The imports run on the pool, so an adaptation without ConcurrentAccessCapability gets them one at a time
+		SynthAccessLock access(synth_.get());
+		auto loaded = librarian_.loadSysexPatchesFromDisk(synth_, fullpath, filename, detector_);
+		std::vector<PatchHolder> newPatches;
+		{
+			std::lock_guard<std::mutex> lock(fingerprintLock_);
+			for (auto const &patch : loaded) {
+				if (knownFingerprints_.insert(patch.md5()).second) {
+					newPatches.push_back(patch);
+				}
+			}
+		}
+		SimpleLogger::instance()->postMessage((boost::format("Watch folder: Loaded %d patches from %s, %d of them new") % loaded.size() % filename % newPatches.size()).str());
+		if (!newPatches.empty() && onImported_) {
+			auto handler = onImported_;
+			MessageManager::callAsync([handler, filename, newPatches]() {
+				handler(filename, newPatches);
+			});
+		}
+	}
+
+}
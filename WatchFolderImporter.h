@@ -0,0 +1,56 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "Librarian.h"
+#include "TaskScheduler.h"
+
+#include <map>
+#include <mutex>
+#include <set>
+
+namespace midikraft {
+
+	// Watches a folder and imports every new or changed patch file dropped into it. Only the files that changed are loaded,
+	// there is no rescan of the folder. Currently only implemented for Linux via inotify.
+	class WatchFolderImporter : private Thread {
+	public:
+		typedef std::function<void(std::string const &filename, std::vector<PatchHolder> patches)> TImportHandler;
+
+		// The handler is called on the message thread once per imported file, with the patches not seen before
+		WatchFolderImporter(Librarian &librarian, std::shared_ptr<Synth> synth, std::shared_ptr<AutomaticCategory> detector, std::string const &folder, TImportHandler onImported);
+		virtual ~WatchFolderImporter() override;
+
+		bool start();
+		void stop();
+
+		// Seed the duplicate detection, e.g. with the fingerprints of the patches already in the database
+		void addKnownFingerprints(std::set<std::string> const &fingerprints);
+
+	private:
+		virtual void run() override;
+
+		bool isImportable(std::string const &filename) const;
+		void importFile(std::string const &fullpath, std::string const &filename);
+
+		static const int kDebounceMilliseconds = 500;
+
+		Librarian &librarian_;
+		std::shared_ptr<Synth> synth_;
+		std::shared_ptr<AutomaticCategory> detector_;
+		File folder_;
+		TImportHandler onImported_;
+		std::unique_ptr<TaskGroup> imports_;
+		std::map<std::string, uint32> pendingFiles_; // Filename to time of last change
+		std::mutex fingerprintLock_;
+		std::set<std::string> knownFingerprints_;
+		int inotifyHandle_;
+	};
+
+}
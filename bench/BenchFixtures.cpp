@@ -0,0 +1,163 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "BenchFixtures.h"
+
+#include <boost/format.hpp>
+
+namespace midikraft {
+
+	BenchPatch::BenchPatch(Synth::PatchData const &data, MidiProgramNumber place) : Patch(0, data), place_(place)
+	{
+	}
+
+	std::string BenchPatch::name() const
+	{
+		std::string result;
+		auto const &d = data();
+		for (size_t i = kNameOffset; i < kHeaderSize && i < d.size(); i++) {
+			if (d[i] == 0) break;
+			result.push_back((char)d[i]);
+		}
+		return result;
+	}
+
+	MidiProgramNumber BenchPatch::patchNumber() const
+	{
+		return place_;
+	}
+
+	BenchSynth::BenchSynth(std::string const &name) : name_(name)
+	{
+	}
+
+	std::string BenchSynth::getName() const
+	{
+		return name_;
+	}
+
+	std::shared_ptr<DataFile> BenchSynth::patchFromPatchData(const Synth::PatchData &data, MidiProgramNumber place) const
+	{
+		return std::make_shared<BenchPatch>(data, place);
+	}
+
+	bool BenchSynth::isOwnSysex(MidiMessage const &message) const
+	{
+		if (message.isSysEx() && message.getSysExDataSize() >= (int)BenchPatch::kHeaderSize) {
+			auto data = message.getSysExData();
+			return data[0] == 0x7d && data[1] == 'B' && data[2] == 'N' && data[3] == 'C';
+		}
+		return false;
+	}
+
+	int BenchSynth::numberOfBanks() const
+	{
+		return 8;
+	}
+
+	int BenchSynth::numberOfPatches() const
+	{
+		return 128;
+	}
+
+	std::string BenchSynth::friendlyBankName(MidiBankNumber bankNo) const
+	{
+		return (boost::format("Bank %d") % bankNo.toOneBased()).str();
+	}
+
+	TPatchVector BenchSynth::loadSysex(std::vector<MidiMessage> const &sysexMessages)
+	{
+		TPatchVector result;
+		for (auto const &message : sysexMessages) {
+			if (isOwnSysex(message)) {
+				Synth::PatchData data(message.getSysExData(), message.getSysExData() + message.getSysExDataSize());
+				result.push_back(patchFromPatchData(data, MidiProgramNumber::fromZeroBase((int)result.size())));
+			}
+		}
+		return result;
+	}
+
+	std::vector<MidiMessage> BenchSynth::dataFileToSysex(std::shared_ptr<DataFile> dataFile, std::shared_ptr<SendTarget> target)
+	{
+		ignoreUnused(target);
+		return { MidiMessage::createSysExMessage(dataFile->data().data(), (int)dataFile->data().size()) };
+	}
+
+	Synth::PatchData BenchSynth::createPatchData(std::string const &name, size_t parameterBytes, Random &random)
+	{
+		Synth::PatchData data = { 0x7d, 'B', 'N', 'C' };
+		for (size_t i = 0; i < BenchPatch::kNameLength; i++) {
+			data.push_back(i < name.size() ? (uint8)(name[i] & 0x7f) : 0);
+		}
+		for (size_t i = 0; i < parameterBytes; i++) {
+			data.push_back((uint8)random.nextInt(128));
+		}
+		return data;
+	}
+
+	std::vector<Category> BenchFixtures::categories()
+	{
+		static std::vector<std::string> names = { "Lead", "Pad", "Brass", "Organ", "Keys", "Bass", "Arp", "Pluck", "Drone", "Drum", "Bell", "SFX", "Ambient", "Wind", "Voice" };
+		static std::vector<Category> result;
+		if (result.empty()) {
+			int id = 1;
+			for (auto const &name : names) {
+				result.emplace_back(std::make_shared<CategoryDefinition>(CategoryDefinition{ id, true, name, Colour::fromHSV(id / 16.0f, 0.5f, 0.8f, 1.0f) }));
+				id++;
+			}
+		}
+		return result;
+	}
+
+	std::string BenchFixtures::randomPatchName(Random &random)
+	{
+		static std::vector<std::string> prefixes = { "", "", "", "", "BS ", "LD ", "PD ", "ARP:", "KBD:", "STR:", "PRC:" };
+		static std::vector<std::string> words = { "Moog", "Soft", "Warm", "Brass", "Pad", "Lead", "Bell", "Organ", "Strings", "Sweep", "Dark", "Fat",
+			"Solo", "Choir", "Pluck", "Harp", "Kick", "Drone", "Sync", "Saw", "Fx", "Wurli", "Rhodes", "Piano", "Clav", "Horn", "Noise",
+			"Space", "Glass", "Hammond", "Perc", "Low", "Hi", "Init", "Vox", "Flute", "Tines", "Chime", "Unison", "Acid" };
+		std::string name = prefixes[(size_t)random.nextInt((int)prefixes.size())];
+		int wordCount = 1 + random.nextInt(3);
+		for (int w = 0; w < wordCount; w++) {
+			if (w > 0) name += " ";
+			name += words[(size_t)random.nextInt((int)words.size())];
+		}
+		if (random.nextInt(4) == 0) {
+			name += " " + std::to_string(1 + random.nextInt(9));
+		}
+		return name.substr(0, BenchPatch::kNameLength);
+	}
+
+	std::vector<PatchHolder> BenchFixtures::createLibrary(std::shared_ptr<BenchSynth> synth, std::shared_ptr<AutomaticCategory> detector, size_t count, int64 seed)
+	{
+		Random random(seed);
+		std::vector<PatchHolder> result;
+		result.reserve(count);
+		Time start(2022, 0, 1, 12, 0);
+		for (size_t i = 0; i < count; i++) {
+			auto name = randomPatchName(random);
+			auto program = MidiProgramNumber::fromZeroBase((int)(i % 128));
+			auto bank = MidiBankNumber::fromZeroBase((int)((i / 128) % 8));
+			auto patch = std::make_shared<BenchPatch>(BenchSynth::createPatchData(name, 256, random), program);
+
+			std::shared_ptr<SourceInfo> source;
+			switch (i % 3) {
+			case 0: source = std::make_shared<FromSynthSource>(start + RelativeTime::seconds((double)i), bank); break;
+			case 1: source = std::make_shared<FromFileSource>("bank.syx", "/tmp/bank.syx", program); break;
+			default: source = std::make_shared<FromBulkImportSource>(start, std::make_shared<FromFileSource>("bulk.syx", "/tmp/bulk.syx", program)); break;
+			}
+
+			PatchHolder holder(synth, source, patch, bank, program, detector);
+			if (i % 4 == 0) {
+				// Some patches with user decisions, so the categories get written to the PIF
+				holder.setUserDecisions(holder.categories());
+			}
+			holder.setFavorite(Favorite(i % 7 == 0));
+			result.push_back(holder);
+		}
+		return result;
+	}
+
+}
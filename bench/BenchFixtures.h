@@ -0,0 +1,70 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "Synth.h"
+#include "Patch.h"
+
+#include "AutomaticCategory.h"
+#include "PatchHolder.h"
+#include "ConcurrentSynthAccess.h"
+
+namespace midikraft {
+
+	// Patch of the BenchSynth. The data is the sysex payload: 0x7d (non-commercial ID), 'B', 'N', 'C', 16 bytes of name, parameters
+	class BenchPatch : public Patch {
+	public:
+		BenchPatch(Synth::PatchData const &data, MidiProgramNumber place);
+
+		virtual std::string name() const override;
+		virtual MidiProgramNumber patchNumber() const override;
+
+		static const size_t kNameOffset = 4;
+		static const size_t kNameLength = 16;
+		static const size_t kHeaderSize = kNameOffset + kNameLength;
+
+	private:
+		MidiProgramNumber place_;
+	};
+
+	// A synth that needs no hardware - every sysex message with the right header is one patch. It has no state beyond its name,
+	// so it can be used from several threads and the parallel code paths are measured.
+	class BenchSynth : public Synth, public ConcurrentAccessCapability {
+	public:
+		BenchSynth(std::string const &name);
+
+		virtual std::string getName() const override;
+		virtual std::shared_ptr<DataFile> patchFromPatchData(const Synth::PatchData &data, MidiProgramNumber place) const override;
+		virtual bool isOwnSysex(MidiMessage const &message) const override;
+		virtual int numberOfBanks() const override;
+		virtual int numberOfPatches() const override;
+		virtual std::string friendlyBankName(MidiBankNumber bankNo) const override;
+
+		virtual TPatchVector loadSysex(std::vector<MidiMessage> const &sysexMessages) override;
+		virtual std::vector<MidiMessage> dataFileToSysex(std::shared_ptr<DataFile> dataFile, std::shared_ptr<SendTarget> target) override;
+
+		// Creates the payload of a patch, parameters are filled from the random generator given
+		static Synth::PatchData createPatchData(std::string const &name, size_t parameterBytes, Random &random);
+
+	private:
+		std::string name_;
+	};
+
+	class BenchFixtures {
+	public:
+		// The categories used by the built-in automatic category rules
+		static std::vector<Category> categories();
+
+		// Patch names in the style found in factory banks, like "BS Moog Low 2" or "Soft Pad"
+		static std::string randomPatchName(Random &random);
+
+		static std::vector<PatchHolder> createLibrary(std::shared_ptr<BenchSynth> synth, std::shared_ptr<AutomaticCategory> detector, size_t count, int64 seed);
+	};
+
+}
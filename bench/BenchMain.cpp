@@ -0,0 +1,292 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+// Microbenchmarks for the hot paths of the librarian. No MIDI hardware or UI needed, all patches come from the BenchSynth.
+//
+// Usage: midikraft-librarian-bench [--filter <substring>] [--repetitions <n>] [--max-size <patches>] [--label <build label>] [--out <file.json>]
+//                                   [--trace <trace.json>]
+//
+// The results are written as JSON, one entry per benchmark with the minimum and median time over all repetitions, so two
+// builds can be compared with a simple script.
+
+#include "JuceHeader.h"
+
+#include "BenchFixtures.h"
+
+#include "Category.h"
+#include "ExportPipeline.h"
+#include "Librarian.h"
+#include "JsonSerialization.h"
+#include "PatchInterchangeFormat.h"
+#include "PatchMetadataTable.h"
+#include "Trace.h"
+
+#include "nlohmann/json.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+
+using namespace midikraft;
+
+namespace {
+
+	// Keeps the compiler from optimizing away results
+	volatile size_t sink = 0;
+
+	class BenchRunner {
+	public:
+		BenchRunner(std::string const &filter, int repetitions) : filter_(filter), repetitions_(std::max(1, repetitions)) {}
+
+		// Runs body repetitions times, items is the number of operations one call of body does. setup is called before each
+		// repetition and not measured.
+		void run(std::string const &name, size_t items, std::function<void()> body, std::function<void()> setup = nullptr) {
+			if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+				return;
+			}
+			std::vector<double> times;
+			for (int r = 0; r < repetitions_; r++) {
+				if (setup) {
+					setup();
+				}
+				auto start = Time::getHighResolutionTicks();
+				body();
+				times.push_back(Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - start) * 1000.0);
+			}
+			std::sort(times.begin(), times.end());
+			double median = times[times.size() / 2];
+			results_.push_back({
+				{ "name", name },
+				{ "items", items },
+				{ "repetitions", repetitions_ },
+				{ "min_ms", times.front() },
+				{ "median_ms", median },
+				{ "ns_per_item", items > 0 ? times.front() * 1e6 / items : 0.0 }
+			});
+			std::cerr << name << ": " << times.front() << " ms (median " << median << " ms)" << std::endl;
+		}
+
+		nlohmann::json results() const { return results_; }
+
+	private:
+		std::string filter_;
+		int repetitions_;
+		nlohmann::json results_ = nlohmann::json::array();
+	};
+
+	std::string argument(StringArray const &args, String const &key, std::string const &defaultValue) {
+		int index = args.indexOf(key);
+		if (index >= 0 && index + 1 < args.size()) {
+			return args[index + 1].toStdString();
+		}
+		return defaultValue;
+	}
+
+	void categorizationBenchmarks(BenchRunner &runner, std::shared_ptr<BenchSynth> synth, std::shared_ptr<AutomaticCategory> detector) {
+		// Categorize without detector in the constructor, so only the measured call does the work
+		auto library = BenchFixtures::createLibrary(synth, nullptr, 10000, 1);
+		runner.run("categorize_single_10k", library.size(), [&]() {
+			for (auto const &patch : library) {
+				sink = sink + detector->determineAutomaticCategories(patch).size();
+			}
+		}, [&]() { detector->clearNameCache(); });
+		runner.run("categorize_batch_10k", library.size(), [&]() {
+			sink = sink + detector->determineAutomaticCategories(library).size();
+		}, [&]() { detector->clearNameCache(); });
+	}
+
+	void pifBenchmarks(BenchRunner &runner, std::shared_ptr<BenchSynth> synth, std::shared_ptr<AutomaticCategory> detector, size_t maxSize) {
+		std::map<std::string, std::shared_ptr<Synth>> synths = { { synth->getName(), synth } };
+		for (size_t size : { 1000, 10000, 100000 }) {
+			if (size > maxSize) continue;
+			auto library = BenchFixtures::createLibrary(synth, detector, size, 2);
+			auto file = File::getSpecialLocation(File::tempDirectory).getNonexistentChildFile("bench", ".json");
+			std::string label = size >= 1000 ? std::to_string(size / 1000) + "k" : std::to_string(size);
+			runner.run("pif_save_" + label, size, [&]() {
+				PatchInterchangeFormat::save(library, file.getFullPathName().toStdString());
+			});
+			runner.run("pif_load_" + label, size, [&]() {
+				sink = sink + PatchInterchangeFormat::load(synths, file.getFullPathName().toStdString(), detector).size();
+			});
+			file.deleteFile();
+
+			// Same library as metadata table, to compare with the PIF numbers
+			auto tableFile = File::getSpecialLocation(File::tempDirectory).getNonexistentChildFile("bench", ".kmdt");
+			runner.run("metadata_save_" + label, size, [&]() {
+				PatchMetadataWriter writer(tableFile);
+				for (auto const &patch : library) {
+					writer.add(patch);
+				}
+				sink = sink + (writer.close() ? 1 : 0);
+			});
+			runner.run("metadata_load_" + label, size, [&]() {
+				PatchMetadataTable table;
+				PatchMetadataTable::read(tableFile, table);
+				sink = sink + table.size();
+			});
+			tableFile.deleteFile();
+		}
+	}
+
+	void serializationBenchmarks(BenchRunner &runner, std::shared_ptr<BenchSynth> synth) {
+		auto library = BenchFixtures::createLibrary(synth, nullptr, 10000, 3);
+		std::vector<std::string> encoded;
+		for (auto const &patch : library) {
+			encoded.push_back(JsonSerialization::dataToString(patch.patch()->data()));
+		}
+		runner.run("base64_encode_10k", library.size(), [&]() {
+			for (auto const &patch : library) {
+				sink = sink + JsonSerialization::dataToString(patch.patch()->data()).size();
+			}
+		});
+		runner.run("base64_decode_10k", encoded.size(), [&]() {
+			for (auto const &string : encoded) {
+				sink = sink + JsonSerialization::stringToData(string).size();
+			}
+		});
+		runner.run("patch_to_json_10k", library.size(), [&]() {
+			for (auto &patch : library) {
+				sink = sink + JsonSerialization::patchToJson(synth, &patch).size();
+			}
+		});
+	}
+
+	void sourceInfoBenchmarks(BenchRunner &runner) {
+		const size_t count = 100000;
+		Time now(2022, 0, 1, 12, 0);
+		runner.run("sourceinfo_construct_100k", count, [&]() {
+			for (size_t i = 0; i < count; i++) {
+				auto program = MidiProgramNumber::fromZeroBase((int)(i % 128));
+				std::shared_ptr<SourceInfo> info;
+				switch (i % 3) {
+				case 0: info = std::make_shared<FromSynthSource>(now, MidiBankNumber::fromZeroBase(0)); break;
+				case 1: info = std::make_shared<FromFileSource>("bank.syx", "/tmp/bank.syx", program); break;
+				default: info = std::make_shared<FromBulkImportSource>(now, std::make_shared<FromFileSource>("bulk.syx", "/tmp/bulk.syx", program)); break;
+				}
+				sink = sink + info->toString().size();
+			}
+		});
+		std::vector<std::string> strings = {
+			FromSynthSource(now, MidiBankNumber::fromZeroBase(1)).toString(),
+			FromFileSource("bank.syx", "/tmp/bank.syx", MidiProgramNumber::fromZeroBase(5)).toString(),
+			FromBulkImportSource(now, std::make_shared<FromFileSource>("bulk.syx", "/tmp/bulk.syx", MidiProgramNumber::fromZeroBase(7))).toString()
+		};
+		runner.run("sourceinfo_fromstring_100k", count, [&]() {
+			for (size_t i = 0; i < count; i++) {
+				sink = sink + (SourceInfo::fromString(strings[i % strings.size()]) ? 1 : 0);
+			}
+		});
+	}
+
+	void categorySetBenchmarks(BenchRunner &runner) {
+		auto all = BenchFixtures::categories();
+		Random random(4);
+		std::vector<std::set<Category>> sets;
+		for (int i = 0; i < 1000; i++) {
+			std::set<Category> s;
+			for (auto const &c : all) {
+				if (random.nextInt(4) == 0) s.insert(c);
+			}
+			sets.push_back(s);
+		}
+		const size_t count = 100000;
+		runner.run("category_union_100k", count, [&]() {
+			for (size_t i = 0; i < count; i++) {
+				sink = sink + category_union(sets[i % sets.size()], sets[(i + 1) % sets.size()]).size();
+			}
+		});
+		runner.run("category_intersection_100k", count, [&]() {
+			for (size_t i = 0; i < count; i++) {
+				sink = sink + category_intersection(sets[i % sets.size()], sets[(i + 1) % sets.size()]).size();
+			}
+		});
+		runner.run("category_difference_100k", count, [&]() {
+			for (size_t i = 0; i < count; i++) {
+				sink = sink + category_difference(sets[i % sets.size()], sets[(i + 1) % sets.size()]).size();
+			}
+		});
+	}
+
+	void exportBenchmarks(BenchRunner &runner, std::shared_ptr<BenchSynth> synth) {
+		auto library = BenchFixtures::createLibrary(synth, nullptr, 10000, 6);
+		auto directory = File::getSpecialLocation(File::tempDirectory).getNonexistentChildFile("bench-export", "");
+		directory.createDirectory();
+		runner.run("export_fanout_10k", library.size(), [&]() {
+			ExportPipeline pipeline;
+			pipeline.addSink(ExportPipeline::createSink(Librarian::ONE_FILE, Librarian::EDIT_BUFFER_DUMPS, directory.getChildFile("all.syx")));
+			pipeline.addSink(ExportPipeline::createSink(Librarian::ZIPPED_FILES, Librarian::EDIT_BUFFER_DUMPS, directory.getChildFile("all.zip")));
+			pipeline.addSink(ExportPipeline::createPatchInterchangeFormatSink(directory.getChildFile("all.json")));
+			sink = sink + (pipeline.run(library) ? 1 : 0);
+		});
+		directory.deleteRecursively();
+	}
+
+	void patchHolderBenchmarks(BenchRunner &runner, std::shared_ptr<BenchSynth> synth, std::shared_ptr<AutomaticCategory> detector) {
+		auto library = BenchFixtures::createLibrary(synth, detector, 100000, 5);
+		runner.run("patchholder_copy_100k", library.size(), [&]() {
+			std::vector<PatchHolder> copy = library;
+			sink = sink + copy.size();
+		});
+		std::vector<PatchHolder> selection(library.begin(), library.begin() + 5000);
+		std::string payload;
+		runner.run("drag_payload_encode_5k", selection.size(), [&]() {
+			payload = PatchHolder::createDragInfoString(selection);
+			sink = sink + payload.size();
+		});
+		runner.run("drag_payload_decode_5k", selection.size(), [&]() {
+			std::vector<PatchHolder::DragReference> references;
+			PatchHolder::dragReferencesFromString(payload, references);
+			sink = sink + references.size();
+		});
+	}
+
+}
+
+int main(int argc, char *argv[])
+{
+	ScopedJuceInitialiser_GUI juce;
+
+	StringArray args;
+	for (int i = 1; i < argc; i++) {
+		args.add(argv[i]);
+	}
+	BenchRunner runner(argument(args, "--filter", ""), std::stoi(argument(args, "--repetitions", "5")));
+	size_t maxSize = (size_t)std::stoul(argument(args, "--max-size", "100000"));
+
+	// Only records anything when built with MIDIKRAFT_LIBRARIAN_TRACING
+	auto traceFile = argument(args, "--trace", "");
+	Trace::instance().setEnabled(!traceFile.empty());
+
+	auto synth = std::make_shared<BenchSynth>("BenchSynth");
+	// Always the built-in rules, so results don't depend on the automatic_categories.jsonc of the machine
+	auto detector = std::make_shared<AutomaticCategory>(BenchFixtures::categories());
+	detector->loadFromString(BenchFixtures::categories(), AutomaticCategory::defaultJson());
+
+	categorizationBenchmarks(runner, synth, detector);
+	pifBenchmarks(runner, synth, detector, maxSize);
+	serializationBenchmarks(runner, synth);
+	sourceInfoBenchmarks(runner);
+	categorySetBenchmarks(runner);
+	exportBenchmarks(runner, synth);
+	patchHolderBenchmarks(runner, synth, detector);
+
+	nlohmann::json report = {
+		{ "label", argument(args, "--label", "") },
+		{ "timestamp", Time::getCurrentTime().toISO8601(true).toStdString() },
+		{ "results", runner.results() }
+	};
+	auto out = argument(args, "--out", "");
+	if (out.empty()) {
+		std::cout << report.dump(2) << std::endl;
+	}
+	else {
+		File(out).replaceWithText(report.dump(2));
+	}
+	if (!traceFile.empty()) {
+		Trace::instance().writeChromeTrace(traceFile);
+	}
+	return 0;
+}
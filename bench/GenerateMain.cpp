@@ -0,0 +1,89 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+// Writes deterministic synthetic libraries for scale tests of the loaders.
+//
+// Usage: midikraft-librarian-generate --out <file> [--format pif|syx|zip|mid] [--count <patches>] [--seed <n>] [--synths <n>]
+//                                     [--min-size <bytes>] [--max-size <bytes>] [--duplicates <rate>] [--near-duplicates <rate>]
+//                                     [--categorized <rate>] [--favorites <rate>] [--per-file <patches per zip entry>]
+//
+// The patches are for synths named "BenchSynth", "BenchSynth 2", ... which the BenchSynth class of the fixtures can load.
+
+#include "JuceHeader.h"
+
+#include "SyntheticLibrary.h"
+
+#include <iostream>
+
+using namespace midikraft;
+
+namespace {
+
+	std::string argument(StringArray const &args, String const &key, std::string const &defaultValue) {
+		int index = args.indexOf(key);
+		if (index >= 0 && index + 1 < args.size()) {
+			return args[index + 1].toStdString();
+		}
+		return defaultValue;
+	}
+
+}
+
+int main(int argc, char *argv[])
+{
+	ScopedJuceInitialiser_GUI juce;
+
+	StringArray args;
+	for (int i = 1; i < argc; i++) {
+		args.add(argv[i]);
+	}
+	auto out = argument(args, "--out", "");
+	if (out.empty()) {
+		std::cerr << "Usage: midikraft-librarian-generate --out <file> [--format pif|syx|zip|mid] [--count <patches>] [--seed <n>] ..." << std::endl;
+		return 1;
+	}
+
+	SyntheticLibraryOptions options;
+	try {
+		options.seed = std::stoll(argument(args, "--seed", "1"));
+		options.numberOfPatches = (size_t)std::stoull(argument(args, "--count", "1000"));
+		options.numberOfSynths = std::stoi(argument(args, "--synths", "1"));
+		options.minPayloadSize = (size_t)std::stoul(argument(args, "--min-size", std::to_string(options.minPayloadSize)));
+		options.maxPayloadSize = (size_t)std::stoul(argument(args, "--max-size", std::to_string(options.maxPayloadSize)));
+		options.duplicateRate = std::stod(argument(args, "--duplicates", std::to_string(options.duplicateRate)));
+		options.nearDuplicateRate = std::stod(argument(args, "--near-duplicates", std::to_string(options.nearDuplicateRate)));
+		options.userCategoryRate = std::stod(argument(args, "--categorized", std::to_string(options.userCategoryRate)));
+		options.favoriteRate = std::stod(argument(args, "--favorites", std::to_string(options.favoriteRate)));
+	}
+	catch (std::logic_error &e) {
+		std::cerr << "Invalid number in arguments: " << e.what() << std::endl;
+		return 1;
+	}
+
+	SyntheticLibrary library(options);
+	auto format = argument(args, "--format", "pif");
+	bool ok = false;
+	if (format == "pif") {
+		ok = library.writePatchInterchangeFormat(out);
+	}
+	else if (format == "syx") {
+		ok = library.writeSysexFile(out);
+	}
+	else if (format == "zip") {
+		ok = library.writeZipFile(out, (size_t)std::stoul(argument(args, "--per-file", "128")));
+	}
+	else if (format == "mid") {
+		ok = library.writeMidiFile(out);
+	}
+	else {
+		std::cerr << "Unknown format " << format << ", use one of pif, syx, zip, mid" << std::endl;
+		return 1;
+	}
+	if (ok) {
+		std::cerr << "Wrote " << options.numberOfPatches << " patches to " << out << std::endl;
+	}
+	return ok ? 0 : 2;
+}
@@ -0,0 +1,436 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "SyntheticLibrary.h"
+
+#include "JsonSerialization.h"
+#include "PatchInterchangeFormat.h"
+
+#include "Logger.h"
+
+// Turn off warning on unknown pragmas for VC++
+#pragma warning(push)
+#pragma warning(disable: 4068)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wzero-as-null-pointer-constant"
+#include "rapidjson/writer.h"
+#include "rapidjson/filewritestream.h"
+#pragma GCC diagnostic pop
+#pragma warning(pop)
+
+#include <boost/format.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+namespace {
+
+	struct CategoryVocabulary {
+		const char *category;
+		int weight; // Relative frequency in a typical library
+		const char *prefix; // Prefix used by some factory banks
+		std::vector<const char *> words;
+	};
+
+	std::vector<CategoryVocabulary> const &vocabulary() {
+		static std::vector<CategoryVocabulary> result = {
+			{ "Pad", 16, "PD ", { "Pad", "Strings", "Sweep", "Choir", "Str", "Bow" } },
+			{ "Lead", 14, "LD ", { "Lead", "Solo", "Sync", "Unison", "Screamer" } },
+			{ "Bass", 14, "BS ", { "Bass", "Sub Bass", "Moog Bass", "Acid Bass", "Bas" } },
+			{ "Keys", 9, "KBD:", { "Piano", "Rhodes", "Wurli", "Clav", "Keys" } },
+			{ "Brass", 5, "BRS:", { "Brass", "Horn", "Trumpet", "Sax" } },
+			{ "Organ", 5, "", { "Organ", "Hammond", "B3", "Church Organ" } },
+			{ "Arp", 6, "ARP:", { "Arp", "Sparp", "Arpeggio" } },
+			{ "Pluck", 6, "PLK:", { "Pluck", "Guitar", "Harp" } },
+			{ "Drone", 2, "DRO:", { "Drone" } },
+			{ "Drum", 5, "PRC:", { "Kick", "Snare", "Tom", "Perc", "Drum" } },
+			{ "Bell", 4, "CHR:", { "Bell", "Chime", "Tines" } },
+			{ "SFX", 6, "", { "Fx", "SFX", "Laser Fx" } },
+			{ "Ambient", 3, "AMB:", { "Space", "Atmosphere" } },
+			{ "Wind", 2, "", { "Flute", "Oboe", "Pan Flute" } },
+			{ "Voice", 3, "", { "Vox", "Voice", "Aahs" } },
+		};
+		return result;
+	}
+
+	std::vector<const char *> const &adjectives() {
+		static std::vector<const char *> result = { "Soft", "Dark", "Fat", "Bright", "Glass", "Warm", "Cold", "Deep", "Vintage", "Analog", "Digital", "Big", "Thin", "Wide", "Old", "New" };
+		return result;
+	}
+
+	// splitmix64, to get independent random sequences for neighbouring indexes
+	juce::int64 mix(juce::int64 seed, size_t index) {
+		juce::uint64 z = (juce::uint64)seed + 0x9e3779b97f4a7c15ULL * ((juce::uint64)index + 1);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return (juce::int64)(z ^ (z >> 31));
+	}
+
+	int nextIndex(juce::Random &random, size_t below) {
+		return random.nextInt((int)std::min(below, (size_t)std::numeric_limits<int>::max()));
+	}
+
+	void writeVariableLength(juce::OutputStream &out, size_t value) {
+		juce::uint8 bytes[10];
+		int count = 0;
+		do {
+			bytes[count++] = (juce::uint8)(value & 0x7f);
+			value >>= 7;
+		} while (value > 0);
+		while (count > 0) {
+			count--;
+			out.writeByte((char)(bytes[count] | (count > 0 ? 0x80 : 0)));
+		}
+	}
+
+	// Sysex of a range of patches, computed while it is read
+	class GeneratedSysexStream : public juce::InputStream {
+	public:
+		GeneratedSysexStream(std::function<std::vector<juce::uint8>(size_t)> generator, size_t first, size_t end) : generator_(generator), next_(first), end_(end), offset_(0), position_(0) {}
+
+		juce::int64 getTotalLength() override {
+			return -1;
+		}
+
+		bool isExhausted() override {
+			return offset_ >= current_.size() && next_ >= end_;
+		}
+
+		int read(void *destination, int maxBytes) override {
+			int done = 0;
+			while (done < maxBytes) {
+				if (offset_ >= current_.size()) {
+					if (next_ >= end_) break;
+					current_ = generator_(next_++);
+					offset_ = 0;
+				}
+				size_t chunk = std::min((size_t)(maxBytes - done), current_.size() - offset_);
+				memcpy(static_cast<char *>(destination) + done, current_.data() + offset_, chunk);
+				offset_ += chunk;
+				done += (int)chunk;
+			}
+			position_ += done;
+			return done;
+		}
+
+		juce::int64 getPosition() override {
+			return position_;
+		}
+
+		bool setPosition(juce::int64 newPosition) override {
+			// Only forward reading is supported
+			return newPosition == position_;
+		}
+
+	private:
+		std::function<std::vector<juce::uint8>(size_t)> generator_;
+		size_t next_;
+		size_t end_;
+		std::vector<juce::uint8> current_;
+		size_t offset_;
+		juce::int64 position_;
+	};
+
+}
+
+namespace midikraft {
+
+	SyntheticLibrary::SyntheticLibrary(SyntheticLibraryOptions const &options) : options_(options)
+	{
+		options_.numberOfSynths = std::max(1, options_.numberOfSynths);
+		options_.minPayloadSize = std::max(options_.minPayloadSize, BenchPatch::kHeaderSize + 1);
+		options_.maxPayloadSize = std::max(options_.maxPayloadSize, options_.minPayloadSize);
+		Random random(options_.seed);
+		for (int i = 0; i < options_.numberOfSynths; i++) {
+			payloadSizes_.push_back(options_.minPayloadSize + (size_t)random.nextInt((int)(options_.maxPayloadSize - options_.minPayloadSize + 1)));
+		}
+	}
+
+	std::string SyntheticLibrary::synthName(int synthIndex)
+	{
+		return synthIndex == 0 ? "BenchSynth" : (boost::format("BenchSynth %d") % (synthIndex + 1)).str();
+	}
+
+	SyntheticPatch SyntheticLibrary::original(size_t index) const
+	{
+		Random random(mix(options_.seed, index));
+		int synthIndex = random.nextInt(options_.numberOfSynths);
+
+		// Pick a category by weight, and build a name that more or less hints at it
+		auto const &vocab = vocabulary();
+		int totalWeight = 0;
+		for (auto const &v : vocab) totalWeight += v.weight;
+		int pick = random.nextInt(totalWeight);
+		size_t c = 0;
+		while (pick >= vocab[c].weight) {
+			pick -= vocab[c].weight;
+			c++;
+		}
+		auto const &category = vocab[c];
+		std::string word = category.words[(size_t)nextIndex(random, category.words.size())];
+		std::string name;
+		int style = random.nextInt(10);
+		if (style == 0) {
+			// Names without any hint, these stay uncategorized
+			name = (boost::format("Patch %d") % (1 + random.nextInt(999))).str();
+		}
+		else if (style < 4 && *category.prefix) {
+			name = std::string(category.prefix) + word;
+		}
+		else {
+			name = std::string(adjectives()[(size_t)nextIndex(random, adjectives().size())]) + " " + word;
+		}
+		if (random.nextInt(4) == 0) {
+			name += " " + std::to_string(1 + random.nextInt(9));
+		}
+		name = name.substr(0, BenchPatch::kNameLength);
+
+		SyntheticPatch result;
+		result.synthName = synthName(synthIndex);
+		result.name = name;
+		result.data = BenchSynth::createPatchData(name, payloadSizes_[(size_t)synthIndex] - BenchPatch::kHeaderSize, random);
+		result.bank = (int)((index / 128) % 8);
+		result.program = (int)(index % 128);
+		result.favorite = random.nextDouble() < options_.favoriteRate;
+		if (random.nextDouble() < options_.userCategoryRate) {
+			result.categories.push_back(category.category);
+			if (random.nextInt(5) == 0) {
+				auto const &second = vocab[(size_t)nextIndex(random, vocab.size())];
+				if (second.category != category.category) {
+					result.categories.push_back(second.category);
+				}
+			}
+		}
+
+		// The mix of sources a library collected over a few years has
+		Time timestamp = Time(2015, 0, 1, 0, 0) + RelativeTime::seconds((double)random.nextInt(7 * 365 * 24 * 3600));
+		auto program = MidiProgramNumber::fromZeroBase(result.program);
+		auto fileSource = std::make_shared<FromFileSource>(result.synthName + ".syx", "/synthetic/" + result.synthName + ".syx", program);
+		switch (random.nextInt(4)) {
+		case 0: result.sourceInfo = std::make_shared<FromSynthSource>(timestamp); break;
+		case 1: result.sourceInfo = std::make_shared<FromSynthSource>(timestamp, MidiBankNumber::fromZeroBase(result.bank)); break;
+		case 2: result.sourceInfo = fileSource; break;
+		default: result.sourceInfo = std::make_shared<FromBulkImportSource>(timestamp, fileSource); break;
+		}
+		return result;
+	}
+
+	SyntheticPatch SyntheticLibrary::patch(size_t index) const
+	{
+		Random random(mix(~options_.seed, index));
+		double roll = random.nextDouble();
+		if (index > 0 && roll < options_.duplicateRate + options_.nearDuplicateRate) {
+			auto result = original((size_t)nextIndex(random, index));
+			if (roll >= options_.duplicateRate) {
+				// Near duplicate - a few parameters tweaked, and often renamed
+				int changes = 1 + random.nextInt(3);
+				size_t parameters = result.data.size() - BenchPatch::kHeaderSize;
+				for (int i = 0; i < changes && parameters > 0; i++) {
+					result.data[BenchPatch::kHeaderSize + (size_t)nextIndex(random, parameters)] = (uint8)random.nextInt(128);
+				}
+				if (random.nextBool()) {
+					result.name = (result.name.substr(0, BenchPatch::kNameLength - 2) + " " + std::to_string(2 + random.nextInt(8)));
+					for (size_t i = 0; i < BenchPatch::kNameLength; i++) {
+						result.data[BenchPatch::kNameOffset + i] = i < result.name.size() ? (uint8)result.name[i] : 0;
+					}
+				}
+			}
+			result.bank = (int)((index / 128) % 8);
+			result.program = (int)(index % 128);
+			return result;
+		}
+		return original(index);
+	}
+
+	void SyntheticLibrary::forEach(std::function<void(size_t index, SyntheticPatch const &patch)> visitor) const
+	{
+		for (size_t i = 0; i < options_.numberOfPatches; i++) {
+			visitor(i, patch(i));
+		}
+	}
+
+	PatchHolder SyntheticLibrary::toPatchHolder(SyntheticPatch const &patch, std::map<std::string, std::shared_ptr<BenchSynth>> const &synths, std::shared_ptr<AutomaticCategory> detector) const
+	{
+		auto synth = synths.find(patch.synthName);
+		if (synth == synths.end()) {
+			jassertfalse;
+			return PatchHolder();
+		}
+		auto program = MidiProgramNumber::fromZeroBase(patch.program);
+		auto bank = MidiBankNumber::fromZeroBase(patch.bank);
+		PatchHolder holder(synth->second, patch.sourceInfo, std::make_shared<BenchPatch>(patch.data, program), bank, program, detector);
+		holder.setFavorite(Favorite(patch.favorite));
+		for (auto const &category : BenchFixtures::categories()) {
+			if (std::find(patch.categories.begin(), patch.categories.end(), category.category()) != patch.categories.end()) {
+				holder.setCategory(category, true);
+				holder.setUserDecision(category);
+			}
+		}
+		return holder;
+	}
+
+	std::vector<uint8> SyntheticLibrary::sysexMessage(SyntheticPatch const &patch)
+	{
+		std::vector<uint8> message;
+		message.reserve(patch.data.size() + 2);
+		message.push_back(0xf0);
+		message.insert(message.end(), patch.data.begin(), patch.data.end());
+		message.push_back(0xf7);
+		return message;
+	}
+
+	bool SyntheticLibrary::writePatchInterchangeFormat(std::string const &filename) const
+	{
+		// Streaming writer, the document for a million patches would not fit into memory comfortably
+#if WIN32
+		FILE *fp;
+		if (fopen_s(&fp, filename.c_str(), "wb") != 0) fp = nullptr;
+#else
+		FILE *fp = fopen(filename.c_str(), "w");
+#endif
+		if (!fp) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to open file %s to write synthetic library to") % filename).str());
+			return false;
+		}
+		char writeBuffer[65536];
+		rapidjson::FileWriteStream os(fp, writeBuffer, sizeof(writeBuffer));
+		rapidjson::Writer<rapidjson::FileWriteStream> writer(os);
+		using namespace PatchInterchangeFormatFields;
+		writer.StartObject();
+		writer.Key(kHeader);
+		writer.StartObject();
+		writer.Key(kFileFormat);
+		writer.String(kPIF);
+		writer.Key(kVersion);
+		writer.Int(1);
+		writer.EndObject();
+		writer.Key(kLibrary);
+		writer.StartArray();
+		forEach([&writer](size_t, SyntheticPatch const &patch) {
+			writer.StartObject();
+			writer.Key(kSynth);
+			writer.String(patch.synthName.c_str());
+			writer.Key(kName);
+			writer.String(patch.name.c_str());
+			writer.Key(kFavorite);
+			writer.Int(patch.favorite ? 1 : 0);
+			writer.Key(kPlace);
+			writer.Int(patch.program);
+			if (!patch.categories.empty()) {
+				writer.Key(kCategories);
+				writer.StartArray();
+				for (auto const &category : patch.categories) {
+					writer.String(category.c_str());
+				}
+				writer.EndArray();
+			}
+			if (patch.sourceInfo) {
+				auto json = patch.sourceInfo->toString();
+				writer.Key(kSourceInfo);
+				writer.RawValue(json.c_str(), json.size(), rapidjson::kObjectType);
+			}
+			writer.Key(kSysex);
+			writer.String(JsonSerialization::dataToString(sysexMessage(patch)).c_str());
+			writer.EndObject();
+		});
+		writer.EndArray();
+		writer.EndObject();
+		os.Flush();
+		bool ok = ferror(fp) == 0;
+		ok = fclose(fp) == 0 && ok;
+		if (!ok) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to write synthetic library to %s") % filename).str());
+		}
+		return ok;
+	}
+
+	bool SyntheticLibrary::writeSysexFile(std::string const &filename) const
+	{
+		File file(filename);
+		file.deleteFile();
+		FileOutputStream out(file, 1 << 20);
+		if (!out.openedOk()) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to open file %s to write synthetic sysex to") % filename).str());
+			return false;
+		}
+		forEach([&out](size_t, SyntheticPatch const &patch) {
+			auto message = sysexMessage(patch);
+			out.write(message.data(), message.size());
+		});
+		out.flush();
+		return out.getStatus().wasOk();
+	}
+
+	bool SyntheticLibrary::writeZipFile(std::string const &filename, size_t patchesPerFile) const
+	{
+		// Each entry generates its patches only when the builder reads it, so at most one (compressed) entry is in memory
+		patchesPerFile = std::max((size_t)1, patchesPerFile);
+		auto generator = [this](size_t index) { return sysexMessage(patch(index)); };
+		ZipFile::Builder builder;
+		int entry = 0;
+		for (size_t first = 0; first < options_.numberOfPatches; first += patchesPerFile) {
+			entry++;
+			size_t end = std::min(options_.numberOfPatches, first + patchesPerFile);
+			builder.addEntry(new GeneratedSysexStream(generator, first, end), 9, String((boost::format("synthetic_%05d.syx") % entry).str()), Time(2022, 0, 1, 12, 0));
+		}
+
+		File file(filename);
+		file.deleteFile();
+		FileOutputStream out(file, 1 << 20);
+		if (!out.openedOk() || !builder.writeToStream(out, nullptr)) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to write synthetic ZIP file %s") % filename).str());
+			return false;
+		}
+		out.flush();
+		return out.getStatus().wasOk();
+	}
+
+	bool SyntheticLibrary::writeMidiFile(std::string const &filename) const
+	{
+		// Written by hand instead of with juce::MidiFile, which needs the whole sequence in memory. Same header as the MIDI file
+		// export writes (format 1 with one track, 96 ticks per quarter note), but the sysex messages are 10 ticks apart instead of
+		// all at time 0.
+		File file(filename);
+		file.deleteFile();
+		FileOutputStream out(file, 1 << 20);
+		if (!out.openedOk()) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to write synthetic MIDI file %s") % filename).str());
+			return false;
+		}
+		out.write("MThd", 4);
+		out.writeIntBigEndian(6);
+		out.writeShortBigEndian(1); // Format 1, one track
+		out.writeShortBigEndian(1);
+		out.writeShortBigEndian(96);
+		out.write("MTrk", 4);
+		auto lengthPosition = out.getPosition();
+		out.writeIntBigEndian(0); // Patched below
+		auto trackStart = out.getPosition();
+		forEach([&out](size_t index, SyntheticPatch const &patch) {
+			writeVariableLength(out, index == 0 ? 0 : 10);
+			out.writeByte((char)0xf0);
+			writeVariableLength(out, patch.data.size() + 1);
+			out.write(patch.data.data(), patch.data.size());
+			out.writeByte((char)0xf7);
+		});
+		const uint8 endOfTrack[] = { 0x00, 0xff, 0x2f, 0x00 };
+		out.write(endOfTrack, sizeof(endOfTrack));
+		auto trackLength = out.getPosition() - trackStart;
+		if (trackLength > (int64)std::numeric_limits<uint32>::max()) {
+			SimpleLogger::instance()->postMessage((boost::format("Synthetic library too big for a MIDI file %s") % filename).str());
+			return false;
+		}
+		if (!out.setPosition(lengthPosition)) {
+			SimpleLogger::instance()->postMessage((boost::format("Failure to write synthetic MIDI file %s") % filename).str());
+			return false;
+		}
+		out.writeIntBigEndian((int)(uint32)trackLength);
+		out.flush();
+		return out.getStatus().wasOk();
+	}
+
+}
@@ -0,0 +1,69 @@
+/*
+   Copyright (c) 2022 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "BenchFixtures.h"
+
+namespace midikraft {
+
+	struct SyntheticLibraryOptions {
+		int64 seed = 1;
+		size_t numberOfPatches = 1000;
+		int numberOfSynths = 1; // Named "BenchSynth", "BenchSynth 2", ...
+		size_t minPayloadSize = 64; // Each synth gets a fixed patch size between min and max, like real synths
+		size_t maxPayloadSize = 512;
+		double duplicateRate = 0.05; // Exact copy of an earlier patch
+		double nearDuplicateRate = 0.05; // Copy of an earlier patch with a few parameters changed
+		double userCategoryRate = 0.3; // Patches with categories decided by the user
+		double favoriteRate = 0.1;
+	};
+
+	// PatchHolder equivalent, but cheap enough to stream millions of them
+	struct SyntheticPatch {
+		std::string synthName;
+		std::string name;
+		Synth::PatchData data; // Sysex payload as understood by the BenchSynth, without F0 and F7
+		int bank;
+		int program;
+		bool favorite;
+		std::vector<std::string> categories;
+		std::shared_ptr<SourceInfo> sourceInfo;
+	};
+
+	// Deterministic generator for synthetic libraries to test import, export and categorization at scale.
+	//
+	// Each patch is computed from the seed and its index only, so the same options always give the same library, and
+	// patches are generated on the fly while writing instead of holding millions of them in memory. All writers stream, the ZIP
+	// writer keeps one compressed entry in memory at a time.
+	class SyntheticLibrary {
+	public:
+		SyntheticLibrary(SyntheticLibraryOptions const &options);
+
+		static std::string synthName(int synthIndex);
+		SyntheticPatch patch(size_t index) const;
+		void forEach(std::function<void(size_t index, SyntheticPatch const &patch)> visitor) const;
+
+		// Creates real PatchHolders, the synths map needs a BenchSynth for every synth name
+		PatchHolder toPatchHolder(SyntheticPatch const &patch, std::map<std::string, std::shared_ptr<BenchSynth>> const &synths, std::shared_ptr<AutomaticCategory> detector) const;
+
+		// Writers for each format the librarian can import
+		bool writePatchInterchangeFormat(std::string const &filename) const;
+		bool writeSysexFile(std::string const &filename) const;
+		bool writeZipFile(std::string const &filename, size_t patchesPerFile) const;
+		bool writeMidiFile(std::string const &filename) const;
+
+	private:
+		SyntheticPatch original(size_t index) const;
+		static std::vector<uint8> sysexMessage(SyntheticPatch const &patch);
+
+		SyntheticLibraryOptions options_;
+		std::vector<size_t> payloadSizes_; // Per synth
+	};
+
+}